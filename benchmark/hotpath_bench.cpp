@@ -0,0 +1,298 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <boost/json.hpp>
+#include <boost/json/src.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <opencv2/opencv.hpp>
+#include <random>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "facedetect_result.hpp"
+#include "openpose_result.hpp"
+#include "options.hpp"
+#include "spsc_ring.hpp"
+
+// 1つのケースを計測し続ける最小の時間
+#define DEFAULT_MIN_TIME_S 0.5
+// キューの受け渡しで1回の計測に流す要素数
+#define HANDOFF_ITEMS 100000
+#define HANDOFF_CAPACITY 64
+
+struct BenchResult {
+    std::string name;
+    std::size_t iterations;
+    double ns_per_op;
+    // 1回あたりに処理するバイト数(0なら表示しない)
+    std::size_t bytes_per_op;
+};
+
+// 繰り返し回数を倍にしながら、min_time以上かかるまで計測する
+class BenchRunner {
+  public:
+    BenchRunner(double min_time, std::string filter)
+        : min_time_(min_time), filter_(std::move(filter)) {}
+
+    // fは1回でitems回分の処理をする。結果は1回分の時間で表す
+    void run(const std::string &name, const std::function<void()> &f,
+             std::size_t bytes_per_op = 0, std::size_t items = 1) {
+        if (name.find(filter_) == std::string::npos) {
+            return;
+        }
+        f();
+        std::size_t iterations = 1;
+        while (true) {
+            auto start = std::chrono::steady_clock::now();
+            for (std::size_t i = 0; i < iterations; ++i) {
+                f();
+            }
+            std::chrono::duration<double> elapsed =
+                std::chrono::steady_clock::now() - start;
+            if (elapsed.count() >= min_time_) {
+                std::size_t ops = iterations * items;
+                results_.push_back({name, ops, elapsed.count() * 1e9 / ops,
+                                    bytes_per_op});
+                return;
+            }
+            iterations *= 2;
+        }
+    }
+
+    const std::vector<BenchResult> &results() const { return results_; }
+
+  private:
+    double min_time_;
+    std::string filter_;
+    std::vector<BenchResult> results_;
+};
+
+// 最適化で計算が消えないように結果を使う
+template <typename T> void keep(const T &value) {
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+vitis::ai::OpenPoseResult make_pose_result(int persons, std::mt19937 &rng) {
+    std::uniform_real_distribution<float> coord(0.0f, 368.0f);
+    vitis::ai::OpenPoseResult result;
+    result.width = OPENPOSE_INPUT_WIDTH;
+    result.height = OPENPOSE_INPUT_HEIGHT;
+    for (int n = 0; n < persons; ++n) {
+        std::vector<vitis::ai::OpenPoseResult::PosePoint> pose(
+            OPENPOSE_NUM_POINTS);
+        for (auto &point : pose) {
+            point.type = rng() % 4 != 0;
+            point.point = cv::Point2f(coord(rng), coord(rng));
+        }
+        result.poses.push_back(pose);
+    }
+    return result;
+}
+
+vitis::ai::FaceDetectResult make_face_result(int faces, std::mt19937 &rng) {
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    vitis::ai::FaceDetectResult result;
+    result.width = DENSEBOX_INPUT_WIDTH;
+    result.height = DENSEBOX_INPUT_HEIGHT;
+    for (int n = 0; n < faces; ++n) {
+        result.rects.push_back({unit(rng) * 0.9f, unit(rng) * 0.9f,
+                                unit(rng) * 0.1f, unit(rng) * 0.1f,
+                                unit(rng)});
+    }
+    return result;
+}
+
+// 平滑化したノイズで、JPEGの圧縮率が実際のカメラ画像に近くなるようにする
+cv::Mat make_image(const cv::Size &size) {
+    cv::Mat image(size, CV_8UC3);
+    cv::randu(image, cv::Scalar::all(0), cv::Scalar::all(256));
+    cv::GaussianBlur(image, image, cv::Size(5, 5), 0);
+    return image;
+}
+
+// サーバの結果の変換と、クライアントでのJSONの解析
+template <typename Result>
+void bench_result(BenchRunner &runner, const std::string &model,
+                  const std::string &unit, const Result &result) {
+    std::string json = result_to_json_string(result);
+    runner.run(model + "/to_json/" + unit, [&result] {
+        keep(result_to_json_string(result));
+    }, json.size());
+    SessionOptions binary;
+    binary.result_format = RESULT_FORMAT_BINARY;
+    runner.run(model + "/to_binary/" + unit, [&result, &binary] {
+        keep(serialize_result(result, binary));
+    });
+    runner.run(model + "/json_parse/" + unit,
+               [&json] { keep(boost::json::parse(json)); }, json.size());
+}
+
+// client.cppと同じ品質でのエンコードと、サーバでのデコード
+void bench_jpeg(BenchRunner &runner, const cv::Size &size, int quality) {
+    cv::Mat image = make_image(size);
+    std::string label = std::to_string(size.width) + "x" +
+                        std::to_string(size.height) + "/q" +
+                        std::to_string(quality);
+    std::vector<uchar> encoded;
+    cv::imencode(".jpg", image, encoded, {cv::IMWRITE_JPEG_QUALITY, quality});
+    runner.run("jpeg/imencode/" + label, [&image, &encoded, quality] {
+        cv::imencode(".jpg", image, encoded,
+                     {cv::IMWRITE_JPEG_QUALITY, quality});
+    }, image.total() * image.elemSize());
+    cv::Mat decoded;
+    runner.run("jpeg/imdecode/" + label, [&encoded, &decoded] {
+        cv::imdecode(encoded, cv::IMREAD_COLOR, &decoded);
+    }, encoded.size());
+}
+
+void bench_resize(BenchRunner &runner, const cv::Size &from,
+                  const cv::Size &to) {
+    cv::Mat image = make_image(from);
+    cv::Mat resized;
+    runner.run("resize/" + std::to_string(from.width) + "x" +
+                   std::to_string(from.height) + "->" +
+                   std::to_string(to.width) + "x" + std::to_string(to.height),
+               [&image, &resized, &to] { cv::resize(image, resized, to); },
+               image.total() * image.elemSize());
+}
+
+// SpscRingに置き換える前の、mutexと条件変数による有界キュー
+template <typename T> class LockedQueue {
+  public:
+    explicit LockedQueue(std::size_t capacity) : capacity_(capacity) {}
+
+    void push(T value) {
+        std::unique_lock<std::mutex> lock(mtx_);
+        not_full_.wait(lock, [this] { return queue_.size() < capacity_; });
+        queue_.push_back(std::move(value));
+        lock.unlock();
+        not_empty_.notify_one();
+    }
+
+    void pop(T &value) {
+        std::unique_lock<std::mutex> lock(mtx_);
+        not_empty_.wait(lock, [this] { return !queue_.empty(); });
+        value = std::move(queue_.front());
+        queue_.pop_front();
+        lock.unlock();
+        not_full_.notify_one();
+    }
+
+  private:
+    std::size_t capacity_;
+    std::deque<T> queue_;
+    std::mutex mtx_;
+    std::condition_variable not_empty_;
+    std::condition_variable not_full_;
+};
+
+// 2つのスレッドの間でHANDOFF_ITEMS個の要素を受け渡す
+template <typename Queue> void handoff(Queue &queue) {
+    std::thread producer([&queue] {
+        for (int i = 0; i < HANDOFF_ITEMS; ++i) {
+            queue.push(i);
+        }
+    });
+    int value;
+    for (int i = 0; i < HANDOFF_ITEMS; ++i) {
+        queue.pop(value);
+    }
+    producer.join();
+}
+
+void bench_handoff(BenchRunner &runner) {
+    runner.run("queue/spsc_ring", [] {
+        SpscRing<int> ring(HANDOFF_CAPACITY);
+        handoff(ring);
+    }, 0, HANDOFF_ITEMS);
+    runner.run("queue/mutex_condvar", [] {
+        LockedQueue<int> queue(HANDOFF_CAPACITY);
+        handoff(queue);
+    }, 0, HANDOFF_ITEMS);
+}
+
+std::string json_escape(const std::string &s) {
+    return boost::json::serialize(boost::json::value(s));
+}
+
+void print_table(const std::vector<BenchResult> &results) {
+    printf("%-36s %12s %14s %10s\n", "name", "iterations", "ns/op", "MB/s");
+    for (const auto &r : results) {
+        printf("%-36s %12zu %14.1f", r.name.c_str(), r.iterations,
+               r.ns_per_op);
+        if (r.bytes_per_op > 0) {
+            printf(" %10.1f", r.bytes_per_op * 1e3 / r.ns_per_op);
+        }
+        printf("\n");
+    }
+}
+
+// ボードごとの結果を比較できるよう、実行環境も一緒に出力する
+void print_json(const std::vector<BenchResult> &results) {
+    char hostname[256] = "";
+    gethostname(hostname, sizeof(hostname) - 1);
+    printf("{\n  \"context\": {\"host\": %s, \"threads\": %u, "
+           "\"compiler\": %s, \"opencv\": %s},\n  \"benchmarks\": [",
+           json_escape(hostname).c_str(), std::thread::hardware_concurrency(),
+           json_escape(__VERSION__).c_str(),
+           json_escape(cv::getVersionString()).c_str());
+    for (std::size_t i = 0; i < results.size(); ++i) {
+        const BenchResult &r = results[i];
+        printf("%s\n    {\"name\": %s, \"iterations\": %zu, \"ns_per_op\": "
+               "%.1f, \"bytes_per_op\": %zu}",
+               i == 0 ? "" : ",", json_escape(r.name).c_str(), r.iterations,
+               r.ns_per_op, r.bytes_per_op);
+    }
+    printf("\n  ]\n}\n");
+}
+
+int main(int argc, char *argv[]) {
+    Options options(argc, argv);
+    BenchRunner runner(options.get_double("min-time", DEFAULT_MIN_TIME_S),
+                       options.get("filter", ""));
+    std::mt19937 rng(1);
+
+    for (int persons : {1, 4, 8}) {
+        bench_result(runner, "pose", std::to_string(persons) + "persons",
+                     make_pose_result(persons, rng));
+    }
+    for (int faces : {1, 8, 32}) {
+        bench_result(runner, "face", std::to_string(faces) + "faces",
+                     make_face_result(faces, rng));
+    }
+    bench_jpeg(runner, cv::Size(368, 368), 80);
+    bench_jpeg(runner, cv::Size(640, 360), 85);
+    for (const cv::Size &from : {cv::Size(1280, 720), cv::Size(1920, 1080)}) {
+        bench_resize(runner, from, cv::Size(368, 368));
+        bench_resize(runner, from, cv::Size(640, 360));
+    }
+    bench_handoff(runner);
+
+    if (options.get("format", "table") == "json") {
+        print_json(runner.results());
+    } else {
+        print_table(runner.results());
+    }
+    return 0;
+}
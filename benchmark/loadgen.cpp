@@ -0,0 +1,448 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <array>
+#include <boost/asio.hpp>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <opencv2/opencv.hpp>
+#include <poll.h>
+#include <thread>
+#include <vector>
+
+#include "frame_codec.hpp"
+#include "image_archive.hpp"
+#include "options.hpp"
+#include "protocol.hpp"
+#include "stage_stats.hpp"
+
+#define DEFAULT_CONNECTIONS 1
+#define DEFAULT_DURATION_S 10
+#define DEFAULT_WARMUP_S 1
+#define DEFAULT_WINDOW 4
+#define DEFAULT_FPS 30
+#define DEFAULT_PRELOAD 100
+#define JPEG_QUALITY 80
+// 結果がこの時間届かなければ、残りは失われたものとして終了する
+#define RECV_TIMEOUT_MS 5000
+
+using Clock = std::chrono::steady_clock;
+using Socket = boost::asio::generic::stream_protocol::socket;
+
+// 負荷のかけ方
+struct LoadConfig {
+    // trueなら一定のフレームレートで送る(開ループ)。
+    // falseなら結果を待っているフレームがwindow個になるまで送る(閉ループ)
+    bool open_loop = false;
+    // 開ループでの全接続の合計のフレームレート
+    double fps = DEFAULT_FPS;
+    std::size_t window = DEFAULT_WINDOW;
+    std::size_t connections = DEFAULT_CONNECTIONS;
+    // 送信を始めた時刻。start + warmupより前に送ったフレームは集計しない
+    Clock::time_point start;
+    Clock::time_point measure_from;
+    Clock::time_point end;
+    // 複数モデルのサーバに送るFrameRequest(count = 0なら送らない)
+    FrameRequest request;
+};
+
+struct Connection {
+    explicit Connection(Socket sock) : socket(std::move(sock)) {}
+
+    Socket socket;
+    SessionOptions options;
+    // 閉ループで結果を待っているフレームの数を送信側に知らせる
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::size_t in_flight = 0;
+    bool sending_done = false;
+    bool receiving_done = false;
+    std::size_t sent = 0;
+    std::size_t received = 0;
+    std::size_t dropped = 0;
+    // 計測区間に届いた結果
+    std::size_t measured = 0;
+    // フレームIDを使えないサーバでは、結果は送った順に届くものとして対応を取る
+    std::deque<std::int64_t> send_times;
+};
+
+// 全接続の送信から結果の受信までの遅延(マイクロ秒)
+LatencyHistogram latency;
+
+std::int64_t to_us(Clock::time_point time) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               time.time_since_epoch())
+        .count();
+}
+
+bool is_jpeg(const char *data, std::size_t size) {
+    return size >= 2 && std::uint8_t(data[0]) == 0xff &&
+           std::uint8_t(data[1]) == 0xd8;
+}
+
+// 動画かアーカイブの先頭からcount枚を読み込み、送る形式に変換しておく。
+// 計測中に読み込みやエンコードのCPU時間がかからないようにする
+std::vector<std::vector<uchar>> preload_frames(const std::string &video_file,
+                                               std::size_t count,
+                                               const SessionOptions &options,
+                                               cv::Size size) {
+    std::unique_ptr<ImageArchive> archive;
+    cv::VideoCapture cap;
+    if (is_image_archive(video_file)) {
+        archive = std::make_unique<ImageArchive>(video_file);
+    } else {
+        cap.open(video_file);
+        if (!cap.isOpened()) {
+            throw std::runtime_error("cannot open " + video_file);
+        }
+    }
+    FrameEncoder encoder(options, JPEG_QUALITY);
+    std::vector<std::vector<uchar>> frames;
+    cv::Mat frame;
+    while (frames.size() < count) {
+        if (archive) {
+            std::size_t i = frames.size();
+            if (i == archive->count()) {
+                break;
+            }
+            const char *data = archive->data(i);
+            std::size_t data_size = archive->size(i);
+            // JPEGのまま送れるものはデコードせずにそのまま使う
+            if (options.frame_format == FRAME_FORMAT_JPEG && size.empty() &&
+                is_jpeg(data, data_size)) {
+                frames.emplace_back(data, data + data_size);
+                continue;
+            }
+            cv::Mat buf(1, data_size, CV_8UC1, const_cast<char *>(data));
+            frame = cv::imdecode(buf, cv::IMREAD_COLOR);
+        } else {
+            cap >> frame;
+        }
+        if (frame.empty()) {
+            break;
+        }
+        if (!size.empty() && frame.size() != size) {
+            cv::resize(frame, frame, size);
+        }
+        frames.emplace_back();
+        encoder.encode(frame, frames.back());
+    }
+    if (frames.empty()) {
+        throw std::runtime_error("no frames in " + video_file);
+    }
+    return frames;
+}
+
+void send_frame(Connection &conn, const std::vector<uchar> &frame,
+                const LoadConfig &config, std::int64_t timestamp_us) {
+    FrameHeader header;
+    header.seq = conn.sent;
+    header.timestamp_us = timestamp_us;
+    bool frame_ids = has_frame_header(conn.options, FRAME_HEADER_SEQUENCE);
+    bool request = has_frame_header(conn.options, FRAME_HEADER_REQUEST);
+    std::size_t frame_size = (frame_ids ? sizeof(header) : 0) +
+                             (request ? sizeof(FrameRequest) : 0) +
+                             frame.size();
+    std::array<boost::asio::const_buffer, 4> buffers = {
+        boost::asio::buffer(&frame_size, sizeof(std::size_t)),
+        boost::asio::buffer(&header, frame_ids ? sizeof(header) : 0),
+        boost::asio::buffer(&config.request,
+                            request ? sizeof(FrameRequest) : 0),
+        boost::asio::buffer(frame)};
+    {
+        std::lock_guard<std::mutex> lock(conn.mtx);
+        ++conn.sent;
+        ++conn.in_flight;
+        if (!frame_ids) {
+            conn.send_times.push_back(timestamp_us);
+        }
+    }
+    boost::asio::write(conn.socket, buffers);
+}
+
+// indexは接続の番号。開ループでは接続ごとに送る時刻をずらす
+void send_frames(Connection &conn, std::size_t index,
+                 const std::vector<std::vector<uchar>> &frames,
+                 const LoadConfig &config) {
+    std::size_t next_frame = index * frames.size() / config.connections;
+    auto interval = std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(config.connections / config.fps));
+    auto next = config.start + interval * index / config.connections;
+    try {
+        while (true) {
+            Clock::time_point timestamp;
+            if (config.open_loop) {
+                // 予定の時刻を送信時刻とするので、送信が詰まった分も遅延に含まれる
+                std::this_thread::sleep_until(next);
+                timestamp = next;
+                next += interval;
+            } else {
+                std::unique_lock<std::mutex> lock(conn.mtx);
+                conn.cv.wait(lock, [&conn, &config] {
+                    return conn.receiving_done ||
+                           conn.in_flight < config.window;
+                });
+                if (conn.receiving_done) {
+                    break;
+                }
+                timestamp = Clock::now();
+            }
+            if (timestamp >= config.end) {
+                break;
+            }
+            send_frame(conn, frames[next_frame], config, to_us(timestamp));
+            next_frame = (next_frame + 1) % frames.size();
+        }
+    } catch (const std::exception &e) {
+        std::cerr << "Error while sending frame: " << e.what() << std::endl;
+    }
+    std::lock_guard<std::mutex> lock(conn.mtx);
+    conn.sending_done = true;
+}
+
+// 結果が届くまでtimeout_msだけ待つ。asioのreadはSO_RCVTIMEOで戻った
+// 読み込みをやり直してしまうので、読み込む前にpollで待つ
+bool wait_readable(Connection &conn, int timeout_ms) {
+    pollfd fd = {conn.socket.native_handle(), POLLIN, 0};
+    int ready;
+    do {
+        ready = ::poll(&fd, 1, timeout_ms);
+    } while (ready < 0 && errno == EINTR);
+    return ready != 0;
+}
+
+void receive(Connection &conn, const LoadConfig &config) {
+    bool frame_ids = has_frame_header(conn.options, FRAME_HEADER_SEQUENCE);
+    std::string result;
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(conn.mtx);
+            if (conn.sending_done &&
+                conn.received + conn.dropped == conn.sent) {
+                return;
+            }
+        }
+        // 結果が届かなくなったら終了する。届かなかったフレームは失ったものとして
+        // 数える(sent - received - dropped)
+        if (!wait_readable(conn, RECV_TIMEOUT_MS)) {
+            std::lock_guard<std::mutex> lock(conn.mtx);
+            std::cerr << "Timed out waiting for "
+                      << conn.sent - conn.received - conn.dropped
+                      << " results" << std::endl;
+            return;
+        }
+        boost::system::error_code error;
+        std::size_t result_size;
+        boost::asio::read(
+            conn.socket, boost::asio::buffer(&result_size, sizeof(result_size)),
+            error);
+        if (!error) {
+            result.resize(result_size);
+            boost::asio::read(conn.socket, boost::asio::buffer(result), error);
+        }
+        if (error) {
+            std::cerr << "Error while receiving result: " << error.message()
+                      << std::endl;
+            return;
+        }
+        auto now = Clock::now();
+        FrameHeader header;
+        std::lock_guard<std::mutex> lock(conn.mtx);
+        if (frame_ids) {
+            if (result.size() < sizeof(header)) {
+                std::cerr << "Invalid frame header" << std::endl;
+                return;
+            }
+            std::memcpy(&header, result.data(), sizeof(header));
+        } else if (!conn.send_times.empty()) {
+            header.timestamp_us = conn.send_times.front();
+            conn.send_times.pop_front();
+        }
+        --conn.in_flight;
+        if (header.flags & FRAME_FLAG_DROPPED) {
+            ++conn.dropped;
+        } else {
+            ++conn.received;
+            if (now >= config.measure_from && now <= config.end) {
+                ++conn.measured;
+            }
+            // 遅延は計測区間に送ったフレームだけを数える
+            std::int64_t timestamp_us = header.timestamp_us;
+            if (timestamp_us >= to_us(config.measure_from)) {
+                latency.record(to_us(now) - timestamp_us);
+            }
+        }
+        conn.cv.notify_all();
+    }
+}
+
+void recv_results(Connection &conn, const LoadConfig &config) {
+    receive(conn, config);
+    std::lock_guard<std::mutex> lock(conn.mtx);
+    conn.receiving_done = true;
+    conn.cv.notify_all();
+}
+
+std::unique_ptr<Connection> connect(boost::asio::io_service &service,
+                                    const std::string &host,
+                                    const std::string &port,
+                                    const SessionOptions &requested) {
+    boost::asio::ip::tcp::resolver resolver(service);
+    boost::asio::ip::tcp::socket tcp_socket(service);
+    boost::asio::connect(tcp_socket, resolver.resolve(host, port));
+    tcp_socket.set_option(boost::asio::ip::tcp::no_delay(true));
+    auto conn = std::make_unique<Connection>(Socket(std::move(tcp_socket)));
+    conn->options = negotiate_session_options(conn->socket, requested);
+    return conn;
+}
+
+double to_ms(std::uint64_t us) { return us / 1000.0; }
+
+int main(int argc, char *argv[]) {
+    Options options(argc, argv);
+    std::string host = options.positional(0);
+    std::string port = options.positional(1);
+    std::string video_file = options.positional(2);
+
+    LoadConfig config;
+    config.open_loop = options.get("mode", "closed") == "open";
+    config.fps = options.get_double("fps", DEFAULT_FPS);
+    config.window = std::max(options.get_int("window", DEFAULT_WINDOW), 1L);
+    config.connections =
+        std::max(options.get_int("connections", DEFAULT_CONNECTIONS), 1L);
+    if (options.has("models")) {
+        config.request = parse_frame_request(options.get("models", ""));
+    }
+    auto duration =
+        std::chrono::seconds(options.get_int("duration", DEFAULT_DURATION_S));
+    auto warmup =
+        std::chrono::seconds(options.get_int("warmup", DEFAULT_WARMUP_S));
+    if (warmup >= duration) {
+        std::cerr << "--warmup must be shorter than --duration" << std::endl;
+        return 1;
+    }
+
+    SessionOptions requested;
+    std::string result_format = options.get("result-format", "json");
+    if (result_format == "binary") {
+        requested.result_format = RESULT_FORMAT_BINARY;
+    } else if (result_format == "delta") {
+        requested.result_format = RESULT_FORMAT_DELTA;
+    }
+    std::string frame_format = options.get("frame-format", "jpeg");
+    if (frame_format == "bgr") {
+        requested.frame_format = FRAME_FORMAT_BGR;
+    } else if (frame_format == "nv12") {
+        requested.frame_format = FRAME_FORMAT_NV12;
+    }
+    if (options.get("frame-compression", "none") == "png") {
+        requested.frame_compression = FRAME_COMPRESSION_PNG;
+    }
+    requested.frame_header = FRAME_HEADER_SEQUENCE;
+    if (config.request.count > 0) {
+        requested.frame_header |= FRAME_HEADER_REQUEST;
+    }
+
+    boost::asio::io_service service;
+    std::vector<std::unique_ptr<Connection>> connections;
+    for (std::size_t i = 0; i < config.connections; ++i) {
+        connections.push_back(connect(service, host, port, requested));
+    }
+    const SessionOptions &accepted = connections[0]->options;
+    if (config.request.count > 0 &&
+        !has_frame_header(accepted, FRAME_HEADER_REQUEST)) {
+        std::cerr << "Server does not accept --models" << std::endl;
+        return 1;
+    }
+    if (!has_frame_header(accepted, FRAME_HEADER_SEQUENCE)) {
+        std::cout << "Server does not accept frame IDs, matching results by "
+                     "order (latency is wrong if frames are dropped)"
+                  << std::endl;
+    }
+    // 生の画素はサーバが指定したサイズで送る。JPEGは--sizeで縮小できる
+    cv::Size size;
+    int width, height;
+    if (is_raw_frame_format(accepted)) {
+        size = cv::Size(accepted.frame_width, accepted.frame_height);
+    } else if (std::sscanf(options.get("size", "").c_str(), "%dx%d", &width,
+                           &height) == 2) {
+        size = cv::Size(width, height);
+    }
+    auto frames = preload_frames(
+        video_file, options.get_int("preload", DEFAULT_PRELOAD), accepted,
+        size);
+    std::size_t frame_bytes = 0;
+    for (const auto &frame : frames) {
+        frame_bytes += frame.size();
+    }
+    std::cout << "Preloaded " << frames.size() << " frames ("
+              << frame_bytes / frames.size() << " bytes/frame)" << std::endl;
+
+    config.start = Clock::now();
+    config.measure_from = config.start + warmup;
+    config.end = config.start + duration;
+    std::vector<std::thread> threads;
+    for (std::size_t i = 0; i < connections.size(); ++i) {
+        Connection &conn = *connections[i];
+        threads.emplace_back(send_frames, std::ref(conn), i, std::cref(frames),
+                             std::cref(config));
+        threads.emplace_back(recv_results, std::ref(conn), std::cref(config));
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    std::size_t sent = 0, received = 0, dropped = 0, measured = 0;
+    for (const auto &conn : connections) {
+        sent += conn->sent;
+        received += conn->received;
+        dropped += conn->dropped;
+        measured += conn->measured;
+    }
+    std::chrono::duration<double> measured_time = duration - warmup;
+    std::cout << std::fixed << std::setprecision(1);
+    if (config.open_loop) {
+        std::cout << "Open loop at " << config.fps << " fps";
+    } else {
+        std::cout << "Closed loop with window " << config.window;
+    }
+    std::cout << ", " << config.connections << " connections" << std::endl;
+    std::cout << "Sent " << sent << " frames, received " << received
+              << " results, " << dropped << " dropped by the server, "
+              << sent - received - dropped << " lost" << std::endl;
+    std::cout << "Throughput: " << measured / measured_time.count()
+              << " fps (" << measured_time.count() << " s measured)"
+              << std::endl;
+    std::cout << "Latency (ms): p50 " << to_ms(latency.percentile(0.5))
+              << " p90 " << to_ms(latency.percentile(0.9)) << " p99 "
+              << to_ms(latency.percentile(0.99)) << " max "
+              << to_ms(latency.max()) << std::endl;
+    for (std::size_t i = 0; i < connections.size(); ++i) {
+        const Connection &conn = *connections[i];
+        std::cout << "  #" << i << ": sent " << conn.sent << ", received "
+                  << conn.received << ", dropped " << conn.dropped
+                  << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <filesystem>
+#include <iostream>
+#include <opencv2/opencv.hpp>
+#include <vector>
+
+#include "image_archive.hpp"
+#include "image_loader.hpp"
+#include "options.hpp"
+
+#define DEFAULT_QUALITY 90
+
+// ディレクトリの画像(.jpg, .png)はそのままの内容で、
+// 動画はフレームごとにJPEGにエンコードして1つのアーカイブにまとめる
+int main(int argc, char *argv[]) {
+    Options options(argc, argv);
+    std::string input = options.positional(0);
+    std::string output = options.positional(1);
+
+    ImageArchiveWriter writer(output);
+    std::size_t count = 0;
+    std::size_t bytes = 0;
+    if (std::filesystem::is_directory(input)) {
+        for (const auto &path : get_file_names(input)) {
+            std::vector<uchar> buf = read_file(path);
+            if (buf.empty()) {
+                std::cerr << "Skipped " << path << std::endl;
+                continue;
+            }
+            writer.add(std::filesystem::path(path).filename().string(),
+                       reinterpret_cast<const char *>(buf.data()),
+                       buf.size());
+            ++count;
+            bytes += buf.size();
+        }
+    } else {
+        cv::VideoCapture cap;
+        cap.open(input);
+        if (!cap.isOpened()) {
+            std::cerr << "Cannot open " << input << std::endl;
+            return 1;
+        }
+        int quality = options.get_int("quality", DEFAULT_QUALITY);
+        cv::Mat frame;
+        std::vector<uchar> buf;
+        while (true) {
+            cap >> frame;
+            if (frame.empty()) {
+                break;
+            }
+            cv::imencode(".jpg", frame, buf,
+                         {cv::IMWRITE_JPEG_QUALITY, quality});
+            char name[32];
+            std::snprintf(name, sizeof(name), "%08zu.jpg", count);
+            writer.add(name, reinterpret_cast<const char *>(buf.data()),
+                       buf.size());
+            ++count;
+            bytes += buf.size();
+        }
+    }
+    writer.finish();
+    std::cout << "Packed " << count << " images (" << bytes << " bytes) into "
+              << output << std::endl;
+    return 0;
+}
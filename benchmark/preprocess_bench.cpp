@@ -0,0 +1,134 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <opencv2/opencv.hpp>
+#include <vector>
+
+#include "fused_preprocess.hpp"
+#include "options.hpp"
+
+// 量子化のパラメータの例(RGB入力、平均128、スケール1/128、fixpos 6)
+static const QuantParams PARAMS = {
+    {128.0f, 128.0f, 128.0f}, {64.0f / 128, 64.0f / 128, 64.0f / 128}, true};
+
+// 出力の差を比べる基準の素朴な実装: cv::resizeで縮小した画像に、画素ごとに
+// スカラーの演算で平均・スケールを適用して量子化する。Vitis AI Libraryの
+// 前処理ではないので、時間は参考値とする
+void naive_path(const cv::Mat &image, const cv::Size &size, cv::Mat &resized,
+                std::int8_t *dst) {
+    if (image.size() != size) {
+        cv::resize(image, resized, size);
+    } else {
+        resized = image;
+    }
+    for (int y = 0; y < resized.rows; ++y) {
+        const uchar *src = resized.ptr(y);
+        std::int8_t *out = dst + y * resized.cols * 3;
+        for (int x = 0; x < resized.cols; ++x) {
+            for (int c = 0; c < 3; ++c) {
+                int channel = PARAMS.swap_rb ? 2 - c : c;
+                float v = (src[x * 3 + channel] - PARAMS.mean[c]) *
+                          PARAMS.scale[c];
+                out[x * 3 + c] = static_cast<std::int8_t>(
+                    std::min(std::max(std::round(v), -128.0f), 127.0f));
+            }
+        }
+    }
+}
+
+// OpenCVのベクトル化された関数だけで組んだ経路: cv::resizeで縮小し、
+// チャネルを並べ替え、浮動小数点の画像で平均・スケールを適用してから
+// convertToで丸めと飽和をまとめて行う。速度はこの経路と比べる
+void opencv_path(const cv::Mat &image, const cv::Size &size, cv::Mat &resized,
+                 cv::Mat &ordered, cv::Mat &scaled, std::int8_t *dst) {
+    const cv::Mat *src = &image;
+    if (image.size() != size) {
+        cv::resize(image, resized, size);
+        src = &resized;
+    }
+    if (PARAMS.swap_rb) {
+        cv::cvtColor(*src, ordered, cv::COLOR_BGR2RGB);
+        src = &ordered;
+    }
+    src->convertTo(scaled, CV_32FC3);
+    cv::subtract(scaled,
+                 cv::Scalar(PARAMS.mean[0], PARAMS.mean[1], PARAMS.mean[2]),
+                 scaled);
+    cv::multiply(scaled,
+                 cv::Scalar(PARAMS.scale[0], PARAMS.scale[1], PARAMS.scale[2]),
+                 scaled);
+    cv::Mat out(size, CV_8SC3, dst);
+    scaled.convertTo(out, CV_8S);
+}
+
+template <typename F> double measure_us(int iterations, F f) {
+    f();
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i) {
+        f();
+    }
+    std::chrono::duration<double, std::micro> elapsed =
+        std::chrono::steady_clock::now() - start;
+    return elapsed.count() / iterations;
+}
+
+int main(int argc, char *argv[]) {
+    Options options(argc, argv);
+    int iterations = options.get_int("iterations", 200);
+    const cv::Size sources[] = {{368, 368}, {640, 360}, {1280, 720},
+                                {1920, 1080}};
+    const cv::Size targets[] = {{368, 368}, {640, 360}};
+
+    printf("%-11s %-9s %10s %11s %10s %8s %8s\n", "source", "target",
+           "naive[us]", "opencv[us]", "fused[us]", "speedup", "maxdiff");
+    for (const auto &source : sources) {
+        cv::Mat image(source, CV_8UC3);
+        cv::randu(image, cv::Scalar::all(0), cv::Scalar::all(256));
+        cv::GaussianBlur(image, image, cv::Size(5, 5), 0);
+        for (const auto &target : targets) {
+            std::size_t n = static_cast<std::size_t>(target.area()) * 3;
+            std::vector<std::int8_t> expected(n), actual(n);
+            std::vector<std::int8_t> converted(n);
+            cv::Mat resized, ordered, scaled;
+            FusedPreprocessor fused(target.width, target.height, PARAMS);
+            double naive_us = measure_us(iterations, [&] {
+                naive_path(image, target, resized, expected.data());
+            });
+            double opencv_us = measure_us(iterations, [&] {
+                opencv_path(image, target, resized, ordered, scaled,
+                            converted.data());
+            });
+            double fused_us = measure_us(
+                iterations, [&] { fused.run(image, actual.data()); });
+            int max_diff = 0;
+            for (std::size_t i = 0; i < n; ++i) {
+                max_diff =
+                    std::max(max_diff, std::abs(expected[i] - actual[i]));
+            }
+            // 速度の比はOpenCVの経路に対するもの
+            printf("%4dx%-6d %3dx%-5d %10.1f %11.1f %10.1f %7.2fx %8d\n",
+                   source.width, source.height, target.width, target.height,
+                   naive_us, opencv_us, fused_us, opencv_us / fused_us,
+                   max_diff);
+        }
+    }
+    return 0;
+}
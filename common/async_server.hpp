@@ -0,0 +1,582 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <boost/asio.hpp>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <opencv2/opencv.hpp>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "decode_pool.hpp"
+#include "delta_result.hpp"
+#include "frame_pool.hpp"
+#include "protocol.hpp"
+#include "queue_limit.hpp"
+#include "server_settings.hpp"
+#include "shared_frame_ring.hpp"
+#include "stage_stats.hpp"
+#include "tagged_frame.hpp"
+
+// 固定数のスレッドでio_contextを回し、接続ごとのスレッドを作らずに
+// 非同期に受信・送信するサーバ。フレームごとの処理はThreadedServerと同じく
+// Pipelineに任せる
+template <typename Pipeline> class AsyncServer {
+  public:
+    using Result = typename Pipeline::Result;
+    using Frame = typename Pipeline::Frame;
+    using Context = typename Pipeline::Context;
+    using Socket = boost::asio::generic::stream_protocol::socket;
+    using LocalAcceptor = boost::asio::local::stream_protocol::acceptor;
+
+    // デコードと前処理はdecode_poolのスレッドで行う。
+    // 段ごとの遅延は接続ごとにstage_reportへ記録する
+    AsyncServer(Context &context, DecodePool &decode_pool,
+                StageReport &stage_report, const ServerSettings &settings)
+        : context_(context), decode_pool_(decode_pool),
+          stage_report_(stage_report), settings_(settings),
+          num_threads_(std::max<std::size_t>(settings.io_threads, 1)),
+          acceptor_(io_context_,
+                    boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(),
+                                                   settings.port)) {
+        // TCPに加えて、同じホストのクライアントを共有メモリで受け付ける
+        if (!settings_.local_socket.empty()) {
+            ::unlink(settings_.local_socket.c_str());
+            local_acceptor_ = std::make_unique<LocalAcceptor>(
+                io_context_, boost::asio::local::stream_protocol::endpoint(
+                                 settings_.local_socket));
+        }
+    }
+
+    // io_contextが止まるまで戻らない
+    void run(const std::string &name) {
+        std::cout << "Launched " << name << " (async, " << num_threads_
+                  << " threads)" << std::endl;
+        accept();
+        if (local_acceptor_) {
+            accept_local();
+        }
+        std::vector<std::thread> threads;
+        for (std::size_t i = 1; i < num_threads_; ++i) {
+            threads.emplace_back([this] { io_context_.run(); });
+        }
+        io_context_.run();
+        for (auto &thread : threads) {
+            thread.join();
+        }
+    }
+
+  private:
+    // 送信待ちのデータ。sizeはデータ長にflags(制御メッセージなら
+    // CONTROL_MESSAGE_FLAG)を重ねたもの。結果はresultに入れておき、
+    // 送信する直前にdataへシリアライズする
+    struct Outgoing {
+        std::size_t size;
+        std::string data;
+        std::optional<Tagged<Result>> result;
+    };
+
+    class Session : public std::enable_shared_from_this<Session> {
+      public:
+
+        Session(AsyncServer &server, Socket socket, std::string client_addr,
+                bool shared)
+            : server_(server), socket_(std::move(socket)),
+              client_addr_(std::move(client_addr)), shared_(shared),
+              stats_(server_.stage_report_.open(client_addr_)) {}
+
+        ~Session() {
+            std::cout << "Connection to " << client_addr_
+                      << " is now fully closed (" << pool_.stats()
+                      << ", dropped " << dropped_frames_ << " frames and "
+                      << dropped_results_ << " results)" << std::endl;
+            stats_->print(std::cout);
+            if (delta_) {
+                std::cout << "Sent " << delta_->encoded_bytes()
+                          << " bytes of delta results for "
+                          << delta_->raw_bytes() << " bytes" << std::endl;
+            }
+            if (pipeline_) {
+                pipeline_->print(std::cout);
+            }
+        }
+
+        void start() {
+            std::weak_ptr<Session> weak_self = this->shared_from_this();
+            // Pipelineからの結果と、結果を返さずに捨てたフレーム。
+            // どちらもstrandで受信した順に並べてから送る
+            pipeline_ = std::make_unique<Pipeline>(
+                server_.context_,
+                [weak_self](Tagged<Result> result) {
+                    auto self = weak_self.lock();
+                    if (!self) {
+                        return;
+                    }
+                    boost::asio::post(
+                        self->socket_.get_executor(),
+                        [self, result = std::move(result)]() mutable {
+                            std::uint64_t index = result.index;
+                            self->completed(index, std::move(result));
+                        });
+                },
+                [weak_self](const TaggedFrame &frame) {
+                    auto self = weak_self.lock();
+                    if (!self) {
+                        return;
+                    }
+                    boost::asio::post(
+                        self->socket_.get_executor(),
+                        [self, frame = TaggedFrame{frame.header, cv::Mat(),
+                                                   frame.times, frame.index}] {
+                            self->dropped(frame);
+                        });
+                });
+            pool_.set_target_size(pipeline_->frame_size());
+            // デコードが終わった順ではなく受信した順に届くので、
+            // strandにもその順番で積まれる
+            decode_ = server_.decode_pool_.open([weak_self](cv::Mat image) {
+                auto self = weak_self.lock();
+                if (!self) {
+                    return;
+                }
+                boost::asio::post(self->socket_.get_executor(),
+                                  [self, image = std::move(image)] {
+                                      self->decoded(image);
+                                  });
+            });
+            if (shared_) {
+                receive_ring();
+            } else {
+                read_header();
+            }
+        }
+
+      private:
+        // 共有メモリで受け渡す接続では、最初にmemfdを受け取る
+        void receive_ring() {
+            auto self = this->shared_from_this();
+            socket_.async_wait(
+                Socket::wait_read,
+                [self](const boost::system::error_code &ec) {
+                    if (ec) {
+                        self->stop(ec);
+                        return;
+                    }
+                    try {
+                        self->pool_.attach(SharedFrameRing::attach(
+                            receive_fd(self->socket_.native_handle())));
+                    } catch (const std::exception &e) {
+                        std::cerr << "Error while attaching shared memory: "
+                                  << e.what() << std::endl;
+                        self->stop(boost::asio::error::invalid_argument);
+                        return;
+                    }
+                    self->read_header();
+                });
+        }
+
+        void read_header() {
+            auto self = this->shared_from_this();
+            boost::asio::async_read(
+                socket_, boost::asio::buffer(&frame_size_, sizeof(std::size_t)),
+                [self](const boost::system::error_code &ec, std::size_t) {
+                    if (ec) {
+                        self->stop(ec);
+                        return;
+                    }
+                    self->recv_start_ = StageClock::now();
+                    if (is_control_message(self->frame_size_)) {
+                        self->read_control();
+                    } else {
+                        self->negotiable_ = false;
+                        self->read_body();
+                    }
+                });
+        }
+
+        // ネゴシエーションは最初のフレームより前にだけ受け付ける
+        void read_control() {
+            auto self = this->shared_from_this();
+            std::size_t size = frame_size_ & ~CONTROL_MESSAGE_FLAG;
+            if (!negotiable_ || size > 4096) {
+                stop(boost::asio::error::invalid_argument);
+                return;
+            }
+            buf_.resize(size);
+            boost::asio::async_read(
+                socket_, boost::asio::buffer(buf_),
+                [self](const boost::system::error_code &ec, std::size_t) {
+                    if (ec) {
+                        self->stop(ec);
+                        return;
+                    }
+                    SessionOptions requested;
+                    std::memcpy(&requested, self->buf_.data(),
+                                std::min(self->buf_.size(),
+                                         sizeof(SessionOptions)));
+                    cv::Size frame_size = self->pipeline_->frame_size();
+                    self->options_ = accept_session_options(
+                        requested, frame_size.width, frame_size.height,
+                        Pipeline::frame_headers, true);
+                    self->pool_.set_format(self->options_);
+                    if (self->options_.result_format == RESULT_FORMAT_DELTA) {
+                        self->delta_ = std::make_unique<DeltaEncoder>(
+                            self->server_.settings_.delta_keyframe_interval);
+                    }
+                    if (has_frame_header(self->options_,
+                                         FRAME_HEADER_SEQUENCE)) {
+                        self->pipeline_->set_frame_ids();
+                    }
+                    self->negotiable_ = false;
+                    std::string reply(sizeof(SessionOptions), '\0');
+                    std::memcpy(&reply[0], &self->options_,
+                                sizeof(SessionOptions));
+                    self->send_control(std::move(reply));
+                    self->read_header();
+                });
+        }
+
+        // FrameHeader, FrameRequestの順にフレームのデータの先頭に付いている
+        void read_body() {
+            auto self = this->shared_from_this();
+            if (frame_size_ == 0) {
+                stop(boost::system::error_code());
+                return;
+            }
+            // 大きすぎるデータ長はバッファを確保する前に断り、この接続だけを閉じる
+            if (frame_size_ > MAX_FRAME_SIZE) {
+                stop(boost::asio::error::message_size);
+                return;
+            }
+            std::size_t header_size =
+                has_frame_header(options_, FRAME_HEADER_SEQUENCE)
+                    ? sizeof(FrameHeader)
+                    : 0;
+            std::size_t request_size =
+                has_frame_header(options_, FRAME_HEADER_REQUEST)
+                    ? sizeof(FrameRequest)
+                    : 0;
+            if (frame_size_ <= header_size + request_size) {
+                stop(boost::asio::error::invalid_argument);
+                return;
+            }
+            std::size_t body_size = frame_size_ - header_size - request_size;
+            std::array<boost::asio::mutable_buffer, 3> buffers = {
+                boost::asio::buffer(&header_, header_size),
+                boost::asio::buffer(&request_, request_size),
+                boost::asio::buffer(pool_.receive_buffer(body_size),
+                                    body_size)};
+            boost::asio::async_read(
+                socket_, buffers,
+                [self](const boost::system::error_code &ec, std::size_t) {
+                    if (ec) {
+                        self->stop(ec);
+                        return;
+                    }
+                    self->received();
+                });
+        }
+
+        // 受信し終えたフレームをデコードプールに渡す
+        void received() {
+            TaggedFrame tagged{header_, cv::Mat(), FrameTimes(),
+                               next_index_++};
+            tagged.times.start(stats_, recv_start_);
+            ReceivedFrame received = pool_.take();
+            Frame frame;
+            if (header_.version != FRAME_HEADER_VERSION ||
+                !pipeline_->receive(tagged, request_, pool_, received, frame)) {
+                stop(boost::asio::error::invalid_argument);
+                return;
+            }
+            ++in_flight_;
+            ++decoding_;
+            stats_->observe(Gauge::InFlight, in_flight_);
+            stats_->observe(Gauge::Decoding, decoding_);
+            received_.push_back(frame);
+            auto self = this->shared_from_this();
+            server_.decode_pool_.submit(decode_, [self, frame, received] {
+                return self->pipeline_->decode(self->pool_, received, frame);
+            });
+            reading_paused_ = true;
+            resume_reading();
+        }
+
+        // デコードと前処理が終わったフレームをPipelineに渡す
+        void decoded(const cv::Mat &image) {
+            --decoding_;
+            Frame frame = std::move(received_.front());
+            received_.pop_front();
+            if (stopped_) {
+                return;
+            }
+            if (image.empty() && pipeline_->decodes(frame)) {
+                --in_flight_;
+                stop(boost::asio::error::invalid_argument);
+                return;
+            }
+            pipeline_->push(std::move(frame), image);
+            resume_reading();
+        }
+
+        // フレームIDを付けない接続では、先に終わったフレームは前のフレームが
+        // 終わるまで保持しておく。値が空なら結果を返さずに捨てたフレーム
+        void completed(std::uint64_t index,
+                       std::optional<Tagged<Result>> result) {
+            if (has_frame_header(options_, FRAME_HEADER_SEQUENCE)) {
+                send_result(std::move(*result));
+            } else {
+                done_.emplace(index, std::move(result));
+                auto it = done_.begin();
+                while (it != done_.end() && it->first == next_done_) {
+                    if (it->second) {
+                        send_result(std::move(*it->second));
+                    } else {
+                        --in_flight_;
+                    }
+                    it = done_.erase(it);
+                    ++next_done_;
+                }
+            }
+            if (draining_ && in_flight_ == 0) {
+                finish();
+            }
+            resume_reading();
+        }
+
+        // フレームIDを付ける接続では、捨てたフレームをクライアントに知らせる
+        void dropped(const TaggedFrame &frame) {
+            ++dropped_frames_;
+            if (has_frame_header(options_, FRAME_HEADER_SEQUENCE)) {
+                completed(frame.index, dropped_result<Result>(frame));
+            } else {
+                completed(frame.index, std::nullopt);
+            }
+        }
+
+        // 結果は送信する直前にシリアライズするので、キューの上限で捨てた結果は
+        // 差分の元にならない
+        void send_result(Tagged<Result> result) {
+            --in_flight_;
+            send(Outgoing{0, std::string(), std::move(result)});
+        }
+
+        void send_control(std::string data) {
+            send(Outgoing{data.size() | CONTROL_MESSAGE_FLAG, std::move(data),
+                          std::nullopt});
+        }
+
+        // デコード待ちが上限に達したら次のフレームを読み込まない。
+        // OverflowPolicy::Blockでは、処理中のフレームと送信待ちの結果の合計が
+        // 上限を下回るまで読み込まない。他のポリシーやフレームIDを付ける接続
+        // でも、合計はThreadedServerの結果リングと同じ容量までにする
+        void resume_reading() {
+            const QueueLimit &limit = server_.settings_.queue_limit;
+            if (!reading_paused_ || draining_) {
+                return;
+            }
+            if (decoding_ >= limit.capacity ||
+                in_flight_ + send_queue_.size() >=
+                    RESULT_RING_SLACK * limit.capacity) {
+                return;
+            }
+            if (limit.policy == OverflowPolicy::Block &&
+                in_flight_ + send_queue_.size() >= limit.capacity) {
+                return;
+            }
+            reading_paused_ = false;
+            read_header();
+        }
+
+        // 差分は送る順番に作る
+        std::string serialize(const Tagged<Result> &result) {
+            auto serialize = [this](const Result &value,
+                                    const SessionOptions &options) {
+                std::string body = pipeline_->serialize(value, options);
+                return delta_ ? delta_->encode(body) : body;
+            };
+            return serialize_tagged(result, options_, serialize);
+        }
+
+        void send(Outgoing outgoing) {
+            if (stopped_) {
+                return;
+            }
+            // 先頭は送信中なので捨てない。
+            // フレームIDを付ける接続では、推論した結果は捨てずに全て返す
+            std::size_t pinned = send_queue_.empty() ? 0 : 1;
+            if (has_frame_header(options_, FRAME_HEADER_SEQUENCE)) {
+                pinned = send_queue_.size();
+            }
+            dropped_results_ += make_room(
+                send_queue_, server_.settings_.queue_limit, pinned);
+            send_queue_.push_back(std::move(outgoing));
+            stats_->observe(Gauge::Results, send_queue_.size());
+            if (send_queue_.size() == 1) {
+                write();
+            }
+        }
+        void write() {
+            auto self = this->shared_from_this();
+            Outgoing &front = send_queue_.front();
+            if (front.result) {
+                front.result->times.lap(Stage::Result);
+                front.data = serialize(*front.result);
+                front.size = front.data.size();
+                front.result->times.lap(Stage::Serialize);
+            }
+            std::array<boost::asio::const_buffer, 2> buffers = {
+                boost::asio::buffer(&send_queue_.front().size,
+                                    sizeof(std::size_t)),
+                boost::asio::buffer(send_queue_.front().data)};
+            boost::asio::async_write(
+                socket_, buffers,
+                [self](const boost::system::error_code &ec, std::size_t) {
+                    if (ec) {
+                        std::cerr << "Error sending image: " << ec.message()
+                                  << std::endl;
+                        self->stop(ec);
+                        return;
+                    }
+                    // 捨てたフレームの知らせは遅延に含めない
+                    auto &sent = self->send_queue_.front().result;
+                    if (sent && !is_dropped(sent->header)) {
+                        sent->times.finish();
+                    }
+                    self->send_queue_.pop_front();
+                    if (!self->send_queue_.empty()) {
+                        self->write();
+                    }
+                    self->resume_reading();
+                });
+        }
+
+        // 受信が終わった後も、推論中のフレームの結果は送信してから閉じる
+        void stop(const boost::system::error_code &ec) {
+            if (ec && ec != boost::asio::error::eof) {
+                std::cerr << "Error while receiving data: " << ec.message()
+                          << std::endl;
+                stopped_ = true;
+                // 先頭は送信中でバッファをasync_writeが使っているので残す
+                if (!send_queue_.empty()) {
+                    send_queue_.erase(send_queue_.begin() + 1,
+                                      send_queue_.end());
+                }
+                finish();
+                return;
+            }
+            draining_ = true;
+            if (in_flight_ == 0) {
+                finish();
+            } else {
+                keep_alive_ = this->shared_from_this();
+            }
+        }
+
+        void finish() {
+            server_.decode_pool_.close(decode_);
+            pipeline_->close();
+            keep_alive_.reset();
+        }
+
+
+        AsyncServer &server_;
+        Socket socket_;
+        std::string client_addr_;
+        bool shared_;
+        std::unique_ptr<Pipeline> pipeline_;
+        std::shared_ptr<DecodePool::Stream> decode_;
+        std::size_t frame_size_ = 0;
+        FrameHeader header_;
+        FrameRequest request_;
+        StageClock::time_point recv_start_;
+        std::uint64_t next_index_ = 0;
+        // デコード中のフレーム。受信した順に並ぶ
+        std::deque<Frame> received_;
+        // フレームIDを付けない接続で、受信した順に並べ直している結果
+        std::map<std::uint64_t, std::optional<Tagged<Result>>> done_;
+        std::uint64_t next_done_ = 0;
+        std::vector<uchar> buf_;
+        FramePool pool_;
+        std::shared_ptr<StageStats> stats_;
+        std::deque<Outgoing> send_queue_;
+        SessionOptions options_;
+        std::unique_ptr<DeltaEncoder> delta_;
+        bool negotiable_ = true;
+        std::size_t in_flight_ = 0;
+        std::size_t decoding_ = 0;
+        std::size_t dropped_frames_ = 0;
+        std::size_t dropped_results_ = 0;
+        bool reading_paused_ = false;
+        bool draining_ = false;
+        bool stopped_ = false;
+        std::shared_ptr<Session> keep_alive_;
+    };
+
+    void accept() {
+        acceptor_.async_accept(
+            boost::asio::make_strand(io_context_),
+            [this](const boost::system::error_code &ec,
+                   boost::asio::ip::tcp::socket socket) {
+                if (!ec) {
+                    std::string client_addr =
+                        endpoint_to_string(socket.remote_endpoint());
+                    std::cout << "New client: " << client_addr << std::endl;
+                    std::make_shared<Session>(*this, Socket(std::move(socket)),
+                                              client_addr, false)
+                        ->start();
+                }
+                accept();
+            });
+    }
+
+    void accept_local() {
+        local_acceptor_->async_accept(
+            boost::asio::make_strand(io_context_),
+            [this](const boost::system::error_code &ec,
+                   boost::asio::local::stream_protocol::socket socket) {
+                if (!ec) {
+                    std::string client_addr =
+                        endpoint_to_string(local_acceptor_->local_endpoint());
+                    std::cout << "New local client: " << client_addr
+                              << std::endl;
+                    std::make_shared<Session>(*this, Socket(std::move(socket)),
+                                              client_addr, true)
+                        ->start();
+                }
+                accept_local();
+            });
+    }
+
+    Context &context_;
+    DecodePool &decode_pool_;
+    StageReport &stage_report_;
+    ServerSettings settings_;
+    std::size_t num_threads_;
+    boost::asio::io_context io_context_;
+    boost::asio::ip::tcp::acceptor acceptor_;
+    std::unique_ptr<LocalAcceptor> local_acceptor_;
+};
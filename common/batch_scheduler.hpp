@@ -0,0 +1,427 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "queue_limit.hpp"
+#include "trace.hpp"
+
+// 1つのインスタンスに割り当てておけるバッチの数(実行中を含む)。
+// 2なら実行中に次のバッチを用意しておける
+#define SCHEDULER_INSTANCE_DEPTH 2
+
+// 複数の接続から届いたフレームを1つのスケジューラに集め、
+// モデルの入力バッチサイズ単位でまとめて推論する。
+// 推論処理は関数として受け取るため、DPUを使わないモデルでも動作する。
+// モデルのインスタンスを複数渡すと、インスタンスごとのスレッドで並列に推論し、
+// バッチは割り当て済みのバッチが最も少ないインスタンスへ送る。
+// 複数のモデルを扱う場合、バッチは同じモデルの接続のフレームだけでまとめる
+template <typename Input, typename Result> class BatchScheduler {
+  public:
+    using Clock = std::chrono::steady_clock;
+    using RunBatch =
+        std::function<std::vector<Result>(const std::vector<Input> &)>;
+    using Deliver = std::function<void(Result)>;
+    using Drop = std::function<void(Input)>;
+
+    // 推論の結果か、推論に失敗したフレーム
+    struct Completion {
+        std::optional<Result> result;
+        std::optional<Input> failed;
+    };
+
+    // 接続ごとの入力キュー。推論結果はdeliverで接続側へ返す
+    class Stream {
+      public:
+        Stream(Deliver deliver, QueueLimit limit, std::size_t model)
+            : deliver_(std::move(deliver)), limit_(limit), model_(model) {}
+
+        // falseにすると、結果をバッチに入れた順番に並べ直さず、
+        // 終わった順にdeliverに渡す。最初のsubmitより前に呼ぶこと
+        void set_ordered(bool ordered) { ordered_ = ordered; }
+
+        // キューのポリシーに従って捨てたフレームと、推論に失敗したフレーム
+        // (run_batchが例外を投げたか、結果が足りなかったもの)をdropに渡す。
+        // 失敗したフレームはdeliverと同じ順番で渡す。
+        // deliverと同時には呼ばれない。最初のsubmitより前に呼ぶこと
+        void set_drop(Drop drop) { drop_ = std::move(drop); }
+
+      private:
+        friend class BatchScheduler;
+        std::deque<std::pair<Input, Clock::time_point>> pending_;
+        Deliver deliver_;
+        QueueLimit limit_;
+        std::size_t model_;
+        bool ordered_ = true;
+        // close()した後のsubmitはキューに入れずにdropへ渡す
+        bool closed_ = false;
+        Drop drop_;
+        // バッチに入れた順番。インスタンスごとに終わる順番が前後しても、
+        // この順番でdeliverに渡す
+        std::uint64_t next_seq_ = 0;
+        std::uint64_t next_deliver_ = 0;
+        std::map<std::uint64_t, Completion> done_;
+        std::mutex deliver_mtx_;
+    };
+
+    // 1つのモデルのインスタンスと入力バッチサイズ
+    struct Model {
+        std::vector<RunBatch> instances;
+        std::size_t max_batch = 1;
+    };
+
+    // インスタンスごとの累計
+    struct InstanceStats {
+        std::size_t model = 0;
+        std::size_t batches = 0;
+        std::size_t frames = 0;
+        // 推論を実行していた時間
+        Clock::duration busy = Clock::duration::zero();
+    };
+
+    BatchScheduler(RunBatch run_batch, std::size_t max_batch,
+                   std::chrono::microseconds max_wait)
+        : BatchScheduler(std::vector<RunBatch>{std::move(run_batch)},
+                         max_batch, max_wait) {}
+
+    BatchScheduler(std::vector<RunBatch> instances, std::size_t max_batch,
+                   std::chrono::microseconds max_wait)
+        : BatchScheduler(std::vector<Model>{{std::move(instances), max_batch}},
+                         max_wait) {}
+
+    BatchScheduler(std::vector<Model> models,
+                   std::chrono::microseconds max_wait)
+        : max_wait_(max_wait), pending_count_(models.size(), 0),
+          next_stream_(0), stop_(false) {
+        for (std::size_t m = 0; m < models.size(); ++m) {
+            max_batch_.push_back(
+                std::max<std::size_t>(models[m].max_batch, 1));
+            for (auto &run_batch : models[m].instances) {
+                instances_.push_back(std::make_unique<Instance>());
+                instances_.back()->run_batch = std::move(run_batch);
+                instances_.back()->stats.model = m;
+            }
+        }
+        for (auto &instance : instances_) {
+            instance->worker =
+                std::thread(&BatchScheduler::run, this, instance.get());
+        }
+        worker_ = std::thread(&BatchScheduler::schedule, this);
+    }
+
+    ~BatchScheduler() {
+        std::unique_lock<std::mutex> lock(mtx_);
+        stop_ = true;
+        lock.unlock();
+        cv_.notify_all();
+        for (auto &instance : instances_) {
+            instance->cv.notify_all();
+        }
+        worker_.join();
+        for (auto &instance : instances_) {
+            instance->worker.join();
+        }
+    }
+
+    std::size_t max_batch(std::size_t model = 0) const {
+        return max_batch_[model];
+    }
+
+    std::size_t num_instances() const { return instances_.size(); }
+
+    std::vector<InstanceStats> instance_stats() const {
+        std::unique_lock<std::mutex> lock(mtx_);
+        std::vector<InstanceStats> stats;
+        for (const auto &instance : instances_) {
+            stats.push_back(instance->stats);
+        }
+        return stats;
+    }
+
+    // OverflowPolicy::Blockの場合、キューの長さは呼び出し側で抑えること。
+    // modelはコンストラクタに渡したモデルの番号
+    std::shared_ptr<Stream> open(Deliver deliver,
+                                 QueueLimit limit = QueueLimit(),
+                                 std::size_t model = 0) {
+        auto stream =
+            std::make_shared<Stream>(std::move(deliver), limit, model);
+        std::unique_lock<std::mutex> lock(mtx_);
+        streams_.push_back(stream);
+        return stream;
+    }
+
+    // 未処理のフレームは破棄する。実行中のバッチの結果はdeliverに渡される。
+    // 以降にsubmitしたフレームは推論せずにdropへ渡す
+    void close(const std::shared_ptr<Stream> &stream) {
+        std::unique_lock<std::mutex> lock(mtx_);
+        stream->closed_ = true;
+        pending_count_[stream->model_] -= stream->pending_.size();
+        stream->pending_.clear();
+        streams_.erase(std::remove(streams_.begin(), streams_.end(), stream),
+                       streams_.end());
+    }
+
+    // キューのポリシーに従って捨てたフレームの数を返す。
+    // 閉じたストリームに渡したフレームも捨てたものとして数える
+    std::size_t submit(const std::shared_ptr<Stream> &stream, Input input) {
+        std::vector<Input> dropped_inputs;
+        std::unique_lock<std::mutex> lock(mtx_);
+        if (stream->closed_) {
+            lock.unlock();
+            if (stream->drop_) {
+                std::lock_guard<std::mutex> deliver_lock(stream->deliver_mtx_);
+                stream->drop_(std::move(input));
+            }
+            return 1;
+        }
+        std::size_t dropped = make_room(
+            stream->pending_, stream->limit_, 0,
+            [&stream, &dropped_inputs](
+                std::pair<Input, Clock::time_point> &pending) {
+                if (stream->drop_) {
+                    dropped_inputs.push_back(std::move(pending.first));
+                }
+            });
+        pending_count_[stream->model_] -= dropped;
+        stream->pending_.emplace_back(std::move(input), Clock::now());
+        ++pending_count_[stream->model_];
+        lock.unlock();
+        cv_.notify_all();
+        if (!dropped_inputs.empty()) {
+            std::lock_guard<std::mutex> deliver_lock(stream->deliver_mtx_);
+            for (auto &dropped_input : dropped_inputs) {
+                stream->drop_(std::move(dropped_input));
+            }
+        }
+        return dropped;
+    }
+
+  private:
+    struct Batch {
+        std::vector<Input> inputs;
+        std::vector<std::pair<std::shared_ptr<Stream>, std::uint64_t>> owners;
+    };
+
+    struct Instance {
+        RunBatch run_batch;
+        std::deque<Batch> batches;
+        // 割り当て済みで、まだ終わっていないバッチの数
+        std::size_t load = 0;
+        InstanceStats stats;
+        std::condition_variable cv;
+        std::thread worker;
+    };
+
+    void schedule() {
+        while (true) {
+            std::unique_lock<std::mutex> lock(mtx_);
+            std::size_t model = 0;
+            cv_.wait(lock, [this, &model] {
+                return stop_ || (model = ready_model()) < max_batch_.size();
+            });
+            if (stop_) {
+                return;
+            }
+            // バッチが埋まるか、最も古いフレームの待ち時間が上限に達するまで待つ
+            cv_.wait_until(lock, oldest_arrival(model) + max_wait_,
+                           [this, model] {
+                               return stop_ || pending_count_[model] >=
+                                                   max_batch_[model];
+                           });
+            if (stop_) {
+                return;
+            }
+            Batch batch;
+            gather(model, batch);
+            if (batch.inputs.empty()) {
+                continue;
+            }
+            // 割り当てを増やすのはこのスレッドだけなので、空きは残っている
+            Instance *instance = least_loaded(model);
+            instance->batches.push_back(std::move(batch));
+            ++instance->load;
+            lock.unlock();
+            instance->cv.notify_one();
+        }
+    }
+
+    // 未処理のフレームがあり、インスタンスに空きのあるモデルのうち、
+    // 最も古いフレームを持つもの。無ければモデルの数を返す
+    std::size_t ready_model() const {
+        std::size_t ready = max_batch_.size();
+        auto oldest = Clock::time_point::max();
+        for (std::size_t m = 0; m < max_batch_.size(); ++m) {
+            if (pending_count_[m] == 0 || least_loaded(m) == nullptr) {
+                continue;
+            }
+            auto arrival = oldest_arrival(m);
+            if (ready == max_batch_.size() || arrival < oldest) {
+                ready = m;
+                oldest = arrival;
+            }
+        }
+        return ready;
+    }
+
+    // モデルのインスタンスのうち、割り当て済みのバッチが最も少なく、
+    // 同じなら稼働時間が短いもの。どれにも空きが無ければnullptr
+    Instance *least_loaded(std::size_t model) const {
+        Instance *best = nullptr;
+        for (const auto &instance : instances_) {
+            if (instance->stats.model != model ||
+                instance->load >= SCHEDULER_INSTANCE_DEPTH) {
+                continue;
+            }
+            if (best == nullptr || instance->load < best->load ||
+                (instance->load == best->load &&
+                 instance->stats.busy < best->stats.busy)) {
+                best = instance.get();
+            }
+        }
+        return best;
+    }
+
+    void run(Instance *instance) {
+        trace_recorder().name_thread(
+            "model " + std::to_string(instance->stats.model) + " instance");
+        while (true) {
+            std::unique_lock<std::mutex> lock(mtx_);
+            instance->cv.wait(lock, [this, instance] {
+                return stop_ || !instance->batches.empty();
+            });
+            if (stop_) {
+                return;
+            }
+            Batch batch = std::move(instance->batches.front());
+            instance->batches.pop_front();
+            lock.unlock();
+
+            auto start = Clock::now();
+            std::vector<Result> results;
+            try {
+                results = instance->run_batch(batch.inputs);
+            } catch (const std::exception &e) {
+                std::cerr << "Error while running a batch: " << e.what()
+                          << std::endl;
+                results.clear();
+            }
+            auto end = Clock::now();
+            auto busy = end - start;
+            trace_recorder().record("infer", start, end);
+            // 結果が足りないフレームは、推論に失敗したものとして接続へ返す
+            for (std::size_t i = 0; i < batch.owners.size(); ++i) {
+                auto &owner = batch.owners[i];
+                Completion completion;
+                if (i < results.size()) {
+                    completion.result = std::move(results[i]);
+                } else {
+                    completion.failed = std::move(batch.inputs[i]);
+                }
+                deliver(*owner.first, owner.second, std::move(completion));
+            }
+
+            lock.lock();
+            --instance->load;
+            ++instance->stats.batches;
+            instance->stats.frames += batch.inputs.size();
+            instance->stats.busy += busy;
+            lock.unlock();
+            cv_.notify_all();
+        }
+    }
+
+    void deliver(Stream &stream, std::uint64_t seq, Completion completion) {
+        std::lock_guard<std::mutex> lock(stream.deliver_mtx_);
+        if (!stream.ordered_) {
+            complete(stream, completion);
+            return;
+        }
+        stream.done_.emplace(seq, std::move(completion));
+        auto it = stream.done_.begin();
+        while (it != stream.done_.end() && it->first == stream.next_deliver_) {
+            complete(stream, it->second);
+            it = stream.done_.erase(it);
+            ++stream.next_deliver_;
+        }
+    }
+
+    // deliver_mtx_を持って呼ぶ
+    static void complete(Stream &stream, Completion &completion) {
+        if (completion.result) {
+            stream.deliver_(std::move(*completion.result));
+        } else if (completion.failed && stream.drop_) {
+            stream.drop_(std::move(*completion.failed));
+        }
+    }
+
+    Clock::time_point oldest_arrival(std::size_t model) const {
+        auto oldest = Clock::time_point::max();
+        for (const auto &stream : streams_) {
+            if (stream->model_ == model && !stream->pending_.empty()) {
+                oldest = std::min(oldest, stream->pending_.front().second);
+            }
+        }
+        return oldest == Clock::time_point::max() ? Clock::now() : oldest;
+    }
+
+    // 1つの接続がバッチを占有しないよう、接続を順番に1フレームずつ取り出す。
+    // 全ての接続を一巡して何も取れなければ、数が合わなくても終える
+    void gather(std::size_t model, Batch &batch) {
+        std::size_t idle = 0;
+        while (batch.inputs.size() < max_batch_[model] &&
+               pending_count_[model] > 0 && idle < streams_.size()) {
+            next_stream_ %= streams_.size();
+            auto &stream = streams_[next_stream_++];
+            if (stream->model_ != model || stream->pending_.empty()) {
+                ++idle;
+                continue;
+            }
+            idle = 0;
+            batch.inputs.push_back(std::move(stream->pending_.front().first));
+            batch.owners.emplace_back(stream, stream->next_seq_++);
+            stream->pending_.pop_front();
+            --pending_count_[model];
+        }
+    }
+
+    std::vector<std::unique_ptr<Instance>> instances_;
+    // モデルごとの入力バッチサイズと未処理のフレーム数
+    std::vector<std::size_t> max_batch_;
+    std::chrono::microseconds max_wait_;
+    std::vector<std::shared_ptr<Stream>> streams_;
+    std::vector<std::size_t> pending_count_;
+    std::size_t next_stream_;
+    bool stop_;
+    mutable std::mutex mtx_;
+    std::condition_variable cv_;
+    std::thread worker_;
+};
@@ -0,0 +1,108 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// RESULT_FORMAT_BINARYの結果形式。BinaryResultHeaderの後に
+// 姿勢推定ならcount * points個のBinaryPosePoint、
+// 顔検出ならcount個のBinaryFaceRectが続く(ホストのバイトオーダー)
+#define BINARY_RESULT_MAGIC 0x31524245 // "EBR1"
+#define BINARY_RESULT_POSE 1
+#define BINARY_RESULT_FACE 2
+
+struct BinaryResultHeader {
+    std::uint32_t magic;
+    std::uint16_t kind;
+    std::uint16_t count;
+    std::uint16_t width;
+    std::uint16_t height;
+    std::uint16_t points;
+    std::uint16_t reserved;
+};
+
+struct BinaryPosePoint {
+    float x;
+    float y;
+    std::int32_t type;
+};
+
+// 座標と大きさはJSON形式と同じく画素単位
+struct BinaryFaceRect {
+    std::int32_t x;
+    std::int32_t y;
+    std::int32_t width;
+    std::int32_t height;
+    float score;
+};
+
+static_assert(sizeof(BinaryResultHeader) == 16, "unexpected padding");
+static_assert(sizeof(BinaryPosePoint) == 12, "unexpected padding");
+static_assert(sizeof(BinaryFaceRect) == 20, "unexpected padding");
+
+inline BinaryResultHeader *
+begin_binary_result(std::string &out, std::uint16_t kind, std::uint16_t count,
+                    std::uint16_t points, std::size_t body_size) {
+    out.resize(sizeof(BinaryResultHeader) + body_size);
+    auto *header = reinterpret_cast<BinaryResultHeader *>(&out[0]);
+    header->magic = BINARY_RESULT_MAGIC;
+    header->kind = kind;
+    header->count = count;
+    header->points = points;
+    header->reserved = 0;
+    return header;
+}
+
+// 受信バッファを参照するだけで、コピーやメモリ確保はしない
+class BinaryResultView {
+  public:
+    bool parse(const char *data, std::size_t size) {
+        if (size < sizeof(BinaryResultHeader)) {
+            return false;
+        }
+        header_ = reinterpret_cast<const BinaryResultHeader *>(data);
+        if (header_->magic != BINARY_RESULT_MAGIC) {
+            return false;
+        }
+        std::size_t body_size = size - sizeof(BinaryResultHeader);
+        if (header_->kind == BINARY_RESULT_POSE) {
+            return body_size == std::size_t(header_->count) *
+                                    header_->points * sizeof(BinaryPosePoint);
+        }
+        if (header_->kind == BINARY_RESULT_FACE) {
+            return body_size == header_->count * sizeof(BinaryFaceRect);
+        }
+        return false;
+    }
+
+    const BinaryResultHeader &header() const { return *header_; }
+
+    // i番目の人物の部位(header().points個)
+    const BinaryPosePoint *pose(std::size_t i) const {
+        return reinterpret_cast<const BinaryPosePoint *>(header_ + 1) +
+               i * header_->points;
+    }
+
+    const BinaryFaceRect &rect(std::size_t i) const {
+        return reinterpret_cast<const BinaryFaceRect *>(header_ + 1)[i];
+    }
+
+  private:
+    const BinaryResultHeader *header_ = nullptr;
+};
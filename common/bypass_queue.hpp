@@ -0,0 +1,139 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <optional>
+#include <ostream>
+
+#include "frame_pool.hpp"
+#include "tagged_frame.hpp"
+
+// DPUで推論するフレームと、推論せずにCPUで結果を作るフレームを受信した順に
+// 並べる。結果は全てのフレームについて受信した順に返すので、推論中のフレーム
+// より後ろのフレームは、その結果が届くまで待たせてから結果を作る。
+// Extraは推論しないフレームの結果を作るのに使う、フレームごとのデータ。
+// スレッドセーフではないので、呼び出し側でロックを取る
+template <typename Result, typename Extra> class BypassQueue {
+  public:
+    struct Entry {
+        FrameHeader header;
+        FrameTimes times;
+        std::uint64_t index;
+        Extra extra;
+        bool infer = false;
+        // 推論の結果が届いた
+        bool done = false;
+        Tagged<Result> result;
+    };
+
+    // 推論したフレーム(entry.done)と、推論しないフレームの結果を作る
+    using Finish = std::function<Tagged<Result>(Entry &)>;
+    using Emit = std::function<void(Tagged<Result>)>;
+
+    BypassQueue(Finish finish, Emit emit)
+        : finish_(std::move(finish)), emit_(std::move(emit)) {}
+
+    // 推論するフレームはpushしてからスケジューラに渡す
+    void push(const TaggedFrame &frame, Extra extra, bool infer) {
+        Entry entry{frame.header, frame.times, frame.index, std::move(extra)};
+        entry.infer = infer;
+        entries_.push_back(std::move(entry));
+    }
+
+    // スケジューラから推論の結果を受け取る。結果は推論を頼んだ順に届くので、
+    // 前に頼んだフレームの結果が無ければ、推論できなかったものとして扱う。
+    // フレームは接続の中で受信した順番(index)で見分ける
+    void complete(Tagged<Result> result) {
+        for (auto &entry : entries_) {
+            if (!entry.infer || entry.done) {
+                continue;
+            }
+            if (entry.index == result.index) {
+                entry.done = true;
+                entry.result = std::move(result);
+                break;
+            }
+            entry.infer = false;
+        }
+    }
+
+    // スケジューラがキューの上限で捨てたフレームは推論しないものとして扱う
+    void cancel(const TaggedFrame &frame) {
+        for (auto &entry : entries_) {
+            if (entry.infer && !entry.done && entry.index == frame.index) {
+                entry.infer = false;
+                return;
+            }
+        }
+    }
+
+    // 先頭から、推論の結果を待っていないフレームの結果を返す
+    void drain() {
+        while (!entries_.empty()) {
+            Entry &entry = entries_.front();
+            if (entry.infer && !entry.done) {
+                return;
+            }
+            emit_(finish_(entry));
+            entries_.pop_front();
+        }
+    }
+
+  private:
+    Finish finish_;
+    Emit emit_;
+    std::deque<Entry> entries_;
+};
+
+// 一部のフレームを推論せずにCPUで結果を作る、接続ごとの段
+// (GatedStream, TrackingStream)。ModelPipelineがスケジューラとの間に挟む。
+// 結果は受信した順でなくてもよく、フレームIDを付けない接続ではサーバが並べ直す
+template <typename Result> class BypassStream {
+  public:
+    virtual ~BypassStream() = default;
+
+    // 受信した順に、受信側のスレッドでデコードする前に呼ぶ。前のフレームの
+    // 結果を使い回すフレームは、その結果を作るフレームのindexを返す。
+    // 使い回すフレームはデコードしない
+    virtual std::optional<std::uint64_t>
+    reuse(FramePool &, const ReceivedFrame &, const TaggedFrame &) {
+        return std::nullopt;
+    }
+
+    // デコードプールのスレッドで、前処理する前の画像から段で使う画像を
+    // 作る。frame.valueは推論の入力の形になっているので、元の画像が
+    // 要る段はここで用意する。複数のスレッドから同時に呼ばれる
+    virtual cv::Mat inspect(const cv::Mat &) { return cv::Mat(); }
+
+    // デコードしたフレームを受信した順に渡す。referenceはreuse()が返した値で、
+    // 値があればframe.valueは空になる。inspectedはinspect()が返した画像。
+    // 推論するフレームはコンストラクタで受け取ったsubmitでスケジューラに渡す
+    virtual void push(TaggedFrame frame, std::optional<std::uint64_t> reference,
+                      cv::Mat inspected) = 0;
+
+    // スケジューラから推論の結果を受け取る
+    virtual void inferred(Tagged<Result> result) = 0;
+
+    // スケジューラが捨てたフレームにも、推論せずに結果を返す
+    virtual void dropped(const TaggedFrame &frame) = 0;
+
+    // 接続を閉じるときに表示する集計
+    virtual void print(std::ostream &os) const = 0;
+};
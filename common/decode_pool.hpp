@@ -0,0 +1,149 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <opencv2/opencv.hpp>
+#include <thread>
+#include <vector>
+
+#include "trace.hpp"
+
+// 全ての接続で共有するデコードと前処理のスレッドプール。
+// 受信スレッドやDPUのスレッドとは別のスレッドで並列にデコードし、
+// 結果は接続ごとに受信した順番でdeliverへ渡す
+class DecodePool {
+  public:
+    using Work = std::function<cv::Mat()>;
+    using Deliver = std::function<void(cv::Mat)>;
+
+    // 接続ごとの並べ替えバッファ
+    class Stream {
+      public:
+        explicit Stream(Deliver deliver) : deliver_(std::move(deliver)) {}
+
+      private:
+        friend class DecodePool;
+        std::mutex mtx_;
+        Deliver deliver_;
+        std::uint64_t next_submit_ = 0;
+        std::uint64_t next_deliver_ = 0;
+        std::map<std::uint64_t, cv::Mat> done_;
+        bool closed_ = false;
+    };
+
+    explicit DecodePool(std::size_t num_threads) : stop_(false) {
+        for (std::size_t i = 0; i < std::max<std::size_t>(num_threads, 1);
+             ++i) {
+            workers_.emplace_back(&DecodePool::work, this);
+        }
+    }
+
+    ~DecodePool() {
+        std::unique_lock<std::mutex> lock(mtx_);
+        stop_ = true;
+        lock.unlock();
+        cv_.notify_all();
+        for (auto &worker : workers_) {
+            worker.join();
+        }
+    }
+
+    std::size_t num_threads() const { return workers_.size(); }
+
+    std::shared_ptr<Stream> open(Deliver deliver) {
+        return std::make_shared<Stream>(std::move(deliver));
+    }
+
+    // 以降に終わったフレームはdeliverに渡さない。
+    // deliverを実行中なら終わるまで待つ
+    void close(const std::shared_ptr<Stream> &stream) {
+        std::lock_guard<std::mutex> lock(stream->mtx_);
+        stream->closed_ = true;
+        stream->done_.clear();
+    }
+
+    // workは例外を投げると空のcv::Matを返したものとして扱う
+    void submit(const std::shared_ptr<Stream> &stream, Work work) {
+        std::unique_lock<std::mutex> stream_lock(stream->mtx_);
+        std::uint64_t seq = stream->next_submit_++;
+        stream_lock.unlock();
+        std::unique_lock<std::mutex> lock(mtx_);
+        tasks_.push_back({stream, seq, std::move(work)});
+        lock.unlock();
+        cv_.notify_one();
+    }
+
+  private:
+    struct Task {
+        std::shared_ptr<Stream> stream;
+        std::uint64_t seq;
+        Work work;
+    };
+
+    void work() {
+        trace_recorder().name_thread("decode");
+        while (true) {
+            std::unique_lock<std::mutex> lock(mtx_);
+            cv_.wait(lock, [this] { return stop_ || !tasks_.empty(); });
+            if (stop_) {
+                return;
+            }
+            Task task = std::move(tasks_.front());
+            tasks_.pop_front();
+            lock.unlock();
+
+            cv::Mat image;
+            try {
+                TraceScope scope("decode");
+                image = task.work();
+            } catch (const std::exception &) {
+                image = cv::Mat();
+            }
+            deliver(*task.stream, task.seq, std::move(image));
+        }
+    }
+
+    // 先に終わったフレームは、前のフレームが終わるまで保持しておく。
+    // deliverはストリームのロックを持ったまま呼ぶので、順番は入れ替わらない
+    void deliver(Stream &stream, std::uint64_t seq, cv::Mat image) {
+        std::lock_guard<std::mutex> lock(stream.mtx_);
+        if (stream.closed_) {
+            return;
+        }
+        stream.done_.emplace(seq, std::move(image));
+        auto it = stream.done_.begin();
+        while (it != stream.done_.end() && it->first == stream.next_deliver_) {
+            stream.deliver_(std::move(it->second));
+            it = stream.done_.erase(it);
+            ++stream.next_deliver_;
+        }
+    }
+
+    std::vector<std::thread> workers_;
+    std::deque<Task> tasks_;
+    bool stop_;
+    std::mutex mtx_;
+    std::condition_variable cv_;
+};
@@ -0,0 +1,172 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// RESULT_FORMAT_DELTAの結果形式。バイナリ形式の結果を4バイト単位で
+// 同じ接続で直前に送った結果と比べ、変わった範囲だけを送る。
+// DeltaResultHeaderの後にruns個の(DeltaRun, words * 4バイトのデータ)が続く。
+// キーフレームは直前の結果を使わず、全体を1つの範囲で送る
+#define DELTA_RESULT_MAGIC 0x31444245 // "EBD1"
+#define DELTA_FLAG_KEYFRAME 0x0001
+#define DEFAULT_DELTA_KEYFRAME_INTERVAL 30
+// この語数以下の変わっていない隙間は、範囲を分けずに続けて送る
+#define DELTA_MERGE_GAP_WORDS 2
+
+struct DeltaResultHeader {
+    std::uint32_t magic;
+    std::uint16_t flags;
+    std::uint16_t reserved;
+    // 復元したバイナリ形式の結果のバイト数
+    std::uint32_t size;
+    std::uint32_t runs;
+};
+
+struct DeltaRun {
+    // 4バイト単位の位置と長さ
+    std::uint32_t offset;
+    std::uint32_t words;
+};
+
+static_assert(sizeof(DeltaResultHeader) == 16, "unexpected padding");
+static_assert(sizeof(DeltaRun) == 8, "unexpected padding");
+
+// 比べやすいよう、4バイトの倍数になるまで0で埋める
+inline std::size_t delta_words(std::size_t size) { return (size + 3) / 4; }
+
+// サーバ側: 接続ごとに1つ持ち、送る順番に結果を渡す
+class DeltaEncoder {
+  public:
+    explicit DeltaEncoder(int keyframe_interval)
+        : keyframe_interval_(std::max(keyframe_interval, 1)) {}
+
+    std::string encode(const std::string &binary) {
+        std::size_t words = delta_words(binary.size());
+        std::string current(words * 4, '\0');
+        std::memcpy(&current[0], binary.data(), binary.size());
+        bool keyframe = since_keyframe_ == 0;
+        since_keyframe_ = (since_keyframe_ + 1) % keyframe_interval_;
+        // 前の結果より長くなった分は0と比べる
+        previous_.resize(current.size(), '\0');
+
+        DeltaResultHeader header{
+            DELTA_RESULT_MAGIC,
+            std::uint16_t(keyframe ? DELTA_FLAG_KEYFRAME : 0), 0,
+            std::uint32_t(binary.size()), 0};
+        std::string out(sizeof(header), '\0');
+        const char *cur = current.data();
+        const char *prev = previous_.data();
+        std::size_t i = 0;
+        while (i < words) {
+            if (!keyframe && std::memcmp(cur + i * 4, prev + i * 4, 4) == 0) {
+                ++i;
+                continue;
+            }
+            // 短い隙間を挟んで続く変化は1つの範囲にまとめる
+            std::size_t end = i + 1;
+            std::size_t gap = 0;
+            while (end + gap < words && gap <= DELTA_MERGE_GAP_WORDS) {
+                if (keyframe ||
+                    std::memcmp(cur + (end + gap) * 4, prev + (end + gap) * 4,
+                                4) != 0) {
+                    end += gap + 1;
+                    gap = 0;
+                } else {
+                    ++gap;
+                }
+            }
+            DeltaRun run{std::uint32_t(i), std::uint32_t(end - i)};
+            out.append(reinterpret_cast<const char *>(&run), sizeof(run));
+            out.append(cur + i * 4, (end - i) * 4);
+            ++header.runs;
+            i = end;
+        }
+        std::memcpy(&out[0], &header, sizeof(header));
+        previous_.swap(current);
+        raw_bytes_ += binary.size();
+        encoded_bytes_ += out.size();
+        return out;
+    }
+
+    std::size_t raw_bytes() const { return raw_bytes_; }
+    std::size_t encoded_bytes() const { return encoded_bytes_; }
+
+  private:
+    int keyframe_interval_;
+    int since_keyframe_ = 0;
+    std::string previous_;
+    std::size_t raw_bytes_ = 0;
+    std::size_t encoded_bytes_ = 0;
+};
+
+// クライアント側: 受け取った順に渡し、バイナリ形式の結果を復元する。
+// 最初のキーフレームより前の結果や、壊れた結果ならfalseを返す
+class DeltaDecoder {
+  public:
+    bool decode(const char *data, std::size_t size, std::string &out) {
+        DeltaResultHeader header;
+        if (size < sizeof(header)) {
+            return false;
+        }
+        std::memcpy(&header, data, sizeof(header));
+        if (header.magic != DELTA_RESULT_MAGIC) {
+            return false;
+        }
+        bool keyframe = (header.flags & DELTA_FLAG_KEYFRAME) != 0;
+        if (!keyframe && !has_base_) {
+            return false;
+        }
+        std::size_t words = delta_words(header.size);
+        if (keyframe) {
+            current_.assign(words * 4, '\0');
+        } else {
+            current_.resize(words * 4, '\0');
+        }
+        std::size_t pos = sizeof(header);
+        for (std::uint32_t n = 0; n < header.runs; ++n) {
+            DeltaRun run;
+            if (size - pos < sizeof(run)) {
+                return fail();
+            }
+            std::memcpy(&run, data + pos, sizeof(run));
+            pos += sizeof(run);
+            if (run.offset > words || run.words > words - run.offset ||
+                size - pos < std::size_t(run.words) * 4) {
+                return fail();
+            }
+            std::memcpy(&current_[run.offset * 4], data + pos, run.words * 4);
+            pos += run.words * 4;
+        }
+        has_base_ = true;
+        out.assign(current_.data(), header.size);
+        return true;
+    }
+
+  private:
+    // 壊れた結果の後は、次のキーフレームまで復元しない
+    bool fail() {
+        has_base_ = false;
+        return false;
+    }
+
+    std::string current_;
+    bool has_base_ = false;
+};
@@ -0,0 +1,140 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#ifdef WITH_VITIS_AI
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+#include <vitis/ai/configurable_dpu_task.hpp>
+
+#include "fused_preprocess.hpp"
+#include "inference_backend.hpp"
+
+// Vitis AI LibraryのDPUタスクを直接使うバックエンド。
+// ライブラリのモデルクラスはresize、平均・スケールの適用、量子化を別々の
+// 処理として行うが、ここではFusedPreprocessorで入力テンソルへ直接書き込み、
+// 後処理だけをライブラリの関数(PostProcess)に任せる。
+// prepare()で作った入力サイズのint8の画像は、そのまま入力テンソルへ写す
+template <typename Result>
+class DpuTaskBackend : public InferenceBackend<Result> {
+  public:
+    // 入力画像のサイズを受け取り、バッチ分の結果を返す
+    using PostProcess = std::function<std::vector<Result>(
+        vitis::ai::ConfigurableDpuTask &, const std::vector<cv::Size> &)>;
+
+    DpuTaskBackend(const std::string &model_path, PostProcess post_process)
+        : task_(vitis::ai::ConfigurableDpuTask::create(model_path, false)),
+          post_process_(std::move(post_process)) {
+        const auto &input = task_->getInputTensor()[0][0];
+        const auto &config = task_->getConfig();
+        float input_scale = std::exp2(static_cast<float>(input.fixpos));
+        for (int c = 0; c < 3; ++c) {
+            params_.mean[c] = config.kernel(0).mean(c);
+            params_.scale[c] = config.kernel(0).scale(c) * input_scale;
+        }
+        params_.swap_rb = config.is_rgb_input();
+    }
+
+    int input_width() const override { return task_->getInputWidth(); }
+    int input_height() const override { return task_->getInputHeight(); }
+    std::size_t input_batch() const override {
+        return task_->get_input_batch();
+    }
+    bool fuses_resize() const override { return true; }
+
+    // 入力テンソルと同じ並びのCV_8SC3の画像を返す
+    cv::Mat prepare(const cv::Mat &image) override {
+        cv::Mat prepared(input_height(), input_width(), CV_8SC3);
+        auto preprocessor = acquire();
+        preprocessor->run(image, prepared.ptr<std::int8_t>());
+        release(std::move(preprocessor));
+        return prepared;
+    }
+
+    Result run(const cv::Mat &image) override {
+        return run(std::vector<cv::Mat>{image})[0];
+    }
+
+    std::vector<Result> run(const std::vector<cv::Mat> &images) override {
+        const auto &input = task_->getInputTensor()[0][0];
+        std::size_t input_size = input.width * input.height * 3;
+        std::vector<cv::Size> sizes;
+        std::unique_ptr<FusedPreprocessor> preprocessor;
+        for (std::size_t i = 0; i < images.size(); ++i) {
+            auto *dst = static_cast<std::int8_t *>(input.get_data(i));
+            // prepare()済みなら結果は入力サイズの座標になる
+            if (prepared(images[i])) {
+                std::memcpy(dst, images[i].data, input_size);
+            } else {
+                if (!preprocessor) {
+                    preprocessor = acquire();
+                }
+                preprocessor->run(images[i], dst);
+            }
+            sizes.push_back(images[i].size());
+        }
+        if (preprocessor) {
+            release(std::move(preprocessor));
+        }
+        task_->run(0);
+        std::vector<Result> results = post_process_(*task_, sizes);
+        results.resize(images.size());
+        return results;
+    }
+
+  private:
+    bool prepared(const cv::Mat &image) const {
+        return image.type() == CV_8SC3 && image.isContinuous() &&
+               image.cols == input_width() && image.rows == input_height();
+    }
+
+    // FusedPreprocessorは作業用の表を持つので、スレッドごとに1つ使う。
+    // 使い終わったものは取っておき、次に呼んだスレッドで使い回す
+    std::unique_ptr<FusedPreprocessor> acquire() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!preprocessors_.empty()) {
+                auto preprocessor = std::move(preprocessors_.back());
+                preprocessors_.pop_back();
+                return preprocessor;
+            }
+        }
+        return std::make_unique<FusedPreprocessor>(
+            input_width(), input_height(), params_);
+    }
+
+    void release(std::unique_ptr<FusedPreprocessor> preprocessor) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        preprocessors_.push_back(std::move(preprocessor));
+    }
+
+    std::unique_ptr<vitis::ai::ConfigurableDpuTask> task_;
+    PostProcess post_process_;
+    QuantParams params_;
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<FusedPreprocessor>> preprocessors_;
+};
+
+#endif
@@ -0,0 +1,83 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstring>
+#include <opencv2/opencv.hpp>
+#include <vector>
+
+#include "protocol.hpp"
+
+// BGRをNV12(Y面の後にUVを交互に並べた面)に変換する。幅と高さは偶数であること
+inline void bgr_to_nv12(const cv::Mat &bgr, cv::Mat &i420, cv::Mat &nv12) {
+    int width = bgr.cols;
+    int height = bgr.rows;
+    cv::cvtColor(bgr, i420, cv::COLOR_BGR2YUV_I420);
+    nv12.create(height * 3 / 2, width, CV_8UC1);
+    std::size_t y_size = std::size_t(width) * height;
+    std::size_t c_size = y_size / 4;
+    std::memcpy(nv12.data, i420.data, y_size);
+    const uchar *u = i420.data + y_size;
+    const uchar *v = u + c_size;
+    uchar *uv = nv12.data + y_size;
+    for (std::size_t i = 0; i < c_size; ++i) {
+        uv[2 * i] = u[i];
+        uv[2 * i + 1] = v[i];
+    }
+}
+
+// クライアント側: ネゴシエーションで決まった形式にフレームを変換する。
+// 変換の途中で使うcv::Matは使い回すので、1つのスレッドから呼び出すこと
+class FrameEncoder {
+  public:
+    FrameEncoder(const SessionOptions &options, int jpeg_quality)
+        : options_(options), jpeg_quality_(jpeg_quality) {}
+
+    void encode(const cv::Mat &frame, std::vector<uchar> &out) {
+        if (!is_raw_frame_format(options_)) {
+            cv::imencode(".jpg", frame, out,
+                         {cv::IMWRITE_JPEG_QUALITY, jpeg_quality_});
+            return;
+        }
+        const cv::Mat *src = &frame;
+        cv::Size size(options_.frame_width, options_.frame_height);
+        if (frame.size() != size) {
+            cv::resize(frame, resized_, size);
+            src = &resized_;
+        }
+        if (options_.frame_format == FRAME_FORMAT_NV12) {
+            bgr_to_nv12(*src, i420_, nv12_);
+            src = &nv12_;
+        } else if (!src->isContinuous()) {
+            resized_ = src->clone();
+            src = &resized_;
+        }
+        if (options_.frame_compression == FRAME_COMPRESSION_PNG) {
+            // 速度優先で最も軽い圧縮レベルを使う
+            cv::imencode(".png", *src, out, {cv::IMWRITE_PNG_COMPRESSION, 1});
+            return;
+        }
+        out.assign(src->data, src->data + src->total() * src->elemSize());
+    }
+
+  private:
+    SessionOptions options_;
+    int jpeg_quality_;
+    cv::Mat resized_;
+    cv::Mat i420_;
+    cv::Mat nv12_;
+};
@@ -0,0 +1,383 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <opencv2/opencv.hpp>
+#include <ostream>
+
+#include "jpeg_header.hpp"
+#include "protocol.hpp"
+#include "shared_frame_ring.hpp"
+
+struct FramePoolStats {
+    std::size_t frames = 0;
+    std::size_t buffer_allocs = 0;
+    std::size_t decode_allocs = 0;
+    std::size_t reduced_decodes = 0;
+};
+
+inline std::ostream &operator<<(std::ostream &os, const FramePoolStats &stats) {
+    return os << stats.frames << " frames, " << stats.buffer_allocs
+              << " receive buffer allocations, " << stats.decode_allocs
+              << " decode allocations, " << stats.reduced_decodes
+              << " reduced decodes";
+}
+
+// 受信し終えたフレーム。FramePool::take()で受け取り、decode()に渡す
+struct ReceivedFrame {
+    // 受信バッファの番号
+    int buffer = -1;
+    // 無圧縮のBGRを直接読み込んだcv::Matの番号
+    int direct = -1;
+    std::size_t size = 0;
+};
+
+// 接続ごとに受信バッファとデコード先のcv::Matを使い回す。
+// 定常状態では受信からデコードまでメモリ確保をしない。
+// receive_buffer()とtake()は1つの接続の受信側スレッドから呼び出す。
+// decode(frame, flags)は別のスレッドから並行に呼び出してよく、
+// デコード中のフレームの数だけバッファとcv::Matを持つ
+class FramePool {
+  public:
+    // ネゴシエーションで決まったフレームの形式を設定する
+    void set_format(const SessionOptions &options) { options_ = options; }
+
+    // 前処理で縮小する先のサイズ。JPEGはこのサイズを下回らない範囲で
+    // 縮小しながらデコードする
+    void set_target_size(const cv::Size &size) { target_size_ = size; }
+
+    // 共有メモリで受け渡す接続では、受信するのはSharedFrameDescriptorになり、
+    // フレームはスロットから直接デコードする
+    void attach(std::shared_ptr<SharedFrameRing> ring) {
+        ring_ = std::move(ring);
+    }
+
+    // 受信したデータはこのバッファへ直接読み込む。
+    // 無圧縮のBGRはデコード先のcv::Matへ直接読み込む
+    uchar *receive_buffer(std::size_t size) {
+        current_ = ReceivedFrame();
+        current_.size = size;
+        if (!ring_ && options_.frame_format == FRAME_FORMAT_BGR &&
+            options_.frame_compression == FRAME_COMPRESSION_NONE &&
+            size == raw_frame_size(options_)) {
+            current_.direct = acquire_slot();
+            cv::Mat &mat = slot(current_.direct).mat;
+            const uchar *prev = mat.data;
+            mat.create(options_.frame_height, options_.frame_width, CV_8UC3);
+            if (mat.data != prev) {
+                std::lock_guard<std::mutex> lock(mtx_);
+                ++stats_.decode_allocs;
+            }
+            return mat.data;
+        }
+        current_.buffer = acquire_buffer();
+        Buffer &received = buffer(current_.buffer);
+        if (size > received.capacity) {
+            received.capacity = size + size / 2;
+            received.data.reset(new uchar[received.capacity]);
+            std::lock_guard<std::mutex> lock(mtx_);
+            ++stats_.buffer_allocs;
+        }
+        return received.data.get();
+    }
+
+    // 直前のreceive_buffer()に読み込んだフレームを受け取る
+    ReceivedFrame take() {
+        ReceivedFrame frame = current_;
+        current_ = ReceivedFrame();
+        return frame;
+    }
+
+    // 受信したフレームを、下流で使われていないcv::Matへデコードする。
+    // flagsはJPEGのときだけ使う。生の画素のサイズが合わなければ空を返す
+    cv::Mat decode(const ReceivedFrame &frame, int flags) {
+        if (frame.direct >= 0) {
+            return release(frame, frame.direct, true, false);
+        }
+        std::size_t size;
+        SharedFrameDescriptor descriptor;
+        const uchar *data = received_data(frame, size, descriptor);
+        if (data == nullptr) {
+            return release(frame, -1, false, false);
+        }
+        int index = acquire_slot();
+        bool reduced = false;
+        bool ok = decode(data, size, flags, slot(index).mat, reduced);
+        if (ring_) {
+            ring_->release(descriptor.slot);
+        }
+        return release(frame, index, ok, reduced);
+    }
+
+    // クライアントが送った画像のサイズ。JPEGは縮小してデコードするので、
+    // 推論の結果をこのサイズの座標に戻すのに使う。分からなければ空を返す
+    cv::Size frame_size(const ReceivedFrame &frame) {
+        if (frame.direct >= 0 || is_raw_frame_format(options_)) {
+            return cv::Size(options_.frame_width, options_.frame_height);
+        }
+        std::size_t size;
+        SharedFrameDescriptor descriptor;
+        const uchar *data = received_data(frame, size, descriptor);
+        int width, height;
+        if (data == nullptr || !read_jpeg_size(data, size, width, height)) {
+            return cv::Size();
+        }
+        return cv::Size(width, height);
+    }
+
+    // 受信したフレームを縮小したグレースケールの画像にする。JPEGは1/8で
+    // デコードする。フレームは解放しないので、続けてdecode()かdiscard()を呼ぶ
+    cv::Mat thumbnail(const ReceivedFrame &frame, const cv::Size &size) {
+        cv::Mat gray;
+        if (frame.direct >= 0) {
+            cv::cvtColor(slot(frame.direct).mat, gray, cv::COLOR_BGR2GRAY);
+        } else {
+            std::size_t data_size;
+            SharedFrameDescriptor descriptor;
+            const uchar *data = received_data(frame, data_size, descriptor);
+            if (data == nullptr) {
+                return gray;
+            }
+            cv::Mat buf(1, static_cast<int>(data_size), CV_8UC1,
+                        const_cast<uchar *>(data));
+            if (!is_raw_frame_format(options_)) {
+                cv::imdecode(buf, cv::IMREAD_REDUCED_GRAYSCALE_8, &gray);
+            } else if (options_.frame_compression == FRAME_COMPRESSION_PNG) {
+                cv::imdecode(buf, cv::IMREAD_GRAYSCALE, &gray);
+            } else if (data_size == raw_frame_size(options_)) {
+                // NV12は先頭の輝度の面だけを使う
+                bool nv12 = options_.frame_format == FRAME_FORMAT_NV12;
+                cv::Mat src(options_.frame_height, options_.frame_width,
+                            nv12 ? CV_8UC1 : CV_8UC3, buf.data);
+                if (nv12) {
+                    gray = src;
+                } else {
+                    cv::cvtColor(src, gray, cv::COLOR_BGR2GRAY);
+                }
+            }
+        }
+        cv::Mat small;
+        if (!gray.empty()) {
+            cv::resize(gray, small, size, 0, 0, cv::INTER_AREA);
+        }
+        return small;
+    }
+
+    // デコードせずにフレームを解放する
+    void discard(const ReceivedFrame &frame) {
+        if (ring_ && frame.buffer >= 0 &&
+            frame.size == sizeof(SharedFrameDescriptor)) {
+            SharedFrameDescriptor descriptor;
+            std::memcpy(&descriptor, buffer(frame.buffer).data.get(),
+                        sizeof(descriptor));
+            if (ring_->frame(descriptor) != nullptr) {
+                ring_->release(descriptor.slot);
+            }
+        }
+        std::lock_guard<std::mutex> lock(mtx_);
+        ++stats_.frames;
+        if (frame.buffer >= 0) {
+            buffers_[frame.buffer].busy = false;
+        }
+        if (frame.direct >= 0) {
+            slots_[frame.direct].busy = false;
+        }
+    }
+
+    // 受信側スレッドでそのままデコードする
+    cv::Mat decode(int flags) { return decode(take(), flags); }
+
+    FramePoolStats stats() const {
+        std::lock_guard<std::mutex> lock(mtx_);
+        return stats_;
+    }
+
+  private:
+    struct Buffer {
+        std::unique_ptr<uchar[]> data;
+        std::size_t capacity = 0;
+        bool busy = false;
+    };
+
+    struct Slot {
+        cv::Mat mat;
+        const uchar *prev = nullptr;
+        bool busy = false;
+    };
+
+    // 受信したデータか、共有メモリのスロットのデータ
+    const uchar *received_data(const ReceivedFrame &frame, std::size_t &size,
+                               SharedFrameDescriptor &descriptor) {
+        const uchar *data = buffer(frame.buffer).data.get();
+        size = frame.size;
+        if (ring_) {
+            if (size != sizeof(descriptor)) {
+                return nullptr;
+            }
+            std::memcpy(&descriptor, data, sizeof(descriptor));
+            data = ring_->frame(descriptor);
+            size = descriptor.size;
+        }
+        return data;
+    }
+
+    bool decode(const uchar *data, std::size_t size, int flags, cv::Mat &dst,
+                bool &reduced) {
+        cv::Mat buf(1, static_cast<int>(size), CV_8UC1,
+                    const_cast<uchar *>(data));
+        if (is_raw_frame_format(options_)) {
+            return decode_raw(buf, dst);
+        }
+        int reduced_flags = reduce_flags(data, size, flags);
+        reduced = reduced_flags != flags;
+        cv::imdecode(buf, reduced_flags, &dst);
+        return true;
+    }
+
+    // 大きなJPEGを全画素デコードしてから捨てないよう、libjpegのDCT領域での
+    // 縮小(1/2, 1/4, 1/8)を使う。倍率はSOFマーカーの画像サイズから決め、
+    // 残りの縮小は前処理のresizeに任せる
+    int reduce_flags(const uchar *data, std::size_t size, int flags) const {
+        static const int reductions[][2] = {
+            {8, cv::IMREAD_REDUCED_COLOR_8},
+            {4, cv::IMREAD_REDUCED_COLOR_4},
+            {2, cv::IMREAD_REDUCED_COLOR_2}};
+        int width, height;
+        if (flags != cv::IMREAD_COLOR || target_size_.empty() ||
+            !read_jpeg_size(data, size, width, height)) {
+            return flags;
+        }
+        for (const auto &reduction : reductions) {
+            if (width / reduction[0] >= target_size_.width &&
+                height / reduction[0] >= target_size_.height) {
+                return reduction[1];
+            }
+        }
+        return flags;
+    }
+
+    bool decode_raw(const cv::Mat &buf, cv::Mat &dst) const {
+        int width = options_.frame_width;
+        int height = options_.frame_height;
+        bool nv12 = options_.frame_format == FRAME_FORMAT_NV12;
+        cv::Mat src;
+        if (options_.frame_compression == FRAME_COMPRESSION_PNG) {
+            if (!nv12) {
+                cv::imdecode(buf, cv::IMREAD_COLOR, &dst);
+                return dst.cols == width && dst.rows == height;
+            }
+            src = cv::imdecode(buf, cv::IMREAD_GRAYSCALE);
+        } else if (buf.total() == raw_frame_size(options_)) {
+            src = cv::Mat(nv12 ? height * 3 / 2 : height, width,
+                          nv12 ? CV_8UC1 : CV_8UC3, buf.data);
+        }
+        if (nv12) {
+            if (src.cols != width || src.rows != height * 3 / 2) {
+                return false;
+            }
+            cv::cvtColor(src, dst, cv::COLOR_YUV2BGR_NV12);
+            return true;
+        }
+        if (src.cols != width || src.rows != height) {
+            return false;
+        }
+        src.copyTo(dst);
+        return true;
+    }
+
+    // 使っていない受信バッファを探す。無ければ増やす
+    int acquire_buffer() {
+        std::lock_guard<std::mutex> lock(mtx_);
+        for (std::size_t i = 0; i < buffers_.size(); ++i) {
+            if (!buffers_[i].busy) {
+                buffers_[i].busy = true;
+                return static_cast<int>(i);
+            }
+        }
+        buffers_.emplace_back();
+        buffers_.back().busy = true;
+        return static_cast<int>(buffers_.size() - 1);
+    }
+
+    // 要素の参照は増やしても動かないが、dequeの索引は増やす側と競合する
+    Buffer &buffer(int index) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        return buffers_[index];
+    }
+
+    Slot &slot(int index) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        return slots_[index];
+    }
+
+    // デコード中でなく、プール以外から参照されていないcv::Matを探す。
+    // 無ければ増やす。参照カウントは下流のスレッドがcv::Matを手放すときに
+    // アトミックに減らすので、こちらもCV_XADDで読む
+    int acquire_slot() {
+        std::lock_guard<std::mutex> lock(mtx_);
+        for (std::size_t i = 0; i < slots_.size(); ++i) {
+            Slot &slot = slots_[i];
+            if (!slot.busy && (slot.mat.u == nullptr ||
+                               CV_XADD(&slot.mat.u->refcount, 0) == 1)) {
+                slot.busy = true;
+                slot.prev = slot.mat.data;
+                return static_cast<int>(i);
+            }
+        }
+        slots_.emplace_back();
+        slots_.back().busy = true;
+        return static_cast<int>(slots_.size() - 1);
+    }
+
+    // 受信バッファとcv::Matを空きに戻し、デコードした画像を返す。
+    // 戻す前に参照を増やしておくので、他のスレッドに使われることはない
+    cv::Mat release(const ReceivedFrame &frame, int index, bool ok,
+                    bool reduced) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        ++stats_.frames;
+        if (reduced) {
+            ++stats_.reduced_decodes;
+        }
+        if (frame.buffer >= 0) {
+            buffers_[frame.buffer].busy = false;
+        }
+        if (index < 0) {
+            return cv::Mat();
+        }
+        Slot &slot = slots_[index];
+        slot.busy = false;
+        if (index != frame.direct && slot.mat.data != slot.prev) {
+            ++stats_.decode_allocs;
+        }
+        return ok ? slot.mat : cv::Mat();
+    }
+
+    // スレッド間で共有するのは、受信バッファとcv::Matの使用状況と統計だけ。
+    // dequeなので要素を増やしても他のスレッドが使っている要素は動かない
+    mutable std::mutex mtx_;
+    std::deque<Buffer> buffers_;
+    std::deque<Slot> slots_;
+    ReceivedFrame current_;
+    SessionOptions options_;
+    cv::Size target_size_;
+    std::shared_ptr<SharedFrameRing> ring_;
+    FramePoolStats stats_;
+};
@@ -0,0 +1,239 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <opencv2/opencv.hpp>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// DPUの入力テンソルへの量子化のパラメータ。出力のチャネル順に並べる。
+// scaleには入力テンソルの固定小数点位置(2^fixpos)も掛けておく
+struct QuantParams {
+    float mean[3];
+    float scale[3];
+    // trueならBGRの画像をRGBの順でテンソルに書き込む
+    bool swap_rb;
+};
+
+// デコードしたBGR画像から、モデルの量子化済み入力テンソル(int8, NHWC)を
+// 1回の走査で作る。バイリニアの縮小、チャネルの並べ替え、平均・スケールの
+// 適用と量子化をまとめて行い、中間画像を作らない。
+// 縦方向の補間と量子化はAVX2(x86)またはNEON(AArch64)でベクトル化する
+class FusedPreprocessor {
+  public:
+    FusedPreprocessor(int dst_width, int dst_height, const QuantParams &params)
+        : dst_width_(dst_width), dst_height_(dst_height),
+          k_(dst_width * 3), b_(dst_width * 3) {
+        int order[3] = {0, 1, 2};
+        if (params.swap_rb) {
+            std::swap(order[0], order[2]);
+        }
+        for (int c = 0; c < 3; ++c) {
+            channel_[c] = order[c];
+        }
+        for (int x = 0; x < dst_width; ++x) {
+            for (int c = 0; c < 3; ++c) {
+                k_[x * 3 + c] = params.scale[c];
+                b_[x * 3 + c] = -params.mean[c] * params.scale[c];
+            }
+        }
+        rows_[0].resize(dst_width * 3);
+        rows_[1].resize(dst_width * 3);
+    }
+
+    void run(const cv::Mat &bgr, std::int8_t *dst) {
+        CV_Assert(bgr.type() == CV_8UC3);
+        run(bgr.data, bgr.cols, bgr.rows, bgr.step, dst);
+    }
+
+    void run(const std::uint8_t *src, int src_width, int src_height,
+             std::size_t src_step, std::int8_t *dst) {
+        prepare(src_width);
+        row_index_[0] = row_index_[1] = -1;
+        float scale_y = static_cast<float>(src_height) / dst_height_;
+        std::size_t n = static_cast<std::size_t>(dst_width_) * 3;
+        for (int y = 0; y < dst_height_; ++y) {
+            float sy = std::max((y + 0.5f) * scale_y - 0.5f, 0.0f);
+            int y0 = std::min(static_cast<int>(sy), src_height - 1);
+            int y1 = std::min(y0 + 1, src_height - 1);
+            float fy = y0 == y1 ? 0.0f : sy - y0;
+            const float *r0 = row(src, src_step, y0, 0);
+            const float *r1 = fy == 0.0f ? r0 : row(src, src_step, y1, 1);
+            blend_quantize(r0, r1, fy, dst + y * n, n);
+        }
+    }
+
+  private:
+    // 横方向の補間の係数は入力の幅が変わったときだけ作り直す
+    void prepare(int src_width) {
+        if (src_width == src_width_) {
+            return;
+        }
+        src_width_ = src_width;
+        x0_.resize(dst_width_);
+        x1_.resize(dst_width_);
+        fx_.resize(dst_width_);
+        float scale_x = static_cast<float>(src_width) / dst_width_;
+        for (int x = 0; x < dst_width_; ++x) {
+            float sx = std::max((x + 0.5f) * scale_x - 0.5f, 0.0f);
+            int x0 = std::min(static_cast<int>(sx), src_width - 1);
+            int x1 = std::min(x0 + 1, src_width - 1);
+            x0_[x] = x0 * 3;
+            x1_[x] = x1 * 3;
+            fx_[x] = x0 == x1 ? 0.0f : sx - x0;
+        }
+    }
+
+    // 入力のsy行目を横方向に補間した行を返す。直前の2行は使い回す
+    const float *row(const std::uint8_t *src, std::size_t src_step, int sy,
+                     int slot) {
+        if (row_index_[slot] == sy) {
+            return rows_[slot].data();
+        }
+        if (row_index_[1 - slot] == sy) {
+            std::swap(rows_[0], rows_[1]);
+            std::swap(row_index_[0], row_index_[1]);
+            return rows_[slot].data();
+        }
+        const std::uint8_t *line = src + sy * src_step;
+        float *out = rows_[slot].data();
+        if (channel_[0] == 0) {
+            resample_row<0>(line, out);
+        } else {
+            resample_row<2>(line, out);
+        }
+        row_index_[slot] = sy;
+        return out;
+    }
+
+    // Rは入力の何番目のチャネルを出力の先頭に置くか(BGRのままなら0)
+    template <int R> void resample_row(const std::uint8_t *line, float *out) {
+        const int *x0 = x0_.data();
+        const int *x1 = x1_.data();
+        const float *fx = fx_.data();
+        int width = dst_width_;
+        if (src_width_ == width) {
+            for (int x = 0; x < width; ++x, line += 3, out += 3) {
+                out[0] = line[R];
+                out[1] = line[1];
+                out[2] = line[2 - R];
+            }
+            return;
+        }
+        for (int x = 0; x < width; ++x, out += 3) {
+            const std::uint8_t *p0 = line + x0[x];
+            const std::uint8_t *p1 = line + x1[x];
+            float w = fx[x];
+            float a0 = p0[R], a1 = p0[1], a2 = p0[2 - R];
+            out[0] = a0 + (p1[R] - a0) * w;
+            out[1] = a1 + (p1[1] - a1) * w;
+            out[2] = a2 + (p1[2 - R] - a2) * w;
+        }
+    }
+
+    void blend_quantize(const float *r0, const float *r1, float fy,
+                        std::int8_t *dst, std::size_t n) {
+        std::size_t i = 0;
+#if defined(__x86_64__) || defined(__i386__)
+        static const bool has_avx2 = __builtin_cpu_supports("avx2");
+        if (has_avx2) {
+            i = blend_quantize_avx2(r0, r1, fy, k_.data(), b_.data(), dst, n);
+        }
+#elif defined(__aarch64__)
+        i = blend_quantize_neon(r0, r1, fy, k_.data(), b_.data(), dst, n);
+#endif
+        for (; i < n; ++i) {
+            float v = (r0[i] + (r1[i] - r0[i]) * fy) * k_[i] + b_[i];
+            v = std::nearbyint(v);
+            dst[i] = static_cast<std::int8_t>(std::min(std::max(v, -128.0f),
+                                                       127.0f));
+        }
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    // 16要素ずつ処理し、処理した要素数を返す
+    __attribute__((target("avx2"))) static std::size_t
+    blend_quantize_avx2(const float *r0, const float *r1, float fy,
+                        const float *k, const float *b, std::int8_t *dst,
+                        std::size_t n) {
+        __m256 vfy = _mm256_set1_ps(fy);
+        std::size_t i = 0;
+        for (; i + 16 <= n; i += 16) {
+            __m256i q[2];
+            for (int j = 0; j < 2; ++j) {
+                __m256 a = _mm256_loadu_ps(r0 + i + j * 8);
+                __m256 d = _mm256_sub_ps(_mm256_loadu_ps(r1 + i + j * 8), a);
+                __m256 v = _mm256_add_ps(a, _mm256_mul_ps(d, vfy));
+                __m256 vk = _mm256_loadu_ps(k + i + j * 8);
+                __m256 vb = _mm256_loadu_ps(b + i + j * 8);
+                v = _mm256_add_ps(_mm256_mul_ps(v, vk), vb);
+                q[j] = _mm256_cvtps_epi32(v);
+            }
+            // packsは128ビットのレーンごとに働くので並びを直す
+            __m256i s16 = _mm256_permute4x64_epi64(
+                _mm256_packs_epi32(q[0], q[1]), 0xD8);
+            __m128i s8 = _mm_packs_epi16(_mm256_castsi256_si128(s16),
+                                         _mm256_extracti128_si256(s16, 1));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), s8);
+        }
+        return i;
+    }
+#elif defined(__aarch64__)
+    static std::size_t blend_quantize_neon(const float *r0, const float *r1,
+                                           float fy, const float *k,
+                                           const float *b, std::int8_t *dst,
+                                           std::size_t n) {
+        float32x4_t vfy = vdupq_n_f32(fy);
+        std::size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            int32x4_t q[2];
+            for (int j = 0; j < 2; ++j) {
+                float32x4_t a = vld1q_f32(r0 + i + j * 4);
+                float32x4_t d = vsubq_f32(vld1q_f32(r1 + i + j * 4), a);
+                float32x4_t v = vfmaq_f32(a, d, vfy);
+                v = vfmaq_f32(vld1q_f32(b + i + j * 4), v,
+                              vld1q_f32(k + i + j * 4));
+                q[j] = vcvtnq_s32_f32(v);
+            }
+            int16x8_t s16 = vcombine_s16(vqmovn_s32(q[0]), vqmovn_s32(q[1]));
+            vst1_s8(dst + i, vqmovn_s16(s16));
+        }
+        return i;
+    }
+#endif
+
+    int dst_width_;
+    int dst_height_;
+    int src_width_ = 0;
+    int channel_[3];
+    std::vector<float> k_;
+    std::vector<float> b_;
+    std::vector<int> x0_;
+    std::vector<int> x1_;
+    std::vector<float> fx_;
+    std::vector<float> rows_[2];
+    int row_index_[2] = {-1, -1};
+};
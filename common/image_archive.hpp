@@ -0,0 +1,197 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+// エンコード済みの画像(JPEG, PNG)を1つにまとめたファイル。
+// ImageArchiveHeader, 画像のデータ, ImageArchiveEntryの配列, ファイル名を
+// 順に並べたもの(ホストのバイトオーダー)。読み込み時はファイル全体を
+// mmapするので、画像ごとのopenやreadが無い
+#define IMAGE_ARCHIVE_MAGIC 0x31414945 // "EIA1"
+
+struct ImageArchiveHeader {
+    std::uint32_t magic = IMAGE_ARCHIVE_MAGIC;
+    std::uint32_t count = 0;
+    // ImageArchiveEntryの配列の位置
+    std::uint64_t index_offset = 0;
+};
+
+// ファイル名は配列の後に、画像と同じ順番で区切り無しに並べる
+struct ImageArchiveEntry {
+    std::uint64_t offset;
+    std::uint32_t size;
+    std::uint32_t name_size;
+};
+
+static_assert(sizeof(ImageArchiveHeader) == 16, "unexpected padding");
+static_assert(sizeof(ImageArchiveEntry) == 16, "unexpected padding");
+
+// ディレクトリの.jpgと.pngのファイルを名前の順にすべて取得する
+inline std::vector<std::string> get_file_names(std::string images_directory) {
+    std::set<std::filesystem::path> contents_of_dir;
+    for (const auto &file :
+         std::filesystem::directory_iterator(images_directory)) {
+        if (file.path().extension() == ".jpg" ||
+            file.path().extension() == ".png") {
+            contents_of_dir.insert(file.path());
+        }
+    }
+    std::vector<std::string> file_names(contents_of_dir.begin(),
+                                        contents_of_dir.end());
+    return file_names;
+}
+
+// 先頭がIMAGE_ARCHIVE_MAGICのファイルならアーカイブとみなす
+inline bool is_image_archive(const std::string &path) {
+    std::ifstream in(path, std::ios::binary);
+    std::uint32_t magic = 0;
+    in.read(reinterpret_cast<char *>(&magic), sizeof(magic));
+    return in && magic == IMAGE_ARCHIVE_MAGIC;
+}
+
+class ImageArchiveWriter {
+  public:
+    explicit ImageArchiveWriter(const std::string &path)
+        : out_(path, std::ios::binary | std::ios::trunc) {
+        if (!out_) {
+            throw std::runtime_error("cannot open " + path);
+        }
+        ImageArchiveHeader header;
+        out_.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        offset_ = sizeof(header);
+    }
+
+    void add(const std::string &name, const char *data, std::size_t size) {
+        out_.write(data, size);
+        entries_.push_back({offset_, std::uint32_t(size),
+                            std::uint32_t(name.size())});
+        names_ += name;
+        offset_ += size;
+    }
+
+    // 索引を書き込んで閉じる
+    void finish() {
+        ImageArchiveHeader header;
+        header.count = entries_.size();
+        header.index_offset = offset_;
+        out_.write(reinterpret_cast<const char *>(entries_.data()),
+                   entries_.size() * sizeof(ImageArchiveEntry));
+        out_.write(names_.data(), names_.size());
+        out_.seekp(0);
+        out_.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        out_.close();
+        if (!out_) {
+            throw std::runtime_error("failed to write archive");
+        }
+    }
+
+  private:
+    std::ofstream out_;
+    std::uint64_t offset_;
+    std::vector<ImageArchiveEntry> entries_;
+    std::string names_;
+};
+
+class ImageArchive {
+  public:
+    explicit ImageArchive(const std::string &path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("cannot open " + path);
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 ||
+            std::size_t(st.st_size) < sizeof(ImageArchiveHeader)) {
+            ::close(fd);
+            throw std::runtime_error("invalid archive: " + path);
+        }
+        size_ = st.st_size;
+        void *addr = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (addr == MAP_FAILED) {
+            throw std::runtime_error("cannot map " + path);
+        }
+        data_ = static_cast<const char *>(addr);
+        // 画像はほぼ先頭から順に読むので、カーネルに大きく先読みさせる
+        madvise(addr, size_, MADV_SEQUENTIAL);
+        try {
+            load_index();
+        } catch (...) {
+            munmap(addr, size_);
+            throw;
+        }
+    }
+
+    ~ImageArchive() { munmap(const_cast<char *>(data_), size_); }
+
+    ImageArchive(const ImageArchive &) = delete;
+    ImageArchive &operator=(const ImageArchive &) = delete;
+
+    std::size_t count() const { return entries_.size(); }
+
+    const std::vector<std::string> &names() const { return names_; }
+
+    // i番目の画像のエンコードされたデータ(コピーせずmmapした領域を指す)
+    const char *data(std::size_t i) const {
+        return data_ + entries_[i].offset;
+    }
+
+    std::size_t size(std::size_t i) const { return entries_[i].size; }
+
+  private:
+    void load_index() {
+        ImageArchiveHeader header;
+        std::memcpy(&header, data_, sizeof(header));
+        std::uint64_t entries_size =
+            std::uint64_t(header.count) * sizeof(ImageArchiveEntry);
+        if (header.magic != IMAGE_ARCHIVE_MAGIC ||
+            header.index_offset > size_ ||
+            entries_size > size_ - header.index_offset) {
+            throw std::runtime_error("invalid archive");
+        }
+        entries_.resize(header.count);
+        std::memcpy(entries_.data(), data_ + header.index_offset,
+                    entries_size);
+        std::uint64_t name_offset = header.index_offset + entries_size;
+        for (const auto &entry : entries_) {
+            if (entry.offset > header.index_offset ||
+                entry.size > header.index_offset - entry.offset ||
+                entry.name_size > size_ - name_offset) {
+                throw std::runtime_error("invalid archive");
+            }
+            names_.emplace_back(data_ + name_offset, entry.name_size);
+            name_offset += entry.name_size;
+        }
+    }
+
+    const char *data_;
+    std::size_t size_;
+    std::vector<ImageArchiveEntry> entries_;
+    std::vector<std::string> names_;
+};
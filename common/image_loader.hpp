@@ -0,0 +1,150 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <fcntl.h>
+#include <functional>
+#include <mutex>
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "decode_pool.hpp"
+#include "image_archive.hpp"
+#include "trace.hpp"
+
+// 読み込み中と、読み込み済みで渡していない画像の数の上限の既定値
+#define DEFAULT_LOAD_WINDOW 16
+
+// ファイルの内容をすべて読む。読めなければ空を返す
+inline std::vector<uchar> read_file(const std::string &path) {
+    std::vector<uchar> buf;
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return buf;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        buf.resize(st.st_size);
+        std::size_t done = 0;
+        while (done < buf.size()) {
+            ssize_t n = ::read(fd, buf.data() + done, buf.size() - done);
+            if (n <= 0) {
+                break;
+            }
+            done += n;
+        }
+        buf.resize(done);
+    }
+    ::close(fd);
+    return buf;
+}
+
+// これから読むファイルをカーネルに先読みさせる
+inline void advise_will_need(const std::string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    ::close(fd);
+}
+
+// 画像ファイルかアーカイブの画像をDecodePoolで並列に読み込み、順番に渡す。
+// 読み込み中と渡していない画像はwindow枚までで、それ以上は渡し終えるまで
+// 次のファイルを読まないので、画像がいくら多くてもメモリは増えない。
+// 読めなかったファイルは空のcv::Matとして渡す
+class ImageLoader {
+  public:
+    using Deliver = std::function<void(cv::Mat)>;
+
+    ImageLoader(std::size_t num_threads, std::size_t window)
+        : pool_(num_threads), window_(std::max<std::size_t>(window, 1)) {}
+
+    // 全ての画像をdeliverに渡し終えたら戻る。
+    // deliverが詰まっている間は次のファイルを読まない
+    void run(const std::vector<std::string> &paths, const Deliver &deliver) {
+        run_indexed(
+            paths.size(),
+            [&paths](std::size_t i) { advise_will_need(paths[i]); },
+            [&paths](std::size_t i) {
+                std::vector<uchar> buf = read_file(paths[i]);
+                if (buf.empty()) {
+                    return cv::Mat();
+                }
+                return cv::imdecode(buf, cv::IMREAD_COLOR);
+            },
+            deliver);
+    }
+
+    // アーカイブの画像はmmapした領域から直接デコードする
+    void run(const ImageArchive &archive, const Deliver &deliver) {
+        run_indexed(
+            archive.count(), [](std::size_t) {},
+            [&archive](std::size_t i) {
+                cv::Mat buf(1, archive.size(i), CV_8UC1,
+                            const_cast<char *>(archive.data(i)));
+                return cv::imdecode(buf, cv::IMREAD_COLOR);
+            },
+            deliver);
+    }
+
+  private:
+    void run_indexed(std::size_t count,
+                     const std::function<void(std::size_t)> &advise,
+                     const std::function<cv::Mat(std::size_t)> &load,
+                     const Deliver &deliver) {
+        auto stream = pool_.open([this, &deliver](cv::Mat image) {
+            deliver(std::move(image));
+            std::lock_guard<std::mutex> lock(mtx_);
+            --in_flight_;
+            cv_.notify_all();
+        });
+        for (std::size_t i = 0; i < std::min(window_, count); ++i) {
+            advise(i);
+        }
+        for (std::size_t i = 0; i < count; ++i) {
+            std::unique_lock<std::mutex> lock(mtx_);
+            cv_.wait(lock, [this] { return in_flight_ < window_; });
+            ++in_flight_;
+            lock.unlock();
+            // 読み込みを始めた画像のwindow枚先を先読みしておく
+            if (i + window_ < count) {
+                advise(i + window_);
+            }
+            pool_.submit(stream, [&load, i] {
+                TraceScope scope("read", i);
+                return load(i);
+            });
+        }
+        std::unique_lock<std::mutex> lock(mtx_);
+        cv_.wait(lock, [this] { return in_flight_ == 0; });
+        pool_.close(stream);
+    }
+
+    DecodePool pool_;
+    std::size_t window_;
+    std::size_t in_flight_ = 0;
+    std::mutex mtx_;
+    std::condition_variable cv_;
+};
@@ -0,0 +1,109 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <opencv2/opencv.hpp>
+#include <random>
+#include <thread>
+#include <vector>
+
+// サーバと*_seqが推論処理を呼び出すためのインタフェース
+template <typename Result> class InferenceBackend {
+  public:
+    virtual ~InferenceBackend() = default;
+    virtual int input_width() const = 0;
+    virtual int input_height() const = 0;
+    virtual std::size_t input_batch() const = 0;
+    // 任意のサイズの画像を受け取り、入力サイズへの縮小を推論の前処理と
+    // 一緒に行う場合はtrue。falseなら呼び出し側で入力サイズに揃える
+    virtual bool fuses_resize() const { return false; }
+    // fuses_resize()がtrueのバックエンドで、推論の前処理をrun()の前に
+    // 済ませておく。サーバはデコードプールのスレッドから並行して呼び、
+    // 返した画像をrun()に渡す。run()はデコードした画像もそのまま受け取る
+    virtual cv::Mat prepare(const cv::Mat &image) { return image; }
+    virtual Result run(const cv::Mat &image) = 0;
+    virtual std::vector<Result> run(const std::vector<cv::Mat> &images) = 0;
+};
+
+// Vitis AI Libraryのモデルクラス(OpenPose, FaceDetectなど)を包む
+template <typename Model, typename Result>
+class VitisBackend : public InferenceBackend<Result> {
+  public:
+    explicit VitisBackend(std::unique_ptr<Model> model)
+        : model_(std::move(model)) {}
+
+    int input_width() const override { return model_->getInputWidth(); }
+    int input_height() const override { return model_->getInputHeight(); }
+    std::size_t input_batch() const override {
+        return model_->get_input_batch();
+    }
+    Result run(const cv::Mat &image) override { return model_->run(image); }
+    std::vector<Result> run(const std::vector<cv::Mat> &images) override {
+        return model_->run(images);
+    }
+
+  private:
+    std::unique_ptr<Model> model_;
+};
+
+// FPGAを使わずに推論時間を模擬するバックエンド。
+// 1回の実行に base + per_frame * バッチ内のフレーム数 だけ待ち、
+// generateで作った結果を返す
+template <typename Result>
+class SyntheticBackend : public InferenceBackend<Result> {
+  public:
+    using Generate = std::function<Result(const cv::Mat &, std::mt19937 &)>;
+
+    SyntheticBackend(int width, int height, std::size_t batch,
+                     std::chrono::microseconds base,
+                     std::chrono::microseconds per_frame, Generate generate)
+        : width_(width), height_(height), batch_(batch), base_(base),
+          per_frame_(per_frame), generate_(std::move(generate)),
+          rng_(std::random_device()()) {}
+
+    int input_width() const override { return width_; }
+    int input_height() const override { return height_; }
+    std::size_t input_batch() const override { return batch_; }
+
+    Result run(const cv::Mat &image) override {
+        std::this_thread::sleep_for(base_ + per_frame_);
+        return generate_(image, rng_);
+    }
+
+    std::vector<Result> run(const std::vector<cv::Mat> &images) override {
+        std::this_thread::sleep_for(
+            base_ + per_frame_ * static_cast<long>(images.size()));
+        std::vector<Result> results;
+        results.reserve(images.size());
+        for (const auto &image : images) {
+            results.push_back(generate_(image, rng_));
+        }
+        return results;
+    }
+
+  private:
+    int width_;
+    int height_;
+    std::size_t batch_;
+    std::chrono::microseconds base_;
+    std::chrono::microseconds per_frame_;
+    Generate generate_;
+    std::mt19937 rng_;
+};
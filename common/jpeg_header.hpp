@@ -0,0 +1,66 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// JPEGのSOFマーカーから画像のサイズを読む。全体をデコードせずに
+// 縮小デコードの倍率を決めるために使う。読めなければfalseを返す
+inline bool read_jpeg_size(const std::uint8_t *data, std::size_t size,
+                           int &width, int &height) {
+    if (size < 4 || data[0] != 0xFF || data[1] != 0xD8) {
+        return false;
+    }
+    std::size_t pos = 2;
+    while (pos + 4 <= size) {
+        if (data[pos] != 0xFF) {
+            return false;
+        }
+        std::uint8_t marker = data[pos + 1];
+        // マーカーの前の埋め草
+        if (marker == 0xFF) {
+            ++pos;
+            continue;
+        }
+        // 長さを持たないマーカー
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+            pos += 2;
+            continue;
+        }
+        // SOSより後は圧縮データなので、それまでにSOFが無ければ諦める
+        if (marker == 0xD9 || marker == 0xDA) {
+            return false;
+        }
+        std::size_t length = (data[pos + 2] << 8) | data[pos + 3];
+        if (length < 2) {
+            return false;
+        }
+        // SOF0〜SOF15(DHT, JPG, DACを除く)
+        if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 &&
+            marker != 0xC8 && marker != 0xCC) {
+            if (length < 7 || pos + 9 > size) {
+                return false;
+            }
+            height = (data[pos + 5] << 8) | data[pos + 6];
+            width = (data[pos + 7] << 8) | data[pos + 8];
+            return width > 0 && height > 0;
+        }
+        pos += 2 + length;
+    }
+    return false;
+}
@@ -0,0 +1,194 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <opencv2/opencv.hpp>
+#include <ostream>
+#include <string>
+
+#include "batch_scheduler.hpp"
+#include "bypass_queue.hpp"
+#include "frame_pool.hpp"
+#include "protocol.hpp"
+#include "queue_limit.hpp"
+#include "tagged_frame.hpp"
+
+// 1つのモデルで全てのフレームを推論する接続の処理(姿勢推定、顔検出)。
+// ThreadedServerとAsyncServerが接続ごとに作り、次の順に呼ぶ。
+//  receive(): 受信した順に、受信側のスレッドで
+//  decode(): デコードプールのスレッドで並列に。decodes()がfalseのフレームは
+//            空の画像を返してよい
+//  push(): デコードが終わったフレームを受信した順に
+// 推論の結果はemitへ、結果を返さずに捨てたフレームはdropへ渡す
+template <typename Result_> class ModelPipeline {
+  public:
+    using Result = Result_;
+    using Scheduler = BatchScheduler<TaggedFrame, Tagged<Result>>;
+    using Emit = std::function<void(Tagged<Result>)>;
+    using Drop = std::function<void(const TaggedFrame &)>;
+    using Submit = std::function<void(TaggedFrame)>;
+    using Bypass = BypassStream<Result>;
+
+    struct Frame {
+        TaggedFrame tagged;
+        // 前のフレームの結果を使い回すなら、その結果を作るフレームのindex
+        std::optional<std::uint64_t> reference;
+        // デコードプールのスレッドでBypassStream::inspect()が作った画像。
+        // Frameはコピーしてデコードに渡すので、push()とは共有して受け取る
+        std::shared_ptr<cv::Mat> inspected;
+    };
+
+    // ネゴシエーションで受け付けるフレームのヘッダ
+    static constexpr std::uint16_t frame_headers = FRAME_HEADER_SEQUENCE;
+
+    // 全ての接続で共有する設定
+    struct Context {
+        Scheduler &scheduler;
+        QueueLimit queue_limit;
+        // モデルの入力サイズ。生の画素はこのサイズで送ってもらう
+        cv::Size input_size;
+        std::function<cv::Mat(cv::Mat)> preprocess;
+        std::function<std::string(const Result &, const SessionOptions &)>
+            serialize;
+        // 推論しないフレームの結果を作る段を接続ごとに作る。
+        // 空なら全てのフレームを推論する
+        std::function<std::unique_ptr<Bypass>(Submit, Emit)> bypass;
+    };
+
+    ModelPipeline(Context &context, Emit emit, Drop drop)
+        : context_(context), state_(std::make_shared<State>()) {
+        state_->emit = std::move(emit);
+        state_->drop = std::move(drop);
+        // スケジューラは接続を閉じた後にも実行中のバッチの結果を返すので、
+        // コールバックはstate_が残っているときだけ呼ぶ
+        std::weak_ptr<State> weak_state = state_;
+        stream_ = context_.scheduler.open(
+            [weak_state](Tagged<Result> result) {
+                if (auto state = weak_state.lock()) {
+                    if (state->bypass) {
+                        state->bypass->inferred(std::move(result));
+                    } else {
+                        state->emit(std::move(result));
+                    }
+                }
+            },
+            context_.queue_limit);
+        // キューのポリシーで捨てたフレームと推論に失敗したフレーム
+        stream_->set_drop([weak_state](TaggedFrame frame) {
+            if (auto state = weak_state.lock()) {
+                if (state->bypass) {
+                    state->bypass->dropped(frame);
+                } else {
+                    state->drop(frame);
+                }
+            }
+        });
+        if (context_.bypass) {
+            Scheduler &scheduler = context_.scheduler;
+            auto stream = stream_;
+            state_->bypass = context_.bypass(
+                [&scheduler, stream](TaggedFrame frame) {
+                    scheduler.submit(stream, std::move(frame));
+                },
+                state_->emit);
+        }
+    }
+
+    cv::Size frame_size() const { return context_.input_size; }
+
+    // フレームIDを付ける接続では、結果を終わった順に返す。
+    // 推論しないフレームを挟む接続は、推論の結果を頼んだ順に受け取る
+    void set_frame_ids() {
+        if (!state_->bypass) {
+            stream_->set_ordered(false);
+        }
+    }
+
+    // 結果を使い回すかどうかは、受信した順にここで決める
+    bool receive(const TaggedFrame &tagged, const FrameRequest &,
+                 FramePool &pool, const ReceivedFrame &received,
+                 Frame &frame) {
+        frame.tagged = tagged;
+        frame.tagged.size = pool.frame_size(received);
+        if (state_->bypass) {
+            frame.reference = state_->bypass->reuse(pool, received, tagged);
+            frame.inspected = std::make_shared<cv::Mat>();
+        }
+        return true;
+    }
+
+    bool decodes(const Frame &frame) const { return !frame.reference; }
+
+    cv::Mat decode(FramePool &pool, const ReceivedFrame &received,
+                   const Frame &frame) {
+        if (!decodes(frame)) {
+            pool.discard(received);
+            return cv::Mat();
+        }
+        cv::Mat image = pool.decode(received, cv::IMREAD_COLOR);
+        if (image.empty()) {
+            return image;
+        }
+        if (frame.inspected) {
+            *frame.inspected = state_->bypass->inspect(image);
+        }
+        return context_.preprocess(image);
+    }
+
+    void push(Frame frame, cv::Mat image) {
+        TaggedFrame tagged = std::move(frame.tagged);
+        tagged.value = std::move(image);
+        tagged.times.lap(Stage::Decode);
+        if (state_->bypass) {
+            state_->bypass->push(std::move(tagged), frame.reference,
+                                 std::move(*frame.inspected));
+        } else {
+            // キューのポリシーで捨てたフレームはdropに渡される
+            context_.scheduler.submit(stream_, std::move(tagged));
+        }
+    }
+
+    std::string serialize(const Result &result,
+                          const SessionOptions &options) const {
+        return context_.serialize(result, options);
+    }
+
+    // 未処理のフレームは破棄する
+    void close() { context_.scheduler.close(stream_); }
+
+    void print(std::ostream &os) const {
+        if (state_->bypass) {
+            state_->bypass->print(os);
+        }
+    }
+
+  private:
+    struct State {
+        Emit emit;
+        Drop drop;
+        std::unique_ptr<Bypass> bypass;
+    };
+
+    Context &context_;
+    std::shared_ptr<State> state_;
+    std::shared_ptr<typename Scheduler::Stream> stream_;
+};
@@ -0,0 +1,71 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+// コマンドライン引数を位置引数と "--key=value" 形式のオプションに分けて保持する
+class Options {
+  public:
+    Options(int argc, char *argv[]) {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg.rfind("--", 0) != 0) {
+                positional_.push_back(arg);
+                continue;
+            }
+            std::size_t eq = arg.find('=');
+            if (eq == std::string::npos) {
+                options_[arg.substr(2)] = "1";
+            } else {
+                options_[arg.substr(2, eq - 2)] = arg.substr(eq + 1);
+            }
+        }
+    }
+
+    std::size_t positional_size() const { return positional_.size(); }
+
+    const std::string &positional(std::size_t index) const {
+        return positional_.at(index);
+    }
+
+    bool has(const std::string &key) const {
+        return options_.find(key) != options_.end();
+    }
+
+    std::string get(const std::string &key,
+                    const std::string &default_value) const {
+        auto it = options_.find(key);
+        return it == options_.end() ? default_value : it->second;
+    }
+
+    long get_int(const std::string &key, long default_value) const {
+        auto it = options_.find(key);
+        return it == options_.end() ? default_value : std::stol(it->second);
+    }
+
+    double get_double(const std::string &key, double default_value) const {
+        auto it = options_.find(key);
+        return it == options_.end() ? default_value : std::stod(it->second);
+    }
+
+  private:
+    std::vector<std::string> positional_;
+    std::map<std::string, std::string> options_;
+};
@@ -0,0 +1,250 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <cstdint>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+// 通信は従来通り、ホストのバイトオーダーのsize_t(データ長)とデータの組で行う。
+// データ長の最上位ビットが立っているものは制御メッセージで、
+// 接続直後にクライアントがSessionOptionsを送り、サーバは受け入れた
+// SessionOptionsを同じ形式で返す。送らなければ従来のJSON形式のままとなる
+#define PROTOCOL_MAGIC 0x31414745 // "EGA1"
+#define PROTOCOL_VERSION 3
+
+// 受け付けるフレームのデータ長の上限。これを超えるデータ長を送った接続は切断する
+#define MAX_FRAME_SIZE (64 << 20)
+
+#define RESULT_FORMAT_JSON 0
+#define RESULT_FORMAT_BINARY 1
+// バイナリ形式の結果を、直前の結果との差分で送る(delta_result.hpp)
+#define RESULT_FORMAT_DELTA 2
+
+// フレームの形式。JPEG以外はモデルの入力サイズ(サーバが返す
+// frame_width/frame_height)のままの画素を送る
+#define FRAME_FORMAT_JPEG 0
+#define FRAME_FORMAT_BGR 1
+#define FRAME_FORMAT_NV12 2
+
+// 生の画素を送るときの可逆圧縮
+#define FRAME_COMPRESSION_NONE 0
+#define FRAME_COMPRESSION_PNG 1
+
+// 各フレームのデータの先頭に付けるヘッダ(ビットの組み合わせ)。
+// 両方付ける場合はFrameHeader, FrameRequestの順に並べる
+#define FRAME_HEADER_NONE 0
+#define FRAME_HEADER_REQUEST 1
+#define FRAME_HEADER_SEQUENCE 2
+
+#define FRAME_HEADER_VERSION 1
+// サーバが推論せずに捨てたフレーム。結果の本体は空になる
+#define FRAME_FLAG_DROPPED 0x0001
+
+// FrameRequestで指定するモデル。結果のBinaryResultHeader::kindと同じ値
+#define MODEL_POSE 1
+#define MODEL_FACE 2
+#define FRAME_REQUEST_MAX_MODELS 7
+
+// フレームに対して順番に実行するモデル。countが0ならサーバの既定のモデル
+struct FrameRequest {
+    std::uint8_t count = 0;
+    std::uint8_t models[FRAME_REQUEST_MAX_MODELS] = {};
+};
+
+static_assert(sizeof(FrameRequest) == 8, "unexpected padding");
+
+// FRAME_HEADER_SEQUENCEの接続では、サーバは結果の先頭にフレームと同じ
+// FrameHeaderを付けて返す。結果はフレームを送った順番に届くとは限らないので、
+// クライアントはseqで対応を取る。stream_idとtimestamp_usはサーバでは使わない
+struct FrameHeader {
+    std::uint16_t version = FRAME_HEADER_VERSION;
+    std::uint16_t flags = 0;
+    std::uint32_t stream_id = 0;
+    std::uint64_t seq = 0;
+    std::uint64_t timestamp_us = 0;
+};
+
+static_assert(sizeof(FrameHeader) == 24, "unexpected padding");
+
+// 結果の先頭にFrameHeaderを付ける
+inline std::string tag_result(const FrameHeader &header,
+                              const std::string &body) {
+    std::string out(sizeof(FrameHeader) + body.size(), '\0');
+    std::memcpy(&out[0], &header, sizeof(FrameHeader));
+    std::memcpy(&out[sizeof(FrameHeader)], body.data(), body.size());
+    return out;
+}
+
+inline const char *model_name(std::uint8_t model) {
+    switch (model) {
+    case MODEL_POSE:
+        return "pose";
+    case MODEL_FACE:
+        return "face";
+    default:
+        return "unknown";
+    }
+}
+
+// "face,pose"のようにカンマで区切ったモデル名を、その順番のFrameRequestにする
+inline FrameRequest parse_frame_request(const std::string &models) {
+    FrameRequest request;
+    std::istringstream is(models);
+    std::string name;
+    while (std::getline(is, name, ',')) {
+        if (request.count == FRAME_REQUEST_MAX_MODELS) {
+            throw std::invalid_argument("too many models: " + models);
+        }
+        if (name == "pose") {
+            request.models[request.count++] = MODEL_POSE;
+        } else if (name == "face") {
+            request.models[request.count++] = MODEL_FACE;
+        } else {
+            throw std::invalid_argument("unknown model: " + name);
+        }
+    }
+    return request;
+}
+
+constexpr std::size_t CONTROL_MESSAGE_FLAG = std::size_t(1)
+                                             << (sizeof(std::size_t) * 8 - 1);
+
+struct SessionOptions {
+    std::uint32_t magic = PROTOCOL_MAGIC;
+    std::uint16_t version = PROTOCOL_VERSION;
+    std::uint16_t result_format = RESULT_FORMAT_JSON;
+    // 以下はバージョン2で追加
+    std::uint16_t frame_format = FRAME_FORMAT_JPEG;
+    std::uint16_t frame_compression = FRAME_COMPRESSION_NONE;
+    std::uint16_t frame_width = 0;
+    std::uint16_t frame_height = 0;
+    // 以下はバージョン3で追加
+    std::uint16_t frame_header = FRAME_HEADER_NONE;
+    std::uint16_t reserved = 0;
+};
+
+inline bool is_control_message(std::size_t size) {
+    return (size & CONTROL_MESSAGE_FLAG) != 0;
+}
+
+inline bool has_frame_header(const SessionOptions &options, int header) {
+    return (options.frame_header & header) != 0;
+}
+
+// 結果の本体がバイナリ形式(差分で送るものを含む)か
+inline bool is_binary_result_format(const SessionOptions &options) {
+    return options.result_format == RESULT_FORMAT_BINARY ||
+           options.result_format == RESULT_FORMAT_DELTA;
+}
+
+// サーバが対応していない値は既定値に戻して返す。
+// 生の画素を受け付けるときは、送ってほしいサイズ(モデルの入力サイズ)を返す。
+// frame_headersはサーバが受け付けるフレームのヘッダ。
+// deltaがfalseのサーバは、差分形式の要求にはバイナリ形式で応じる
+inline SessionOptions
+accept_session_options(const SessionOptions &requested,
+                       std::uint16_t frame_width, std::uint16_t frame_height,
+                       std::uint16_t frame_headers = FRAME_HEADER_SEQUENCE,
+                       bool delta = false) {
+    SessionOptions accepted;
+    if (requested.magic != PROTOCOL_MAGIC) {
+        return accepted;
+    }
+    if (requested.result_format == RESULT_FORMAT_BINARY ||
+        requested.result_format == RESULT_FORMAT_DELTA) {
+        accepted.result_format =
+            delta ? requested.result_format : RESULT_FORMAT_BINARY;
+    }
+    if (requested.frame_format == FRAME_FORMAT_BGR ||
+        requested.frame_format == FRAME_FORMAT_NV12) {
+        accepted.frame_format = requested.frame_format;
+        if (requested.frame_compression == FRAME_COMPRESSION_PNG) {
+            accepted.frame_compression = FRAME_COMPRESSION_PNG;
+        }
+        accepted.frame_width = frame_width;
+        accepted.frame_height = frame_height;
+    }
+    accepted.frame_header = requested.frame_header & frame_headers;
+    return accepted;
+}
+
+inline bool is_raw_frame_format(const SessionOptions &options) {
+    return options.frame_format == FRAME_FORMAT_BGR ||
+           options.frame_format == FRAME_FORMAT_NV12;
+}
+
+// 圧縮しない場合の1フレームのバイト数
+inline std::size_t raw_frame_size(const SessionOptions &options) {
+    std::size_t pixels =
+        std::size_t(options.frame_width) * options.frame_height;
+    if (options.frame_format == FRAME_FORMAT_NV12) {
+        return pixels * 3 / 2;
+    }
+    return pixels * 3;
+}
+
+// 長さの異なるSessionOptionsは共通部分だけを読み、残りは読み捨てる
+template <typename SyncReadStream>
+SessionOptions read_session_options(SyncReadStream &stream,
+                                    std::size_t header) {
+    std::size_t size = header & ~CONTROL_MESSAGE_FLAG;
+    if (size > 4096) {
+        throw std::runtime_error("invalid control message");
+    }
+    char buf[4096];
+    boost::asio::read(stream, boost::asio::buffer(buf, size));
+    SessionOptions options;
+    std::memcpy(&options, buf, std::min(size, sizeof(SessionOptions)));
+    return options;
+}
+
+template <typename SyncWriteStream>
+void write_session_options(SyncWriteStream &stream,
+                           const SessionOptions &options) {
+    std::size_t header = CONTROL_MESSAGE_FLAG | sizeof(SessionOptions);
+    boost::asio::write(stream,
+                       boost::asio::buffer(&header, sizeof(std::size_t)));
+    boost::asio::write(stream,
+                       boost::asio::buffer(&options, sizeof(SessionOptions)));
+}
+
+// クライアント側: 要求を送り、サーバが受け入れた内容を受け取る
+template <typename SyncStream>
+SessionOptions negotiate_session_options(SyncStream &stream,
+                                         const SessionOptions &requested) {
+    write_session_options(stream, requested);
+    std::size_t header;
+    boost::asio::read(stream,
+                      boost::asio::buffer(&header, sizeof(std::size_t)));
+    if (!is_control_message(header)) {
+        throw std::runtime_error("server does not support negotiation");
+    }
+    return read_session_options(stream, header);
+}
+
+// ログに表示するための接続先の文字列
+template <typename Endpoint>
+std::string endpoint_to_string(const Endpoint &endpoint) {
+    std::ostringstream os;
+    os << endpoint;
+    return os.str();
+}
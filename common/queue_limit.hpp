@@ -0,0 +1,83 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <deque>
+#include <stdexcept>
+#include <string>
+
+#include "options.hpp"
+
+// キューが一杯になったときの動作
+//  Block: 受信側(ソケットの読み込み)を止める
+//  DropOldest: 最も古い要素を捨てる
+//  KeepLatest: 最新の要素だけを残す
+enum class OverflowPolicy { Block, DropOldest, KeepLatest };
+
+struct QueueLimit {
+    std::size_t capacity = 8;
+    OverflowPolicy policy = OverflowPolicy::Block;
+};
+
+inline QueueLimit queue_limit_from_options(const Options &options) {
+    QueueLimit limit;
+    limit.capacity = std::max(options.get_int("queue-capacity", 8), 1L);
+    std::string policy = options.get("overflow", "block");
+    if (policy == "block") {
+        limit.policy = OverflowPolicy::Block;
+    } else if (policy == "drop-oldest") {
+        limit.policy = OverflowPolicy::DropOldest;
+    } else if (policy == "latest") {
+        limit.policy = OverflowPolicy::KeepLatest;
+    } else {
+        throw std::invalid_argument("unknown overflow policy: " + policy);
+    }
+    return limit;
+}
+
+// 要素を1つ追加する前に、ポリシーに従って古い要素を捨て、捨てた数を返す。
+// 先頭のpinned個(送信中のものなど)は捨てない。捨てる要素はon_dropに渡す
+template <typename T, typename OnDrop>
+std::size_t make_room(std::deque<T> &queue, const QueueLimit &limit,
+                      std::size_t pinned, OnDrop on_drop) {
+    std::size_t keep;
+    switch (limit.policy) {
+    case OverflowPolicy::DropOldest:
+        keep = limit.capacity - 1;
+        break;
+    case OverflowPolicy::KeepLatest:
+        keep = 0;
+        break;
+    default:
+        return 0;
+    }
+    keep = std::max(keep, pinned);
+    std::size_t dropped = 0;
+    while (queue.size() > keep) {
+        on_drop(queue[pinned]);
+        queue.erase(queue.begin() + pinned);
+        ++dropped;
+    }
+    return dropped;
+}
+
+template <typename T>
+std::size_t make_room(std::deque<T> &queue, const QueueLimit &limit,
+                      std::size_t pinned = 0) {
+    return make_room(queue, limit, pinned, [](T &) {});
+}
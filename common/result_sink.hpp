@@ -0,0 +1,180 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <boost/json.hpp>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+// *_seqの結果の出力形式。textは従来通り人が読む形式で標準出力に表示する
+#define RESULT_SINK_TEXT 0
+#define RESULT_SINK_JSONL 1
+#define RESULT_SINK_BINARY 2
+
+// 書き込みスレッドへ渡す単位と、書き込みが追いつかないときに溜める上限
+#define RESULT_SINK_CHUNK (1 << 20)
+#define RESULT_SINK_MAX_PENDING (8 << 20)
+
+// バイナリ形式の1フレーム分のレコード。後にファイル名(name_size バイト)、
+// 結果(result_size バイト、RESULT_FORMAT_BINARYと同じ形式)が続く
+struct ResultRecordHeader {
+    std::uint64_t frame;
+    std::uint32_t name_size;
+    std::uint32_t result_size;
+};
+
+static_assert(sizeof(ResultRecordHeader) == 16, "unexpected padding");
+
+inline int parse_result_sink(const std::string &name) {
+    if (name == "text") {
+        return RESULT_SINK_TEXT;
+    } else if (name == "jsonl") {
+        return RESULT_SINK_JSONL;
+    } else if (name == "binary") {
+        return RESULT_SINK_BINARY;
+    }
+    throw std::invalid_argument("unknown output format: " + name);
+}
+
+// 結果をメモリに溜め、別のスレッドでまとめてファイルに書き込む。
+// pathが"-"なら標準出力に書き込む
+class ResultSink {
+  public:
+    ResultSink(int format, const std::string &path)
+        : format_(format), closed_(false) {
+        if (path == "-") {
+            fd_ = STDOUT_FILENO;
+        } else {
+            fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd_ < 0) {
+                throw std::runtime_error("cannot open output: " + path);
+            }
+        }
+        writer_ = std::thread(&ResultSink::run, this);
+    }
+
+    ~ResultSink() { close(); }
+
+    int format() const { return format_; }
+
+    // jsonはresult_to_json_stringの結果
+    void write_jsonl(std::uint64_t frame, const std::string &file,
+                     const std::string &json) {
+        std::string line = "{\"frame\":" + std::to_string(frame) +
+                           ",\"file\":" +
+                           boost::json::serialize(boost::json::value(file)) +
+                           ",\"result\":" + json + "}\n";
+        append(line.data(), line.size());
+    }
+
+    // binaryはresult_to_binaryの結果
+    void write_binary(std::uint64_t frame, const std::string &file,
+                      const std::string &binary) {
+        ResultRecordHeader header;
+        header.frame = frame;
+        header.name_size = file.size();
+        header.result_size = binary.size();
+        std::string record(sizeof(header), '\0');
+        std::memcpy(&record[0], &header, sizeof(header));
+        record += file;
+        record += binary;
+        append(record.data(), record.size());
+    }
+
+    // 溜まっている結果を全て書き込んでから閉じる
+    void close() {
+        std::unique_lock<std::mutex> lock(mtx_);
+        if (closed_) {
+            return;
+        }
+        closed_ = true;
+        lock.unlock();
+        ready_.notify_one();
+        writer_.join();
+        if (fd_ != STDOUT_FILENO) {
+            ::close(fd_);
+        }
+    }
+
+  private:
+    void append(const char *data, std::size_t size) {
+        std::unique_lock<std::mutex> lock(mtx_);
+        drained_.wait(lock, [this] {
+            return pending_.size() < RESULT_SINK_MAX_PENDING;
+        });
+        pending_.append(data, size);
+        if (pending_.size() >= RESULT_SINK_CHUNK) {
+            ready_.notify_one();
+        }
+    }
+
+    void run() {
+        std::string buf;
+        while (true) {
+            std::unique_lock<std::mutex> lock(mtx_);
+            ready_.wait(lock, [this] {
+                return closed_ || pending_.size() >= RESULT_SINK_CHUNK;
+            });
+            buf.swap(pending_);
+            bool closed = closed_;
+            lock.unlock();
+            drained_.notify_all();
+            write_all(buf);
+            buf.clear();
+            if (closed) {
+                return;
+            }
+        }
+    }
+
+    void write_all(const std::string &buf) {
+        std::size_t done = 0;
+        while (done < buf.size()) {
+            ssize_t n = ::write(fd_, buf.data() + done, buf.size() - done);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (!failed_) {
+                    std::cerr << "Failed to write results" << std::endl;
+                    failed_ = true;
+                }
+                return;
+            }
+            done += n;
+        }
+    }
+
+    int format_;
+    int fd_;
+    bool closed_;
+    bool failed_ = false;
+    std::string pending_;
+    std::mutex mtx_;
+    std::condition_variable ready_;
+    std::condition_variable drained_;
+    std::thread writer_;
+};
@@ -0,0 +1,57 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <string>
+#include <thread>
+
+#include "async_server.hpp"
+#include "decode_pool.hpp"
+#include "server_settings.hpp"
+#include "stage_stats.hpp"
+#include "threaded_server.hpp"
+#include "trace.hpp"
+
+// write_trace_on_signal()を呼んだときはサーバを別のスレッドで動かし、
+// メインスレッドで終了のシグナルを待ってトレースを書き出す
+template <typename Server>
+void run_until_trace_signal(Server &server, const std::string &name) {
+    if (!waits_trace_signal()) {
+        server.run(name);
+        return;
+    }
+    std::thread([&server, &name] { server.run(name); }).detach();
+    wait_trace_signal();
+}
+
+// settings.asyncに従ってThreadedServerかAsyncServerを起動する。
+// nameは起動したときに表示するサーバの名前。戻らない
+template <typename Pipeline>
+void run_server(typename Pipeline::Context &context, DecodePool &decode_pool,
+                StageReport &stage_report, const ServerSettings &settings,
+                const std::string &name) {
+    if (settings.async) {
+        AsyncServer<Pipeline> server(context, decode_pool, stage_report,
+                                     settings);
+        run_until_trace_signal(server, name);
+    } else {
+        ThreadedServer<Pipeline> server(context, decode_pool, stage_report,
+                                        settings);
+        run_until_trace_signal(server, name);
+    }
+}
@@ -0,0 +1,170 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <opencv2/opencv.hpp>
+#include <optional>
+#include <ostream>
+
+#include "bypass_queue.hpp"
+#include "options.hpp"
+#include "tagged_frame.hpp"
+
+// フレームを比べる縮小したグレースケールの画像のサイズ
+#define GATE_WIDTH 32
+#define GATE_HEIGHT 18
+
+// 全ての接続の合計
+struct GateStats {
+    std::atomic<std::size_t> frames{0};
+    std::atomic<std::size_t> reused{0};
+
+    // per_frameは推論1フレームあたりの平均時間。省いた推論の時間を見積もる
+    void print(std::ostream &os,
+               std::chrono::duration<double> per_frame) const {
+        std::size_t total = frames;
+        if (total == 0) {
+            return;
+        }
+        os << "Scene gate: reused " << reused << " of " << total
+           << " frames (" << 100 * reused / total << "%), saved about "
+           << per_frame.count() * reused << " s of inference" << std::endl;
+    }
+};
+
+// 基準のフレーム(最後に推論することにしたフレーム)と縮小した画像の平均の差
+// (0〜255)を比べ、threshold未満なら同じ場面とみなす。
+// 基準が受信した順に変わるよう、受信した順に1つのスレッドから呼ぶ
+class SceneGate {
+  public:
+    explicit SceneGate(double threshold) : threshold_(threshold) {}
+
+    // 同じ場面なら基準のフレームのindexを返す。
+    // 違えば次からはこのフレームを基準にする
+    std::optional<std::uint64_t> similar(const cv::Mat &thumbnail,
+                                         std::uint64_t index) {
+        if (!reference_.empty() &&
+            cv::norm(thumbnail, reference_, cv::NORM_L1) <
+                threshold_ * thumbnail.total()) {
+            return reference_index_;
+        }
+        reference_ = thumbnail;
+        reference_index_ = index;
+        return std::nullopt;
+    }
+
+  private:
+    double threshold_;
+    cv::Mat reference_;
+    std::uint64_t reference_index_ = 0;
+};
+
+// 同じ場面のフレームは推論せずに、比べた基準のフレームの結果を返す。
+// 結果は全てのフレームについて受信した順に返す(BypassQueue)。
+// Extraは基準のフレームのindexで、推論するフレームは自身のindexになる
+template <typename Result> class GatedStream : public BypassStream<Result> {
+  public:
+    using Submit = std::function<void(TaggedFrame)>;
+    using Emit = std::function<void(Tagged<Result>)>;
+
+    GatedStream(double threshold, GateStats &stats, Submit submit, Emit emit)
+        : gate_(threshold), stats_(stats), submit_(std::move(submit)),
+          queue_([this](typename Queue::Entry &entry) { return finish(entry); },
+                 std::move(emit)) {}
+
+    // 基準のフレームと同じ場面ならデコードしない
+    std::optional<std::uint64_t> reuse(FramePool &pool,
+                                       const ReceivedFrame &received,
+                                       const TaggedFrame &frame) override {
+        cv::Mat thumbnail =
+            pool.thumbnail(received, cv::Size(GATE_WIDTH, GATE_HEIGHT));
+        if (thumbnail.empty()) {
+            return std::nullopt;
+        }
+        return gate_.similar(thumbnail, frame.index);
+    }
+
+    void push(TaggedFrame frame, std::optional<std::uint64_t> reference,
+              cv::Mat) override {
+        bool reuse = reference.has_value();
+        std::unique_lock<std::mutex> lock(mtx_);
+        queue_.push(frame, reference.value_or(frame.index), !reuse);
+        if (reuse) {
+            queue_.drain();
+            return;
+        }
+        lock.unlock();
+        submit_(std::move(frame));
+    }
+
+    void inferred(Tagged<Result> result) override {
+        std::lock_guard<std::mutex> lock(mtx_);
+        queue_.complete(std::move(result));
+        queue_.drain();
+    }
+
+    // スケジューラがキューの上限で捨てたフレームにも直前の結果を返す
+    void dropped(const TaggedFrame &frame) override {
+        std::lock_guard<std::mutex> lock(mtx_);
+        queue_.cancel(frame);
+        queue_.drain();
+    }
+
+    void print(std::ostream &os) const override {
+        os << "Reused the previous result for " << reused_ << " of "
+           << frames_ << " frames" << std::endl;
+    }
+
+  private:
+    using Queue = BypassQueue<Result, std::uint64_t>;
+
+    // 基準のフレームは受信した順で前にあるので、使い回すフレームより先に
+    // 結果を作っている。捨てられた基準のフレームは、その前の結果を返す
+    Tagged<Result> finish(typename Queue::Entry &entry) {
+        ++frames_;
+        ++stats_.frames;
+        if (entry.extra == entry.index) {
+            if (entry.done) {
+                last_ = entry.result.value;
+                return std::move(entry.result);
+            }
+        } else {
+            ++reused_;
+            ++stats_.reused;
+        }
+        return {entry.header, last_, entry.times, entry.index};
+    }
+
+    SceneGate gate_;
+    GateStats &stats_;
+    Submit submit_;
+    std::mutex mtx_;
+    Queue queue_;
+    Result last_{};
+    std::atomic<std::size_t> frames_{0};
+    std::atomic<std::size_t> reused_{0};
+};
+
+// 0なら比べずに全てのフレームを推論する
+inline double gate_threshold_from_options(const Options &options) {
+    return options.get_double("gate-threshold", 0.0);
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include "delta_result.hpp"
+#include "options.hpp"
+#include "queue_limit.hpp"
+
+// 処理中のフレームと送信待ちの結果は、キューの上限のこの倍までにする。
+// キューの上限より余裕を持たせ、上限の判定は送信側で行う
+#define RESULT_RING_SLACK 2
+
+// ThreadedServerとAsyncServerに共通の設定
+struct ServerSettings {
+    int port = 0;
+    // 空でなければ、同じホストのクライアントをこのパスのUnixドメインソケットで
+    // 受け付け、フレームは共有メモリで受け取る
+    std::string local_socket;
+    QueueLimit queue_limit;
+    int delta_keyframe_interval = DEFAULT_DELTA_KEYFRAME_INTERVAL;
+    // --server=async。固定数のスレッドで全ての接続を非同期に扱う
+    bool async = false;
+    std::size_t io_threads = 1;
+};
+
+inline ServerSettings server_settings_from_options(const Options &options,
+                                                   int port) {
+    ServerSettings settings;
+    settings.port = port;
+    settings.local_socket = options.get("local-socket", "");
+    settings.queue_limit = queue_limit_from_options(options);
+    settings.delta_keyframe_interval = options.get_int(
+        "delta-keyframe-interval", DEFAULT_DELTA_KEYFRAME_INTERVAL);
+    std::string server = options.get("server", "threaded");
+    if (server != "threaded" && server != "async") {
+        throw std::invalid_argument("unknown server: " + server);
+    }
+    settings.async = server == "async";
+    settings.io_threads = std::max(
+        options.get_int("io-threads", std::thread::hardware_concurrency()),
+        1L);
+    return settings;
+}
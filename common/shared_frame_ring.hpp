@@ -0,0 +1,271 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <memory>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// 同じホストのクライアントとサーバの間で、memfdで確保した共有メモリの
+// スロットにフレームを置いて受け渡す。
+// クライアントはUnixドメインソケットに接続した直後にmemfdを送り、
+// 以降はフレームの代わりにSharedFrameDescriptor(スロット番号とサイズ)を
+// 従来と同じデータ長付きの形式で送る。サーバはスロットから直接デコードし、
+// デコードが終わったスロットを空きに戻す。結果は従来通りソケットで返す
+#define SHARED_FRAME_MAGIC 0x31524653 // "SFR1"
+#define SHARED_FRAME_SLOTS 8
+#define SHARED_FRAME_MAX_SLOTS 256
+#define SHARED_FRAME_ALIGN 4096
+
+#define SHARED_SLOT_FREE 0
+#define SHARED_SLOT_FILLED 1
+
+struct SharedFrameDescriptor {
+    std::uint32_t slot;
+    std::uint32_t size;
+};
+
+class SharedFrameRing {
+  public:
+    // クライアント側: slot_sizeバイトのスロットをslot_count個持つ共有メモリを作る
+    static std::shared_ptr<SharedFrameRing> create(std::uint32_t slot_count,
+                                                   std::size_t slot_size) {
+        if (slot_count == 0 || slot_count > SHARED_FRAME_MAX_SLOTS) {
+            throw std::invalid_argument("invalid number of shared slots");
+        }
+        slot_size = align(slot_size);
+        int fd = memfd_create("frame_ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if (fd < 0) {
+            throw std::runtime_error("memfd_create failed");
+        }
+        std::size_t size = data_offset() + slot_size * slot_count;
+        if (ftruncate(fd, size) != 0) {
+            close(fd);
+            throw std::runtime_error("ftruncate failed");
+        }
+        // サーバがマップした後に縮めてSIGBUSを起こせないよう、大きさを固定する
+        int seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL;
+        if (fcntl(fd, F_ADD_SEALS, seals) != 0) {
+            close(fd);
+            throw std::runtime_error("failed to seal shared memory");
+        }
+        auto ring = map(fd, size);
+        ring->header()->magic = SHARED_FRAME_MAGIC;
+        ring->header()->slot_count = slot_count;
+        ring->header()->slot_size = slot_size;
+        ring->slot_count_ = slot_count;
+        ring->slot_size_ = slot_size;
+        return ring;
+    }
+
+    // サーバ側: クライアントから受け取ったmemfdを検証してマップする。
+    // fdの所有権は成否にかかわらずattachに移る。
+    // 縮められないよう封印されていないmemfdはマップしない
+    static std::shared_ptr<SharedFrameRing> attach(int fd) {
+        int seals = fcntl(fd, F_GET_SEALS);
+        struct stat st;
+        Header header;
+        if (seals < 0 || (seals & F_SEAL_SHRINK) == 0 || fstat(fd, &st) != 0 ||
+            static_cast<std::size_t>(st.st_size) < data_offset() ||
+            pread(fd, &header, sizeof(header), 0) !=
+                static_cast<ssize_t>(sizeof(header))) {
+            close(fd);
+            throw std::runtime_error("invalid shared frame ring");
+        }
+        std::size_t size = st.st_size;
+        if (header.magic != SHARED_FRAME_MAGIC || header.slot_count == 0 ||
+            header.slot_count > SHARED_FRAME_MAX_SLOTS ||
+            header.slot_size == 0 ||
+            header.slot_size % SHARED_FRAME_ALIGN != 0 ||
+            header.slot_size > (size - data_offset()) / header.slot_count) {
+            close(fd);
+            throw std::runtime_error("invalid shared frame ring");
+        }
+        auto ring = map(fd, size);
+        // 以降はクライアントが書き換えても影響しないよう検証した値を使う
+        ring->slot_count_ = header.slot_count;
+        ring->slot_size_ = header.slot_size;
+        return ring;
+    }
+
+    ~SharedFrameRing() {
+        munmap(base_, size_);
+        close(fd_);
+    }
+
+    SharedFrameRing(const SharedFrameRing &) = delete;
+    SharedFrameRing &operator=(const SharedFrameRing &) = delete;
+
+    int fd() const { return fd_; }
+    std::uint32_t slot_count() const { return slot_count_; }
+    std::size_t slot_size() const { return slot_size_; }
+
+    std::uint8_t *slot_data(std::uint32_t slot) {
+        return base_ + data_offset() + slot_size_ * slot;
+    }
+
+    // クライアント側: スロットが空くまで待つ。タイムアウトした場合はfalseを返す
+    bool acquire(std::uint32_t slot, std::chrono::nanoseconds timeout) {
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        std::atomic<std::uint32_t> &state = slot_state(slot);
+        while (true) {
+            std::uint32_t current = state.load(std::memory_order_acquire);
+            if (current == SHARED_SLOT_FREE) {
+                return true;
+            }
+            auto remaining = deadline - std::chrono::steady_clock::now();
+            if (remaining <= std::chrono::nanoseconds::zero()) {
+                return false;
+            }
+            auto sec = std::chrono::duration_cast<std::chrono::seconds>(
+                remaining);
+            struct timespec ts;
+            ts.tv_sec = sec.count();
+            ts.tv_nsec = (remaining - sec).count();
+            // プロセスをまたぐのでPRIVATEでないfutexを使う
+            syscall(SYS_futex, reinterpret_cast<std::uint32_t *>(&state),
+                    FUTEX_WAIT, current, &ts, nullptr, 0);
+        }
+    }
+
+    // クライアント側: スロットに書き込んだフレームをサーバに渡す
+    SharedFrameDescriptor publish(std::uint32_t slot, std::size_t size) {
+        slot_state(slot).store(SHARED_SLOT_FILLED, std::memory_order_release);
+        return SharedFrameDescriptor{slot, static_cast<std::uint32_t>(size)};
+    }
+
+    // サーバ側: 受け取った記述子が指すフレームを返す。不正ならnullptr
+    const std::uint8_t *frame(const SharedFrameDescriptor &descriptor) {
+        if (descriptor.slot >= slot_count_ || descriptor.size > slot_size_ ||
+            slot_state(descriptor.slot).load(std::memory_order_acquire) !=
+                SHARED_SLOT_FILLED) {
+            return nullptr;
+        }
+        return slot_data(descriptor.slot);
+    }
+
+    // サーバ側: デコードが終わったスロットを空きに戻す
+    void release(std::uint32_t slot) {
+        std::atomic<std::uint32_t> &state = slot_state(slot);
+        state.store(SHARED_SLOT_FREE, std::memory_order_release);
+        syscall(SYS_futex, reinterpret_cast<std::uint32_t *>(&state),
+                FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+    }
+
+  private:
+    struct Header {
+        std::uint32_t magic;
+        std::uint32_t slot_count;
+        std::uint64_t slot_size;
+    };
+
+    // スロットの状態は互いに別のキャッシュラインに置く
+    struct alignas(64) SlotState {
+        std::atomic<std::uint32_t> state;
+    };
+
+    SharedFrameRing(int fd, std::uint8_t *base, std::size_t size)
+        : fd_(fd), base_(base), size_(size) {}
+
+    // fdの所有権を受け取る。失敗した場合は閉じる
+    static std::shared_ptr<SharedFrameRing> map(int fd, std::size_t size) {
+        void *base =
+            mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (base == MAP_FAILED) {
+            close(fd);
+            throw std::runtime_error("mmap failed");
+        }
+        return std::shared_ptr<SharedFrameRing>(
+            new SharedFrameRing(fd, static_cast<std::uint8_t *>(base), size));
+    }
+
+    static std::size_t align(std::size_t size) {
+        return (size + SHARED_FRAME_ALIGN - 1) / SHARED_FRAME_ALIGN *
+               SHARED_FRAME_ALIGN;
+    }
+
+    static std::size_t data_offset() {
+        return align(sizeof(SlotState) * (SHARED_FRAME_MAX_SLOTS + 1));
+    }
+
+    Header *header() { return reinterpret_cast<Header *>(base_); }
+
+    std::atomic<std::uint32_t> &slot_state(std::uint32_t slot) {
+        return reinterpret_cast<SlotState *>(base_)[slot + 1].state;
+    }
+
+    int fd_;
+    std::uint8_t *base_;
+    std::size_t size_;
+    std::uint32_t slot_count_ = 0;
+    std::size_t slot_size_ = 0;
+};
+
+// Unixドメインソケットでファイルディスクリプタを1つ送る
+inline void send_fd(int sock, int fd) {
+    char byte = 0;
+    struct iovec iov = {&byte, 1};
+    char control[CMSG_SPACE(sizeof(int))] = {};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    std::memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    if (sendmsg(sock, &msg, 0) != 1) {
+        throw std::runtime_error("failed to send shared memory");
+    }
+}
+
+// send_fdで送られたファイルディスクリプタを受け取る
+inline int receive_fd(int sock) {
+    char byte;
+    struct iovec iov = {&byte, 1};
+    char control[CMSG_SPACE(sizeof(int))] = {};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1) {
+        throw std::runtime_error("failed to receive shared memory");
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == nullptr || cmsg->cmsg_level != SOL_SOCKET ||
+        cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+        throw std::runtime_error("failed to receive shared memory");
+    }
+    int fd;
+    std::memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
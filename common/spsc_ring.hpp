@@ -0,0 +1,237 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#define SPSC_CACHE_LINE 64
+#define SPSC_SPIN_COUNT 256
+
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    asm volatile("yield" ::: "memory");
+#endif
+}
+
+// 条件が成り立つまで待つための通知機構。しばらくスピンしてから
+// futexで眠るので、待つ側がいなければnotifyはほぼ何もしない
+class WaitEvent {
+  public:
+    template <typename Predicate> void wait(Predicate pred) {
+        while (!wait_for(pred, std::chrono::hours(1))) {
+        }
+    }
+
+    // タイムアウトした場合はfalseを返す
+    template <typename Predicate>
+    bool wait_for(Predicate pred, std::chrono::nanoseconds timeout) {
+        // 1コアの環境ではスピンしても相手が進まないので、すぐに眠る
+        static const int spin_count =
+            std::thread::hardware_concurrency() > 1 ? SPSC_SPIN_COUNT : 0;
+        for (int i = 0; i < spin_count; ++i) {
+            if (pred()) {
+                return true;
+            }
+            cpu_relax();
+        }
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        while (true) {
+            std::uint32_t seq = seq_.load(std::memory_order_acquire);
+            waiters_.fetch_add(1, std::memory_order_seq_cst);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (pred()) {
+                waiters_.fetch_sub(1, std::memory_order_relaxed);
+                return true;
+            }
+            auto remaining = deadline - std::chrono::steady_clock::now();
+            if (remaining <= std::chrono::nanoseconds::zero()) {
+                waiters_.fetch_sub(1, std::memory_order_relaxed);
+                return pred();
+            }
+            sleep(seq, remaining);
+            waiters_.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+
+    // 条件に関わる状態を書き換えた後に呼ぶ
+    void notify() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters_.load(std::memory_order_relaxed) == 0) {
+            return;
+        }
+        seq_.fetch_add(1, std::memory_order_release);
+#ifdef __linux__
+        syscall(SYS_futex, reinterpret_cast<std::uint32_t *>(&seq_),
+                FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+#endif
+    }
+
+  private:
+    void sleep(std::uint32_t seq, std::chrono::nanoseconds timeout) {
+#ifdef __linux__
+        auto sec = std::chrono::duration_cast<std::chrono::seconds>(timeout);
+        struct timespec ts;
+        ts.tv_sec = sec.count();
+        ts.tv_nsec = (timeout - sec).count();
+        syscall(SYS_futex, reinterpret_cast<std::uint32_t *>(&seq_),
+                FUTEX_WAIT_PRIVATE, seq, &ts, nullptr, 0);
+#else
+        (void)seq;
+        std::this_thread::sleep_for(
+            std::min(timeout, std::chrono::nanoseconds(50000)));
+#endif
+    }
+
+    std::atomic<std::uint32_t> seq_{0};
+    std::atomic<std::uint32_t> waiters_{0};
+};
+
+// 1つの生産者スレッドと1つの消費者スレッドの間でデータを受け渡す
+// ロックフリーのリングバッファ。容量は2のべき乗に切り上げる
+template <typename T> class SpscRing {
+  public:
+    explicit SpscRing(std::size_t capacity)
+        : slots_(round_up(capacity)), mask_(slots_.size() - 1) {}
+
+    std::size_t capacity() const { return slots_.size(); }
+
+    std::size_t size() const {
+        return tail_.load(std::memory_order_acquire) -
+               head_.load(std::memory_order_acquire);
+    }
+
+    // 一杯のときはfalseを返し、valueはそのまま残す
+    bool try_push(T &value) {
+        std::size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - cached_head_ == slots_.size()) {
+            cached_head_ = head_.load(std::memory_order_acquire);
+            if (tail - cached_head_ == slots_.size()) {
+                return false;
+            }
+        }
+        slots_[tail & mask_] = std::move(value);
+        tail_.store(tail + 1, std::memory_order_release);
+        not_empty_.notify();
+        return true;
+    }
+
+    bool try_pop(T &value) {
+        std::size_t head = head_.load(std::memory_order_relaxed);
+        if (head == cached_tail_) {
+            cached_tail_ = tail_.load(std::memory_order_acquire);
+            if (head == cached_tail_) {
+                return false;
+            }
+        }
+        // 取り出した要素が持つ資源(cv::Matなど)をすぐに手放す
+        value = std::move(slots_[head & mask_]);
+        slots_[head & mask_] = T();
+        head_.store(head + 1, std::memory_order_release);
+        not_full_.notify();
+        return true;
+    }
+
+    // 空きができるまで待つ。close()された場合はfalseを返す
+    bool push(T value) {
+        while (!try_push(value)) {
+            not_full_.wait([this] { return closed() || !full(); });
+            if (closed()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // close()されて空になった場合はfalseを返す
+    bool pop(T &value) {
+        while (!try_pop(value)) {
+            not_empty_.wait([this] { return closed() || !empty(); });
+            if (closed() && empty()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // タイムアウトした場合、またはclose()されて空になった場合はfalseを返す
+    template <typename Rep, typename Period>
+    bool pop_for(T &value, std::chrono::duration<Rep, Period> timeout) {
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        while (!try_pop(value)) {
+            bool ready = not_empty_.wait_for(
+                [this] { return closed() || !empty(); },
+                deadline - std::chrono::steady_clock::now());
+            if (!ready || (closed() && empty())) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // 生産者がこれ以上データを入れないことを知らせる。消費者側から
+    // 呼んだ場合は、待っている生産者のpush()がfalseで戻る
+    void close() {
+        closed_.store(true, std::memory_order_release);
+        not_empty_.notify();
+        not_full_.notify();
+    }
+
+    bool closed() const { return closed_.load(std::memory_order_acquire); }
+
+  private:
+    static std::size_t round_up(std::size_t n) {
+        std::size_t size = 1;
+        while (size < n) {
+            size <<= 1;
+        }
+        return size;
+    }
+
+    bool empty() const {
+        return head_.load(std::memory_order_acquire) ==
+               tail_.load(std::memory_order_acquire);
+    }
+
+    bool full() const { return size() >= slots_.size(); }
+
+    std::vector<T> slots_;
+    const std::size_t mask_;
+    alignas(SPSC_CACHE_LINE) std::atomic<std::size_t> head_{0};
+    std::size_t cached_tail_ = 0;
+    alignas(SPSC_CACHE_LINE) std::atomic<std::size_t> tail_{0};
+    std::size_t cached_head_ = 0;
+    alignas(SPSC_CACHE_LINE) std::atomic<bool> closed_{false};
+    WaitEvent not_empty_;
+    WaitEvent not_full_;
+};
@@ -0,0 +1,323 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <functional>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <pthread.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "trace.hpp"
+
+// 1オクターブ(2倍)ごとのバケットの分割数。8なら誤差は12.5%以内
+#define HISTOGRAM_SUB_BUCKETS 8
+// 2^40マイクロ秒(約12日)までを数える
+#define HISTOGRAM_BUCKETS ((40 - 2) * HISTOGRAM_SUB_BUCKETS)
+
+using StageClock = std::chrono::steady_clock;
+
+// フレームが通る段。順番は結果を表示する順番
+enum class Stage {
+    // フレームのデータの受信
+    Recv,
+    // デコードプールの待ちとデコード、前処理
+    Decode,
+    // スケジューラのキューでバッチを待つ時間
+    Queue,
+    // モデルの推論
+    Infer,
+    // 推論が終わってから送信スレッドが取り出すまで
+    Result,
+    // 結果のJSONやバイナリへの変換
+    Serialize,
+    // ソケットへの書き込み
+    Send,
+    // 受信し終えてから送信し終えるまで
+    Total,
+    Count
+};
+
+inline const char *stage_name(Stage stage) {
+    static const char *names[] = {"recv",  "decode",    "queue", "infer",
+                                  "result", "serialize", "send",  "total"};
+    return names[static_cast<int>(stage)];
+}
+
+// 接続ごとのキューの長さ
+enum class Gauge {
+    // 受信してから結果を取り出すまでのフレーム
+    InFlight,
+    // デコード待ちのフレーム
+    Decoding,
+    // 送信待ちの結果
+    Results,
+    Count
+};
+
+inline const char *gauge_name(Gauge gauge) {
+    static const char *names[] = {"in_flight", "decoding", "results"};
+    return names[static_cast<int>(gauge)];
+}
+
+// マイクロ秒単位の遅延のヒストグラム。2のべき乗ごとの区間を等分した
+// バケットを数えるので、記録はロックを取らずにカウンタを増やすだけで済む
+class LatencyHistogram {
+  public:
+    void record(std::uint64_t us) {
+        counts_[bucket(us)].fetch_add(1, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+        std::uint64_t max = max_.load(std::memory_order_relaxed);
+        while (us > max && !max_.compare_exchange_weak(
+                               max, us, std::memory_order_relaxed)) {
+        }
+    }
+
+    std::uint64_t count() const {
+        return count_.load(std::memory_order_relaxed);
+    }
+
+    std::uint64_t max() const { return max_.load(std::memory_order_relaxed); }
+
+    // p(0〜1)の位置の値を含むバケットの上限。記録中でも呼び出してよい
+    std::uint64_t percentile(double p) const {
+        std::uint64_t total = 0;
+        std::uint64_t counts[HISTOGRAM_BUCKETS];
+        for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+            counts[i] = counts_[i].load(std::memory_order_relaxed);
+            total += counts[i];
+        }
+        std::uint64_t rank = static_cast<std::uint64_t>(p * total);
+        std::uint64_t seen = 0;
+        for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+            seen += counts[i];
+            if (seen > rank) {
+                return std::min(upper_bound(i), max());
+            }
+        }
+        return max();
+    }
+
+  private:
+    static int bucket(std::uint64_t us) {
+        if (us < HISTOGRAM_SUB_BUCKETS) {
+            return static_cast<int>(us);
+        }
+        // 最上位ビットの位置で区間を、続く3ビットで区間内のバケットを決める
+        int exponent = 63 - __builtin_clzll(us);
+        int sub = static_cast<int>(us >> (exponent - 3)) &
+                  (HISTOGRAM_SUB_BUCKETS - 1);
+        int index = (exponent - 2) * HISTOGRAM_SUB_BUCKETS + sub;
+        return std::min(index, HISTOGRAM_BUCKETS - 1);
+    }
+
+    static std::uint64_t upper_bound(int index) {
+        if (index < HISTOGRAM_SUB_BUCKETS) {
+            return index;
+        }
+        int exponent = index / HISTOGRAM_SUB_BUCKETS + 2;
+        std::uint64_t sub = index % HISTOGRAM_SUB_BUCKETS;
+        return ((HISTOGRAM_SUB_BUCKETS + sub + 1) << (exponent - 3)) - 1;
+    }
+
+    std::atomic<std::uint64_t> counts_[HISTOGRAM_BUCKETS] = {};
+    std::atomic<std::uint64_t> count_{0};
+    std::atomic<std::uint64_t> max_{0};
+};
+
+// 段ごとの遅延のヒストグラムとキューの長さ。接続ごとに持ち、
+// 記録した値は全体の集計(parent)にも加える
+class StageStats {
+  public:
+    explicit StageStats(std::string name, StageStats *parent = nullptr)
+        : name_(std::move(name)), parent_(parent) {}
+
+    void record(Stage stage, StageClock::duration elapsed) {
+        auto us =
+            std::chrono::duration_cast<std::chrono::microseconds>(elapsed);
+        histograms_[static_cast<int>(stage)].record(
+            std::max<std::int64_t>(us.count(), 0));
+        if (parent_ != nullptr) {
+            parent_->record(stage, elapsed);
+        }
+    }
+
+    // 全体の集計では接続ごとの最大値だけを持つ
+    void observe(Gauge gauge, std::size_t depth) {
+        gauges_[static_cast<int>(gauge)].current.store(
+            depth, std::memory_order_relaxed);
+        observe_max(gauge, depth);
+    }
+
+    const std::string &name() const { return name_; }
+
+    void print(std::ostream &os) const {
+        const LatencyHistogram &total =
+            histograms_[static_cast<int>(Stage::Total)];
+        os << "Latency [" << name_ << "] " << total.count()
+           << " frames (us: p50/p90/p99/max)" << std::endl;
+        for (int i = 0; i < static_cast<int>(Stage::Count); ++i) {
+            const LatencyHistogram &histogram = histograms_[i];
+            if (histogram.count() == 0) {
+                continue;
+            }
+            os << "  " << std::left << std::setw(10)
+               << stage_name(static_cast<Stage>(i)) << std::right
+               << histogram.percentile(0.5) << "/"
+               << histogram.percentile(0.9) << "/"
+               << histogram.percentile(0.99) << "/" << histogram.max()
+               << std::endl;
+        }
+        os << "  depth    ";
+        for (int i = 0; i < static_cast<int>(Gauge::Count); ++i) {
+            const GaugeValue &gauge = gauges_[i];
+            os << " " << gauge_name(static_cast<Gauge>(i)) << " ";
+            if (parent_ != nullptr) {
+                os << gauge.current.load(std::memory_order_relaxed) << " ";
+            }
+            os << "(max " << gauge.max.load(std::memory_order_relaxed) << ")";
+        }
+        os << std::endl;
+    }
+
+  private:
+    struct GaugeValue {
+        std::atomic<std::size_t> current{0};
+        std::atomic<std::size_t> max{0};
+    };
+
+    void observe_max(Gauge gauge, std::size_t depth) {
+        std::atomic<std::size_t> &max = gauges_[static_cast<int>(gauge)].max;
+        std::size_t prev = max.load(std::memory_order_relaxed);
+        while (depth > prev && !max.compare_exchange_weak(
+                                   prev, depth, std::memory_order_relaxed)) {
+        }
+        if (parent_ != nullptr) {
+            parent_->observe_max(gauge, depth);
+        }
+    }
+
+    std::string name_;
+    StageStats *parent_;
+    LatencyHistogram histograms_[static_cast<int>(Stage::Count)];
+    GaugeValue gauges_[static_cast<int>(Gauge::Count)];
+};
+
+// 1フレームの各段の時刻。フレームと一緒にスレッド間を渡し、
+// 段の終わりでlap()を呼ぶと、前の段の終わりからの時間を記録する。
+// トレースを記録している場合は、段の区間をフレームのイベントとしても残す
+struct FrameTimes {
+    // 記録先の接続の集計。空なら記録しない
+    std::shared_ptr<StageStats> stats;
+    // トレースでのフレームの番号
+    std::uint64_t frame = 0;
+    StageClock::time_point received;
+    StageClock::time_point last;
+
+    // 受信し終えたときに呼ぶ。startは受信を始めた時刻
+    void start(std::shared_ptr<StageStats> connection,
+               StageClock::time_point start) {
+        stats = std::move(connection);
+        received = last = StageClock::now();
+        if (trace_recorder().enabled()) {
+            frame = trace_recorder().next_frame();
+        }
+        lap_at(Stage::Recv, start, received);
+    }
+
+    void lap(Stage stage, StageClock::time_point at = StageClock::now()) {
+        lap_at(stage, last, at);
+        last = at;
+    }
+
+    // 送信し終えたときに呼ぶ
+    void finish() {
+        lap(Stage::Send);
+        lap_at(Stage::Total, received, last);
+    }
+
+  private:
+    void lap_at(Stage stage, StageClock::time_point from,
+                StageClock::time_point to) const {
+        if (stats) {
+            stats->record(stage, to - from);
+        }
+        if (stage != Stage::Total) {
+            trace_recorder().record_stage(stage_name(stage), from, to, frame);
+        }
+    }
+};
+
+// 全体の集計と、接続中の接続ごとの集計をまとめて表示する
+class StageReport {
+  public:
+    StageReport() : total_("all") {}
+
+    std::shared_ptr<StageStats> open(const std::string &name) {
+        auto stats = std::make_shared<StageStats>(name, &total_);
+        std::lock_guard<std::mutex> lock(mtx_);
+        connections_.push_back(stats);
+        return stats;
+    }
+
+    void print(std::ostream &os) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        total_.print(os);
+        auto it = connections_.begin();
+        while (it != connections_.end()) {
+            if (auto stats = it->lock()) {
+                stats->print(os);
+                ++it;
+            } else {
+                it = connections_.erase(it);
+            }
+        }
+    }
+
+  private:
+    StageStats total_;
+    std::mutex mtx_;
+    std::vector<std::weak_ptr<StageStats>> connections_;
+};
+
+// sigを受け取るたびにreportを呼ぶスレッドを起動する。
+// sigは呼び出したスレッドのシグナルマスクで止め、以降に作るスレッドにも
+// 引き継がせて、起動したスレッドだけが受け取る。このため他のスレッドを
+// 作る前に呼ぶこと。起動したスレッドは呼んだときのマスクを引き継ぐので、
+// 他に止めるシグナル(write_trace_on_signal())があれば先に止めておく
+inline void report_on_signal(int sig, std::function<void()> report) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, sig);
+    pthread_sigmask(SIG_BLOCK, &set, nullptr);
+    std::thread([set, report] {
+        while (true) {
+            int received;
+            if (sigwait(&set, &received) == 0) {
+                report();
+            }
+        }
+    }).detach();
+}
@@ -0,0 +1,103 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+
+#include "inference_backend.hpp"
+#include "protocol.hpp"
+#include "stage_stats.hpp"
+
+// フレームや結果に、クライアントが付けたFrameHeaderと各段の時刻を添えて運ぶ
+template <typename T> struct Tagged {
+    FrameHeader header;
+    T value;
+    FrameTimes times;
+    // 接続の中で受信した順番。結果を受信した順に並べ直すのに使う
+    std::uint64_t index = 0;
+    // クライアントが送った画像のサイズ。推論の結果はこのサイズの座標で返す。
+    // 空なら推論した画像のサイズのまま
+    cv::Size size;
+};
+
+// クライアントが付けたFrameHeaderを添えたフレーム
+using TaggedFrame = Tagged<cv::Mat>;
+
+// 画像だけを推論処理に渡し、結果にはフレームのFrameHeaderを引き継ぐ。
+// rescale(result, size)で結果の座標をクライアントが送った画像のサイズに戻す
+template <typename Result, typename Rescale>
+std::vector<Tagged<Result>> run_tagged(InferenceBackend<Result> &backend,
+                                       const std::vector<TaggedFrame> &frames,
+                                       Rescale rescale) {
+    std::vector<cv::Mat> images;
+    images.reserve(frames.size());
+    for (const auto &frame : frames) {
+        images.push_back(frame.value);
+    }
+    auto start = StageClock::now();
+    std::vector<Result> results = backend.run(images);
+    auto end = StageClock::now();
+    std::vector<Tagged<Result>> tagged;
+    tagged.reserve(results.size());
+    for (std::size_t i = 0; i < results.size() && i < frames.size(); ++i) {
+        tagged.push_back({frames[i].header, std::move(results[i]),
+                          frames[i].times, frames[i].index, frames[i].size});
+        if (!frames[i].size.empty()) {
+            rescale(tagged.back().value, frames[i].size);
+        }
+        tagged.back().times.lap(Stage::Queue, start);
+        tagged.back().times.lap(Stage::Infer, end);
+    }
+    return tagged;
+}
+
+template <typename Result>
+std::vector<Tagged<Result>> run_tagged(InferenceBackend<Result> &backend,
+                                       const std::vector<TaggedFrame> &frames) {
+    return run_tagged(backend, frames, [](Result &, const cv::Size &) {});
+}
+
+// 推論せずに捨てたフレームをクライアントに知らせるための結果
+template <typename Result>
+Tagged<Result> dropped_result(const TaggedFrame &frame) {
+    Tagged<Result> result{frame.header, Result(), frame.times, frame.index,
+                          frame.size};
+    result.header.flags |= FRAME_FLAG_DROPPED;
+    return result;
+}
+
+inline bool is_dropped(const FrameHeader &header) {
+    return (header.flags & FRAME_FLAG_DROPPED) != 0;
+}
+
+// FRAME_HEADER_SEQUENCEの接続では結果の先頭にFrameHeaderを付ける。
+// 捨てたフレームの結果は本体を空にする
+template <typename Result, typename Serialize>
+std::string serialize_tagged(const Tagged<Result> &result,
+                             const SessionOptions &options,
+                             const Serialize &serialize) {
+    if (!has_frame_header(options, FRAME_HEADER_SEQUENCE)) {
+        return serialize(result.value, options);
+    }
+    if (is_dropped(result.header)) {
+        return tag_result(result.header, std::string());
+    }
+    return tag_result(result.header, serialize(result.value, options));
+}
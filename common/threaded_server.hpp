@@ -0,0 +1,490 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <boost/asio.hpp>
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+
+#include "decode_pool.hpp"
+#include "delta_result.hpp"
+#include "frame_pool.hpp"
+#include "protocol.hpp"
+#include "server_settings.hpp"
+#include "shared_frame_ring.hpp"
+#include "spsc_ring.hpp"
+#include "stage_stats.hpp"
+#include "tagged_frame.hpp"
+#include "trace.hpp"
+
+// 接続ごとに受信と送信のスレッドを作るサーバ。受信、デコードプールへの投入、
+// 結果の送信は全てのサーバで共通で、フレームごとの処理はPipeline
+// (ModelPipelineなど)に任せる
+template <typename Pipeline> class ThreadedServer {
+  public:
+    using Result = typename Pipeline::Result;
+    using Frame = typename Pipeline::Frame;
+    using Context = typename Pipeline::Context;
+    using Socket = boost::asio::generic::stream_protocol::socket;
+
+    ThreadedServer(Context &context, DecodePool &decode_pool,
+                   StageReport &stage_report, const ServerSettings &settings)
+        : context_(context), decode_pool_(decode_pool),
+          stage_report_(stage_report), settings_(settings) {}
+
+    // 接続を受け付け続け、戻らない
+    void run(const std::string &name) {
+        boost::asio::io_service service;
+        boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::tcp::v4(),
+                                                settings_.port);
+        boost::asio::ip::tcp::acceptor acceptor(service, endpoint);
+        std::cout << "Launched " << name << std::endl;
+        if (!settings_.local_socket.empty()) {
+            std::thread local_thread(&ThreadedServer::accept_local, this);
+            local_thread.detach();
+        }
+
+        while (true) {
+            boost::asio::ip::tcp::socket sock(service);
+            acceptor.accept(sock);
+            std::string client_addr =
+                endpoint_to_string(sock.remote_endpoint());
+            std::cout << "New client: " << client_addr << std::endl;
+            std::thread client_handler_thread(&ThreadedServer::handle, this,
+                                              Socket(std::move(sock)),
+                                              client_addr, false);
+            client_handler_thread.detach();
+        }
+    }
+
+  private:
+    struct Connection {
+        Connection(Socket sock, const QueueLimit &limit)
+            : received(limit.capacity),
+              result(RESULT_RING_SLACK * limit.capacity),
+              socket(std::move(sock)) {}
+
+        std::unique_ptr<Pipeline> pipeline;
+        std::shared_ptr<DecodePool::Stream> decode;
+        // デコードプールに投入したフレーム。デコードが終わった順に取り出す
+        SpscRing<Frame> received;
+        // 送信スレッドへ結果を渡す。結果を入れるスレッドは複数あるので、
+        // 入れる側はresult_mtxで排他する
+        SpscRing<Tagged<Result>> result;
+        std::mutex result_mtx;
+        // フレームIDを付けない接続では、結果を受信した順に並べ直してから
+        // 送信スレッドへ渡す。値が空なら結果を返さずに捨てたフレーム
+        std::mutex order_mtx;
+        std::map<std::uint64_t, std::optional<Tagged<Result>>> done;
+        std::uint64_t next_done = 0;
+        Socket socket;
+        SessionOptions options;
+        // RESULT_FORMAT_DELTAの接続だけ作る
+        std::unique_ptr<DeltaEncoder> delta;
+        FramePool pool;
+        std::shared_ptr<StageStats> stats;
+        // in_flightやdecodingが減ったことを受信スレッドに知らせる
+        WaitEvent space;
+        // 受信してから結果を取り出すまでのフレーム数
+        std::atomic<std::size_t> in_flight{0};
+        // デコードプールに投入して、まだPipelineに渡していないフレーム数
+        std::atomic<std::size_t> decoding{0};
+        std::atomic<std::size_t> dropped_frames{0};
+        std::atomic<std::size_t> dropped_results{0};
+        std::atomic<bool> already_stopped{false};
+    };
+
+    using ConnectionPtr = std::shared_ptr<Connection>;
+
+    void accept_local() {
+        boost::asio::io_service service;
+        const std::string &path = settings_.local_socket;
+        ::unlink(path.c_str());
+        boost::asio::local::stream_protocol::acceptor acceptor(
+            service, boost::asio::local::stream_protocol::endpoint(path));
+
+        while (true) {
+            boost::asio::local::stream_protocol::socket sock(service);
+            acceptor.accept(sock);
+            std::cout << "New local client: " << path << std::endl;
+            std::thread client_handler_thread(&ThreadedServer::handle, this,
+                                              Socket(std::move(sock)), path,
+                                              true);
+            client_handler_thread.detach();
+        }
+    }
+
+    void handle(Socket socket, std::string client_addr, bool shared) {
+        auto data = std::make_shared<Connection>(std::move(socket),
+                                                 settings_.queue_limit);
+        std::weak_ptr<Connection> weak_data = data;
+        data->pipeline = std::make_unique<Pipeline>(
+            context_,
+            [this, weak_data](Tagged<Result> result) {
+                emit(weak_data, std::move(result));
+            },
+            [this, weak_data](const TaggedFrame &frame) {
+                drop(weak_data, frame);
+            });
+        data->pool.set_target_size(data->pipeline->frame_size());
+        // 共有メモリで受け渡す接続では、最初にmemfdを受け取る
+        if (shared) {
+            try {
+                data->pool.attach(SharedFrameRing::attach(
+                    receive_fd(data->socket.native_handle())));
+            } catch (const std::exception &e) {
+                std::cerr << "Error while attaching shared memory: "
+                          << e.what() << std::endl;
+                data->pipeline->close();
+                return;
+            }
+        }
+        data->stats = stage_report_.open(client_addr);
+        data->decode = decode_pool_.open([this, weak_data](cv::Mat image) {
+            push_frame(weak_data, std::move(image));
+        });
+        std::thread tcp_recv_thread(&ThreadedServer::tcp_recv, this, data);
+        std::thread tcp_send_thread(&ThreadedServer::tcp_send, this, data);
+
+        tcp_recv_thread.join();
+        // 受信し終えたフレームの結果を送り終えてから閉じる
+        data->space.wait([&data] {
+            return data->already_stopped || data->in_flight == 0;
+        });
+        data->already_stopped = true;
+        decode_pool_.close(data->decode);
+        data->pipeline->close();
+        data->result.close();
+        tcp_send_thread.join();
+        std::cout << "Connection to " << client_addr
+                  << " is now fully closed (" << data->pool.stats()
+                  << ", dropped " << data->dropped_frames.load()
+                  << " frames and " << data->dropped_results.load()
+                  << " results)" << std::endl;
+        data->stats->print(std::cout);
+        if (data->delta) {
+            std::cout << "Sent " << data->delta->encoded_bytes()
+                      << " bytes of delta results for "
+                      << data->delta->raw_bytes() << " bytes" << std::endl;
+        }
+        data->pipeline->print(std::cout);
+    }
+
+    // Pipelineからの結果。捨てたフレームの知らせもここから送信スレッドへ渡す
+    void emit(const std::weak_ptr<Connection> &weak_data,
+              Tagged<Result> result) {
+        auto data = weak_data.lock();
+        if (!data) {
+            return;
+        }
+        if (has_frame_header(data->options, FRAME_HEADER_SEQUENCE)) {
+            push_result(*data, std::move(result));
+        } else {
+            complete(*data, result.index, std::move(result));
+        }
+    }
+
+    // Pipelineが結果を返さずに捨てたフレーム。
+    // フレームIDを付ける接続ではクライアントに知らせる
+    void drop(const std::weak_ptr<Connection> &weak_data,
+              const TaggedFrame &frame) {
+        auto data = weak_data.lock();
+        if (!data) {
+            return;
+        }
+        ++data->dropped_frames;
+        if (has_frame_header(data->options, FRAME_HEADER_SEQUENCE)) {
+            // 知らせを送信スレッドが取り出すまでは処理中として数える
+            push_result(*data, dropped_result<Result>(frame));
+        } else {
+            complete(*data, frame.index, std::nullopt);
+        }
+    }
+
+    // 先に終わったフレームは、前のフレームが終わるまで保持しておく
+    void complete(Connection &data, std::uint64_t index,
+                  std::optional<Tagged<Result>> result) {
+        std::lock_guard<std::mutex> lock(data.order_mtx);
+        data.done.emplace(index, std::move(result));
+        auto it = data.done.begin();
+        while (it != data.done.end() && it->first == data.next_done) {
+            if (it->second) {
+                push_result(data, std::move(*it->second));
+            } else {
+                --data.in_flight;
+                data.space.notify();
+            }
+            it = data.done.erase(it);
+            ++data.next_done;
+        }
+    }
+
+    void push_result(Connection &data, Tagged<Result> result) {
+        // 受信スレッドが処理中のフレームをリングの容量までに抑えるので、
+        // 通常は待たない。送信スレッドが終わっていればpushはfalseで戻る
+        std::lock_guard<std::mutex> lock(data.result_mtx);
+        data.result.push(std::move(result));
+    }
+
+    // デコードプールから受信した順番で呼ばれ、Pipelineに渡す
+    void push_frame(const std::weak_ptr<Connection> &weak_data,
+                    cv::Mat image) {
+        auto data = weak_data.lock();
+        if (!data) {
+            return;
+        }
+        Frame frame;
+        data->received.try_pop(frame);
+        if (image.empty() && data->pipeline->decodes(frame)) {
+            std::cerr << "Error while decoding frame" << std::endl;
+            --data->in_flight;
+            data->already_stopped = true;
+            // 読み込みを待っている受信スレッドを起こす
+            ::shutdown(data->socket.native_handle(), SHUT_RD);
+        } else {
+            data->pipeline->push(std::move(frame), std::move(image));
+        }
+        --data->decoding;
+        data->space.notify();
+    }
+
+    void tcp_send(ConnectionPtr data) {
+        trace_recorder().name_thread("send");
+        const QueueLimit &limit = settings_.queue_limit;
+        while (true) {
+            Tagged<Result> result;
+            if (!data->result.pop_for(result,
+                                      std::chrono::milliseconds(5000))) {
+                if (data->already_stopped) {
+                    return;
+                } else {
+                    continue;
+                }
+            }
+
+            // キューの上限を超えた分はポリシーに従って古い結果から捨てる。
+            // フレームIDを付ける接続では、推論した結果は捨てずに全て返す
+            std::size_t trimmed = 0;
+            OverflowPolicy policy =
+                has_frame_header(data->options, FRAME_HEADER_SEQUENCE)
+                    ? OverflowPolicy::Block
+                    : limit.policy;
+            if (policy == OverflowPolicy::KeepLatest) {
+                while (data->result.try_pop(result)) {
+                    ++trimmed;
+                }
+            } else if (policy == OverflowPolicy::DropOldest) {
+                while (data->result.size() >= limit.capacity &&
+                       data->result.try_pop(result)) {
+                    ++trimmed;
+                }
+            }
+            data->dropped_results += trimmed;
+            data->in_flight -= trimmed + 1;
+            data->space.notify();
+            data->stats->observe(Gauge::Results, data->result.size());
+            result.times.lap(Stage::Result);
+
+            // 差分は送る順番に作るので、捨てた結果は差分の元にならない
+            auto serialize = [&data](const Result &value,
+                                     const SessionOptions &options) {
+                std::string body = data->pipeline->serialize(value, options);
+                return data->delta ? data->delta->encode(body) : body;
+            };
+            std::string serialized_data =
+                serialize_tagged(result, data->options, serialize);
+            std::size_t data_size = serialized_data.size();
+            result.times.lap(Stage::Serialize);
+
+            std::array<boost::asio::const_buffer, 2> buffers = {
+                boost::asio::buffer(&data_size, sizeof(std::size_t)),
+                boost::asio::buffer(serialized_data)};
+            boost::system::error_code error;
+            boost::asio::write(data->socket, buffers, error);
+            if (error) {
+                std::cerr << "Error sending result: " << error.message()
+                          << std::endl;
+                data->already_stopped = true;
+                data->result.close();
+                // 読み込みや空きを待っている受信スレッドを起こす
+                ::shutdown(data->socket.native_handle(), SHUT_RD);
+                data->space.notify();
+                return;
+            }
+            // 捨てたフレームの知らせは遅延に含めない
+            if (!is_dropped(result.header)) {
+                result.times.finish();
+            }
+        }
+    }
+
+    // ネゴシエーションは最初のフレームより前にだけ受け付ける
+    bool negotiate(Connection &data, std::size_t header) {
+        try {
+            cv::Size frame_size = data.pipeline->frame_size();
+            data.options = accept_session_options(
+                read_session_options(data.socket, header), frame_size.width,
+                frame_size.height, Pipeline::frame_headers, true);
+            data.pool.set_format(data.options);
+            if (data.options.result_format == RESULT_FORMAT_DELTA) {
+                data.delta = std::make_unique<DeltaEncoder>(
+                    settings_.delta_keyframe_interval);
+            }
+            if (has_frame_header(data.options, FRAME_HEADER_SEQUENCE)) {
+                data.pipeline->set_frame_ids();
+            }
+            write_session_options(data.socket, data.options);
+        } catch (const std::exception &e) {
+            std::cerr << "Error while negotiating: " << e.what() << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    void tcp_recv(ConnectionPtr data) {
+        trace_recorder().name_thread("recv");
+        const QueueLimit &limit = settings_.queue_limit;
+        bool negotiable = true;
+        std::uint64_t index = 0;
+        while (true) {
+            boost::system::error_code error;
+            std::size_t frame_size;
+            boost::asio::read(
+                data->socket,
+                boost::asio::buffer(&frame_size, sizeof(std::size_t)), error);
+            if (!error && is_control_message(frame_size)) {
+                if (!negotiable) {
+                    std::cerr << "Error while negotiating: unexpected "
+                                 "control message"
+                              << std::endl;
+                }
+                if (!negotiable || !negotiate(*data, frame_size)) {
+                    data->already_stopped = true;
+                    return;
+                }
+                negotiable = false;
+                continue;
+            }
+            negotiable = false;
+            if (!error && frame_size > MAX_FRAME_SIZE) {
+                std::cerr << "Error while receiving data: frame of "
+                          << frame_size << " bytes is too large" << std::endl;
+                data->already_stopped = true;
+                return;
+            }
+            auto recv_start = StageClock::now();
+            bool end_of_stream = frame_size == 0;
+            // FrameHeader, FrameRequestの順にフレームのデータの先頭に付いている
+            FrameHeader header;
+            FrameRequest request;
+            std::array<boost::asio::mutable_buffer, 2> headers = {
+                boost::asio::buffer(
+                    &header,
+                    has_frame_header(data->options, FRAME_HEADER_SEQUENCE)
+                        ? sizeof(header)
+                        : 0),
+                boost::asio::buffer(
+                    &request,
+                    has_frame_header(data->options, FRAME_HEADER_REQUEST)
+                        ? sizeof(request)
+                        : 0)};
+            std::size_t header_size = boost::asio::buffer_size(headers);
+            if (!error && !end_of_stream && header_size > 0) {
+                if (frame_size < header_size) {
+                    std::cerr << "Error while receiving data: invalid frame"
+                              << std::endl;
+                    data->already_stopped = true;
+                    return;
+                }
+                boost::asio::read(data->socket, headers, error);
+                frame_size -= header_size;
+            }
+            if (!error && frame_size > 0) {
+                boost::asio::read(
+                    data->socket,
+                    boost::asio::buffer(data->pool.receive_buffer(frame_size),
+                                        frame_size),
+                    error);
+            }
+            if (data->already_stopped) {
+                return;
+            }
+            if (error) {
+                std::cerr << "Error while receiving data: " << error.message()
+                          << std::endl;
+                data->already_stopped = true;
+                return;
+            }
+            if (end_of_stream) {
+                // 受信済みのフレームはデコードしてPipelineに渡しておく
+                data->space.wait([&data] { return data->decoding == 0; });
+                return;
+            }
+
+            // デコード待ちが上限に達したら読み込みを止める。
+            // OverflowPolicy::Blockでは処理中のフレームが減るまで止める。
+            // 結果リングが溢れないよう、処理中のフレームはリングの容量までにする
+            data->space.wait([&data, &limit] {
+                return data->already_stopped ||
+                       (data->decoding < limit.capacity &&
+                        data->in_flight < data->result.capacity() &&
+                        (limit.policy != OverflowPolicy::Block ||
+                         data->in_flight < limit.capacity));
+            });
+            if (data->already_stopped) {
+                return;
+            }
+            TaggedFrame tagged{header, cv::Mat(), FrameTimes(), index++};
+            tagged.times.start(data->stats, recv_start);
+            ReceivedFrame received = data->pool.take();
+            Frame frame;
+            if (frame_size == 0 || header.version != FRAME_HEADER_VERSION ||
+                !data->pipeline->receive(tagged, request, data->pool, received,
+                                         frame)) {
+                std::cerr << "Error while receiving data: invalid frame"
+                          << std::endl;
+                data->already_stopped = true;
+                return;
+            }
+            ++data->in_flight;
+            ++data->decoding;
+            data->stats->observe(Gauge::InFlight, data->in_flight);
+            data->stats->observe(Gauge::Decoding, data->decoding);
+            Frame queued = frame;
+            data->received.try_push(queued);
+
+            // デコードと前処理はプールのスレッドで並列に行う
+            decode_pool_.submit(data->decode, [data, frame, received] {
+                return data->pipeline->decode(data->pool, received, frame);
+            });
+        }
+    }
+
+    Context &context_;
+    DecodePool &decode_pool_;
+    StageReport &stage_report_;
+    ServerSettings settings_;
+};
@@ -0,0 +1,309 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <pthread.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "options.hpp"
+
+// スレッドごとに保持するイベントの数。超えたら古いものから上書きする
+#define DEFAULT_TRACE_EVENTS 65536
+
+// 1つの区間。nameは文字列リテラルなど、書き出すまで有効なものを渡す
+struct TraceEvent {
+    const char *name;
+    std::int64_t begin_us;
+    std::int64_t duration_us;
+    std::uint64_t frame;
+    // trueならスレッドの処理ではなく、フレームごとの段(非同期の区間)
+    bool frame_stage;
+};
+
+// フレームの各段の開始・終了をスレッドごとのリングバッファに記録し、
+// Chrome trace形式(chrome://tracingやPerfettoで開ける)のJSONに書き出す。
+// 記録はスレッド内で閉じるので、ロックもスレッド間の共有も無い。
+// write()は記録を止め、書き込み中のスレッドが終わるのを待ってから読む
+class TraceRecorder {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    // pathが空なら何も記録しない。他のスレッドが記録を始める前に呼ぶこと
+    void open(const std::string &path, std::size_t events_per_thread) {
+        path_ = path;
+        capacity_ = std::max<std::size_t>(events_per_thread, 1);
+        origin_ = Clock::now();
+        enabled_.store(!path.empty(), std::memory_order_release);
+    }
+
+    bool enabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+    // フレームを区別する番号。Chrome traceの非同期イベントのIDになる
+    std::uint64_t next_frame() {
+        return next_frame_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // 呼び出したスレッドの処理の区間
+    void record(const char *name, Clock::time_point begin,
+                Clock::time_point end, std::uint64_t frame = 0) {
+        append(name, begin, end, frame, false);
+    }
+
+    // フレームがある段にいた区間。他のスレッドで始まった区間でもよい
+    void record_stage(const char *name, Clock::time_point begin,
+                      Clock::time_point end, std::uint64_t frame) {
+        append(name, begin, end, frame, true);
+    }
+
+    // 呼び出したスレッドに名前を付ける
+    void name_thread(const std::string &name) {
+        if (enabled()) {
+            ThreadBuffer *buffer = this->buffer();
+            std::lock_guard<std::mutex> lock(mtx_);
+            buffer->name = name;
+        }
+    }
+
+    // 記録をやめて書き出す
+    bool write() {
+        if (!enabled_.exchange(false)) {
+            return true;
+        }
+        std::lock_guard<std::mutex> lock(mtx_);
+        // enabled_を見る前に書き込み中の印を付けるので、印が消えた後の
+        // スレッドはもうバッファに書き込まない
+        for (const auto &buffer : buffers_) {
+            while (buffer->writing.load()) {
+                std::this_thread::yield();
+            }
+        }
+        std::ofstream out(path_);
+        out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        bool first = true;
+        auto separator = [&out, &first]() -> std::ostream & {
+            out << (first ? "\n" : ",\n");
+            first = false;
+            return out;
+        };
+        for (const auto &buffer : buffers_) {
+            if (!buffer->name.empty()) {
+                separator() << "{\"ph\":\"M\",\"name\":\"thread_name\","
+                               "\"pid\":1,\"tid\":"
+                            << buffer->tid << ",\"args\":{\"name\":\""
+                            << buffer->name << "\"}}";
+            }
+            std::uint64_t end = buffer->next.load(std::memory_order_acquire);
+            std::uint64_t begin = end > capacity_ ? end - capacity_ : 0;
+            for (std::uint64_t i = begin; i < end; ++i) {
+                const TraceEvent &event = buffer->events[i % capacity_];
+                if (event.frame_stage) {
+                    // 非同期イベントは開始と終了の2つで表す
+                    separator() << "{\"ph\":\"b\",\"cat\":\"frame\",\"name\":\""
+                                << event.name << "\",\"id\":" << event.frame
+                                << ",\"pid\":1,\"tid\":" << buffer->tid
+                                << ",\"ts\":" << event.begin_us << "}";
+                    separator() << "{\"ph\":\"e\",\"cat\":\"frame\",\"name\":\""
+                                << event.name << "\",\"id\":" << event.frame
+                                << ",\"pid\":1,\"tid\":" << buffer->tid
+                                << ",\"ts\":"
+                                << event.begin_us + event.duration_us << "}";
+                } else {
+                    separator() << "{\"ph\":\"X\",\"name\":\"" << event.name
+                                << "\",\"pid\":1,\"tid\":" << buffer->tid
+                                << ",\"ts\":" << event.begin_us
+                                << ",\"dur\":" << event.duration_us
+                                << ",\"args\":{\"frame\":" << event.frame
+                                << "}}";
+                }
+            }
+        }
+        out << "\n]}\n";
+        out.close();
+        if (!out) {
+            std::cerr << "Failed to write trace: " << path_ << std::endl;
+            return false;
+        }
+        std::cout << "Trace written to " << path_ << std::endl;
+        return true;
+    }
+
+  private:
+    struct ThreadBuffer {
+        int tid = 0;
+        std::string name;
+        std::vector<TraceEvent> events;
+        // 次に書き込む位置(通算)。書き込むのは持ち主のスレッドだけ
+        std::atomic<std::uint64_t> next{0};
+        // 持ち主のスレッドがイベントを書き込んでいる間true
+        std::atomic<bool> writing{false};
+        bool in_use = false;
+    };
+
+    // 終了したスレッドのバッファは記録を残したまま次のスレッドに使い回す。
+    // 接続ごとにスレッドを作っても、バッファは同時に動くスレッドの数で済む
+    struct Lease {
+        ~Lease() {
+            if (buffer != nullptr) {
+                std::lock_guard<std::mutex> lock(*mtx);
+                buffer->in_use = false;
+            }
+        }
+        ThreadBuffer *buffer = nullptr;
+        std::mutex *mtx = nullptr;
+    };
+
+    ThreadBuffer *buffer() {
+        thread_local Lease lease;
+        if (lease.buffer != nullptr) {
+            return lease.buffer;
+        }
+        std::lock_guard<std::mutex> lock(mtx_);
+        for (auto &buffer : buffers_) {
+            if (!buffer->in_use) {
+                lease.buffer = buffer.get();
+                break;
+            }
+        }
+        if (lease.buffer == nullptr) {
+            buffers_.push_back(std::make_unique<ThreadBuffer>());
+            lease.buffer = buffers_.back().get();
+            lease.buffer->tid = static_cast<int>(buffers_.size());
+            lease.buffer->events.resize(capacity_);
+        }
+        lease.buffer->in_use = true;
+        lease.mtx = &mtx_;
+        return lease.buffer;
+    }
+
+    void append(const char *name, Clock::time_point begin,
+                Clock::time_point end, std::uint64_t frame, bool frame_stage) {
+        if (!enabled()) {
+            return;
+        }
+        ThreadBuffer *buffer = this->buffer();
+        buffer->writing.store(true);
+        if (enabled_.load()) {
+            std::uint64_t next = buffer->next.load(std::memory_order_relaxed);
+            buffer->events[next % capacity_] = {name, to_us(begin),
+                                                to_us(end) - to_us(begin),
+                                                frame, frame_stage};
+            buffer->next.store(next + 1, std::memory_order_release);
+        }
+        buffer->writing.store(false, std::memory_order_release);
+    }
+
+    std::int64_t to_us(Clock::time_point time) const {
+        return std::chrono::duration_cast<std::chrono::microseconds>(time -
+                                                                     origin_)
+            .count();
+    }
+
+    std::atomic<bool> enabled_{false};
+    std::atomic<std::uint64_t> next_frame_{0};
+    std::string path_;
+    std::size_t capacity_ = DEFAULT_TRACE_EVENTS;
+    Clock::time_point origin_;
+    std::mutex mtx_;
+    std::vector<std::unique_ptr<ThreadBuffer>> buffers_;
+};
+
+inline TraceRecorder &trace_recorder() {
+    static TraceRecorder recorder;
+    return recorder;
+}
+
+// --trace=<パス>を指定したときだけ記録する
+inline void trace_from_options(const Options &options) {
+    trace_recorder().open(
+        options.get("trace", ""),
+        options.get_int("trace-events", DEFAULT_TRACE_EVENTS));
+}
+
+// write_trace_on_signal()で止めたシグナル。記録しないときは空
+inline sigset_t &trace_signals() {
+    static sigset_t set = [] {
+        sigset_t empty;
+        sigemptyset(&empty);
+        return empty;
+    }();
+    return set;
+}
+
+// 終了しないサーバでは、SIGINTかSIGTERMを受け取ったら書き出して終了する。
+// シグナルは全てのスレッドで止めておき、wait_trace_signal()を呼んだ
+// メインスレッドで受け取る。他のスレッドを作る前に呼ぶこと
+inline void write_trace_on_signal() {
+    if (!trace_recorder().enabled()) {
+        return;
+    }
+    sigset_t &set = trace_signals();
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, nullptr);
+}
+
+inline bool waits_trace_signal() {
+    return sigismember(&trace_signals(), SIGINT) == 1;
+}
+
+// メインスレッドでシグナルを待ち、記録を書き出して終了する。
+// 他のスレッドは動いたままなので、静的なオブジェクトは破棄せずに終える
+[[noreturn]] inline void wait_trace_signal() {
+    int received;
+    while (sigwait(&trace_signals(), &received) != 0) {
+    }
+    trace_recorder().write();
+    std::cout.flush();
+    std::_Exit(0);
+}
+
+// スコープの間を呼び出したスレッドの処理として記録する
+class TraceScope {
+  public:
+    explicit TraceScope(const char *name, std::uint64_t frame = 0)
+        : name_(name), frame_(frame) {
+        if (trace_recorder().enabled()) {
+            begin_ = TraceRecorder::Clock::now();
+        }
+    }
+
+    ~TraceScope() {
+        if (trace_recorder().enabled()) {
+            trace_recorder().record(name_, begin_,
+                                    TraceRecorder::Clock::now(), frame_);
+        }
+    }
+
+    TraceScope(const TraceScope &) = delete;
+    TraceScope &operator=(const TraceScope &) = delete;
+
+  private:
+    const char *name_;
+    std::uint64_t frame_;
+    TraceRecorder::Clock::time_point begin_;
+};
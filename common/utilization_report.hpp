@@ -0,0 +1,78 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// 起動してからの、推論1フレームあたりの平均時間
+template <typename InstanceStats>
+std::chrono::duration<double>
+inference_per_frame(const std::vector<InstanceStats> &stats) {
+    std::chrono::duration<double> busy(0);
+    std::size_t frames = 0;
+    for (const auto &instance : stats) {
+        busy += instance.busy;
+        frames += instance.frames;
+    }
+    return frames > 0 ? busy / frames : busy;
+}
+
+// intervalごとに、インスタンスごとの稼働率(推論を実行していた時間の割合)と
+// 処理したフレーム数を表示してreportを呼ぶスレッドを起動する。
+// 間に1つもバッチを実行しなかったときは表示しない。
+// labelはインスタンスの番号の前に表示するモデルの名前を返す
+template <typename Scheduler>
+void report_utilization(
+    const Scheduler &scheduler, std::chrono::seconds interval,
+    std::function<void(const std::vector<typename Scheduler::InstanceStats> &)>
+        report,
+    std::function<std::string(std::size_t model)> label = nullptr) {
+    std::thread([&scheduler, interval, report, label] {
+        auto prev = scheduler.instance_stats();
+        while (true) {
+            std::this_thread::sleep_for(interval);
+            auto stats = scheduler.instance_stats();
+            std::size_t batches = 0;
+            for (std::size_t i = 0; i < stats.size(); ++i) {
+                batches += stats[i].batches - prev[i].batches;
+            }
+            if (batches == 0) {
+                prev = stats;
+                continue;
+            }
+            std::cout << "Utilization:";
+            for (std::size_t i = 0; i < stats.size(); ++i) {
+                std::chrono::duration<double> busy =
+                    stats[i].busy - prev[i].busy;
+                std::cout << " " << (label ? label(stats[i].model) : "")
+                          << "#" << i << " " << std::fixed
+                          << std::setprecision(1)
+                          << 100.0 * busy.count() / interval.count() << "% ("
+                          << stats[i].frames - prev[i].frames << " frames)";
+            }
+            std::cout << std::endl;
+            report(stats);
+            prev = stats;
+        }
+    }).detach();
+}
@@ -14,201 +14,123 @@
  * limitations under the License.
  */
 
+
 #define BOOST_BIND_GLOBAL_PLACEHOLDERS
 
-#include <boost/asio.hpp>
 #include <boost/json.hpp>
 #include <boost/json/src.hpp>
-#include <condition_variable>
 #include <iostream>
-#include <mutex>
 #include <opencv2/opencv.hpp>
-#include <queue>
 #include <thread>
-#include <vitis/ai/facedetect.hpp>
-
-#define DEFAULT_PORT 54321
-
-struct FrameInfo {
-    FrameInfo(cv::Mat img, boost::asio::ip::tcp::socket sock)
-        : image_in(std::queue<cv::Mat>()),
-          result(std::queue<vitis::ai::FaceDetectResult>()),
-          socket(std::move(sock)), already_stopped(false) {}
-
-    std::queue<cv::Mat> image_in;
-    std::queue<vitis::ai::FaceDetectResult> result;
-    boost::asio::ip::tcp::socket socket;
-    std::mutex mtx_in;
-    std::mutex mtx_result;
-    std::condition_variable cv_in;
-    std::condition_variable cv_result;
-    bool already_stopped;
-};
-
-std::unique_ptr<vitis::ai::FaceDetect> model;
-std::mutex mtx_dpu;
-
-void face_detect(std::shared_ptr<FrameInfo> data) {
-    while (true) {
-        std::unique_lock<std::mutex> lock_in(data->mtx_in);
-        data->cv_in.wait_for(lock_in, std::chrono::milliseconds(5000),
-                             [&data] { return !data->image_in.empty(); });
-        if (data->image_in.empty()) {
-            lock_in.unlock();
-            data->cv_in.notify_one();
-            if (data->already_stopped) {
-                return;
-            } else {
-                continue;
-            }
-        }
 
-        cv::Mat image = data->image_in.front();
-        data->image_in.pop();
-        lock_in.unlock();
-        data->cv_in.notify_one();
+#include "batch_scheduler.hpp"
+#include "decode_pool.hpp"
+#include "face_tracker.hpp"
+#include "facedetect_backend.hpp"
+#include "model_pipeline.hpp"
+#include "options.hpp"
+#include "run_server.hpp"
+#include "scene_gate.hpp"
+#include "server_settings.hpp"
+#include "stage_stats.hpp"
+#include "tagged_frame.hpp"
+#include "trace.hpp"
+#include "utilization_report.hpp"
 
-        if (image.rows != 360 && image.cols != 640) {
-            cv::resize(image, image, cv::Size(640, 360));
-        }
-
-        std::unique_lock<std::mutex> lock_dpu(mtx_dpu);
-        vitis::ai::FaceDetectResult result = model->run(image);
-        lock_dpu.unlock();
-
-        std::unique_lock<std::mutex> lock_result(data->mtx_result);
-        data->result.push(result);
-        lock_result.unlock();
-        data->cv_result.notify_one();
-    }
-}
-
-std::string result_to_json_string(const vitis::ai::FaceDetectResult &result) {
-    boost::json::object result_json;
-    result_json["num"] = result.rects.size();
-    result_json["height"] = result.height;
-    result_json["width"] = result.width;
-    int num = 0;
-    for (const auto &r : result.rects) {
-        boost::json::object result_json_pos;
-        result_json_pos["x"] = static_cast<int>((r.x < 0 ? 0 : r.x) * result.width);
-        result_json_pos["y"] = static_cast<int>((r.y < 0 ? 0 : r.y) * result.height);
-        result_json_pos["size_col"] = static_cast<int>(r.width * result.width);
-        result_json_pos["size_row"] = static_cast<int>(r.height * result.height);
-        result_json[std::to_string(++num)] = std::move(result_json_pos);
-    }
-    std::string serialized_data = boost::json::serialize(result_json);
-    return serialized_data;
-}
-
-void tcp_send(std::shared_ptr<FrameInfo> data) {
-    while (true) {
-        std::unique_lock<std::mutex> lock_result(data->mtx_result);
-        data->cv_result.wait_for(lock_result, std::chrono::milliseconds(5000),
-                                 [&data] { return !data->result.empty(); });
-        if (data->result.empty()) {
-            lock_result.unlock();
-            data->cv_result.notify_one();
-            if (data->already_stopped) {
-                return;
-            } else {
-                continue;
-            }
-        }
-
-        vitis::ai::FaceDetectResult result = data->result.front();
-        data->result.pop();
+#define DEFAULT_PORT 54321
+#define DEFAULT_BATCH_WAIT_US 2000
+#define DEFAULT_REPORT_INTERVAL_S 10
 
-        lock_result.unlock();
-        data->cv_result.notify_one();
+using Pipeline = ModelPipeline<vitis::ai::FaceDetectResult>;
+using Scheduler = Pipeline::Scheduler;
+using Gated = GatedStream<vitis::ai::FaceDetectResult>;
 
-        std::string serialized_data = result_to_json_string(result);
-        std::size_t data_size = serialized_data.size();
+StageReport stage_report;
+GateStats gate_stats;
 
-        async_write(data->socket,
-                    boost::asio::buffer(&data_size, sizeof(std::size_t)),
-                    [&data](const boost::system::error_code &ec, size_t) {
-                        if (ec) {
-                            std::cerr << "Error sending image: " << ec.message()
-                                      << std::endl;
-                            data->already_stopped = true;
-                        }
-                    });
+// DPUのコアやコンピュートユニットの数だけインスタンスを作る
+std::vector<std::unique_ptr<FaceBackend>> models;
+std::unique_ptr<Scheduler> scheduler;
+std::unique_ptr<DecodePool> decode_pool;
 
-        async_write(data->socket,
-                    boost::asio::buffer(serialized_data, data_size),
-                    [&data](const boost::system::error_code &ec, size_t) {
-                        if (ec) {
-                            std::cerr << "Error sending image: " << ec.message()
-                                      << std::endl;
-                            data->already_stopped = true;
-                        }
-                    });
+cv::Mat preprocess(cv::Mat image) {
+    // 前処理をまとめて行うバックエンドは、縮小も含めてここで済ませる
+    if (models[0]->fuses_resize()) {
+        return models[0]->prepare(image);
     }
-}
-
-void tcp_recv(std::shared_ptr<FrameInfo> data) {
-    while (true) {
-        boost::system::error_code error;
-        std::size_t frame_size;
-        boost::asio::read(data->socket,
-                          boost::asio::buffer(&frame_size, sizeof(std::size_t)),
-                          error);
-        std::vector<uchar> buf(frame_size);
-        boost::asio::read(data->socket, boost::asio::buffer(buf, frame_size),
-                          error);
-        if (error) {
-            std::cerr << "Error while receiving data: " << error.message()
-                      << std::endl;
-            data->already_stopped = true;
-            return;
-        }
-        if(buf.empty()) {
-            return;
-        }
-        cv::Mat image = cv::imdecode(cv::Mat(buf), cv::IMREAD_COLOR);
-        std::unique_lock<std::mutex> lock_in(data->mtx_in);
-        data->image_in.push(image);
-        lock_in.unlock();
-        data->cv_in.notify_one();
+    if (image.rows != 360 || image.cols != 640) {
+        cv::resize(image, image, cv::Size(640, 360));
     }
-}
-
-void client_handler(boost::asio::ip::tcp::socket socket) {
-    auto client_addr = socket.remote_endpoint();
-    auto client_data =
-        std::make_shared<FrameInfo>(cv::Mat(), std::move(socket));
-    std::thread tcp_recv_thread(tcp_recv, client_data);
-    std::thread face_detect_thread(face_detect, client_data);
-    std::thread tcp_send_thread(tcp_send, client_data);
-
-    tcp_recv_thread.join();
-    face_detect_thread.join();
-    tcp_send_thread.join();
-    std::cout << "Connection to " << client_addr << " is now fully closed"
-              << std::endl;
+    return image;
 }
 
 int main(int argc, char *argv[]) {
-    std::string model_ = argv[1];
+    Options options(argc, argv);
+    std::string model_ = options.positional(0);
     int port = DEFAULT_PORT;
-    if (argc > 2) {
-        port = std::stoi(argv[2]);
+    if (options.positional_size() > 1) {
+        port = std::stoi(options.positional(1));
+    }
+    auto batch_wait = std::chrono::microseconds(
+        options.get_int("batch-wait-us", DEFAULT_BATCH_WAIT_US));
+    ServerSettings settings = server_settings_from_options(options, port);
+    double gate_threshold = gate_threshold_from_options(options);
+    TrackOptions track_options = track_options_from_options(options);
+    if (track_options.interval > 0 && gate_threshold > 0) {
+        std::cerr << "--track-interval and --gate-threshold cannot be combined"
+                  << std::endl;
+        return 1;
+    }
+    trace_from_options(options);
+    // 以下の2つは呼び出したスレッドでシグナルを止め、以降に作る全ての
+    // スレッドがそれを引き継ぐ。SIGINTとSIGTERMを止めてから報告のスレッドを
+    // 作るので、どちらも他のスレッドを作る前にこの順で呼ぶ
+    write_trace_on_signal();
+    report_on_signal(SIGUSR1, [] { stage_report.print(std::cout); });
+    decode_pool = std::make_unique<DecodePool>(
+        options.get_int("decode-threads", std::thread::hardware_concurrency()));
+
+    std::vector<Scheduler::RunBatch> instances;
+    for (long i = 0; i < std::max(options.get_int("instances", 1), 1L); ++i) {
+        models.push_back(create_face_backend(options, model_));
+        FaceBackend *model = models.back().get();
+        instances.push_back([model](const std::vector<TaggedFrame> &frames) {
+            return run_tagged(*model, frames, rescale_result);
+        });
+    }
+    scheduler = std::make_unique<Scheduler>(
+        std::move(instances), models[0]->input_batch(), batch_wait);
+    long report_interval =
+        options.get_int("report-interval", DEFAULT_REPORT_INTERVAL_S);
+    if (report_interval > 0) {
+        report_utilization(
+            *scheduler, std::chrono::seconds(report_interval),
+            [](const std::vector<Scheduler::InstanceStats> &stats) {
+                stage_report.print(std::cout);
+                gate_stats.print(std::cout, inference_per_frame(stats));
+            });
     }
 
-    model = vitis::ai::FaceDetect::create(model_);
-
-    boost::asio::io_service service;
-    boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::tcp::v4(), port);
-    boost::asio::ip::tcp::acceptor acceptor(service, endpoint);
-    std::cout << "Launched face detection server" << std::endl;
-
-    while (true) {
-        boost::asio::ip::tcp::socket sock(service);
-        acceptor.accept(sock);
-        std::cout << "New client: " << sock.remote_endpoint() << std::endl;
-        std::thread client_handler_thread(client_handler, std::move(sock));
-        client_handler_thread.detach();
+    Pipeline::Context context{
+        *scheduler, settings.queue_limit,
+        cv::Size(DENSEBOX_INPUT_WIDTH, DENSEBOX_INPUT_HEIGHT), preprocess,
+        serialize_result};
+    // --track-intervalを指定したときは、間のフレームを追跡で済ませる。
+    // --gate-thresholdを指定したときは、同じ場面のフレームを推論しない
+    if (track_options.interval > 0) {
+        context.bypass = [track_options](Pipeline::Submit submit,
+                                         Pipeline::Emit emit) {
+            return std::make_unique<TrackingStream>(
+                track_options, std::move(submit), std::move(emit));
+        };
+    } else if (gate_threshold > 0) {
+        context.bypass = [gate_threshold](Pipeline::Submit submit,
+                                          Pipeline::Emit emit) {
+            return std::make_unique<Gated>(gate_threshold, gate_stats,
+                                           std::move(submit), std::move(emit));
+        };
     }
+    run_server<Pipeline>(context, *decode_pool, stage_report, settings,
+                         "face detection server");
     return 0;
 }
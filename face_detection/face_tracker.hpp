@@ -0,0 +1,255 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <opencv2/opencv.hpp>
+#include <ostream>
+#include <vector>
+
+#include "bypass_queue.hpp"
+#include "facedetect_result.hpp"
+#include "options.hpp"
+#include "tagged_frame.hpp"
+#include "trace.hpp"
+
+// 追跡は縮小したグレースケールの画像で行う
+#define TRACK_WIDTH 160
+#define TRACK_HEIGHT 90
+// 前の位置からこの画素数(縮小後)までの移動を探す
+#define TRACK_SEARCH_MARGIN 8
+#define DEFAULT_TRACK_MAX_INTERVAL 30
+#define DEFAULT_TRACK_THRESHOLD 0.5
+
+struct TrackOptions {
+    // DPUで検出するフレームの間隔。0なら追跡せずに全てのフレームを検出する
+    int interval = 0;
+    // 負荷に応じて間隔を広げる上限
+    int max_interval = DEFAULT_TRACK_MAX_INTERVAL;
+    // 追跡の一致度(正規化相互相関)がこれを下回ったら次のフレームを検出する
+    double threshold = DEFAULT_TRACK_THRESHOLD;
+};
+
+inline TrackOptions track_options_from_options(const Options &options) {
+    TrackOptions track;
+    track.interval = std::max(options.get_int("track-interval", 0), 0L);
+    track.max_interval =
+        std::max<long>(options.get_int("track-max-interval",
+                                       DEFAULT_TRACK_MAX_INTERVAL),
+                       track.interval);
+    track.threshold =
+        options.get_double("track-threshold", DEFAULT_TRACK_THRESHOLD);
+    return track;
+}
+
+inline cv::Mat tracking_image(const cv::Mat &image) {
+    cv::Mat small, gray;
+    cv::resize(image, small, cv::Size(TRACK_WIDTH, TRACK_HEIGHT), 0, 0,
+               cv::INTER_AREA);
+    cv::cvtColor(small, gray, cv::COLOR_BGR2GRAY);
+    return gray;
+}
+
+// 検出したフレームの顔をテンプレートとし、以降のフレームで
+// 前の位置の周りからテンプレートマッチングで探す
+class FaceTracker {
+  public:
+    bool empty() const { return key_.empty(); }
+
+    void reset(const cv::Mat &gray, const vitis::ai::FaceDetectResult &result) {
+        key_ = gray;
+        result_ = result;
+        templates_.clear();
+        positions_.clear();
+        cv::Rect bounds(0, 0, gray.cols, gray.rows);
+        for (const auto &r : result.rects) {
+            cv::Rect rect(r.x * gray.cols, r.y * gray.rows, r.width * gray.cols,
+                          r.height * gray.rows);
+            rect &= bounds;
+            templates_.push_back(rect);
+            positions_.push_back(rect);
+        }
+    }
+
+    // 最後に検出した顔を現在のフレームで探して結果を作り、
+    // 最も低い一致度を返す(顔が無ければ1)
+    double track(const cv::Mat &gray, vitis::ai::FaceDetectResult &result) {
+        result = result_;
+        double confidence = 1.0;
+        cv::Rect bounds(0, 0, gray.cols, gray.rows);
+        for (std::size_t i = 0; i < templates_.size(); ++i) {
+            const cv::Rect &templ = templates_[i];
+            cv::Rect &position = positions_[i];
+            // 小さすぎる顔は追跡できないので、位置を変えずに再検出を促す
+            if (templ.width < 4 || templ.height < 4) {
+                confidence = 0.0;
+                continue;
+            }
+            cv::Rect search(position.x - TRACK_SEARCH_MARGIN,
+                            position.y - TRACK_SEARCH_MARGIN,
+                            templ.width + 2 * TRACK_SEARCH_MARGIN,
+                            templ.height + 2 * TRACK_SEARCH_MARGIN);
+            search &= bounds;
+            if (search.width < templ.width || search.height < templ.height) {
+                confidence = 0.0;
+                continue;
+            }
+            cv::Mat score;
+            cv::matchTemplate(gray(search), key_(templ), score,
+                              cv::TM_CCOEFF_NORMED);
+            double max_score;
+            cv::Point best;
+            cv::minMaxLoc(score, nullptr, &max_score, nullptr, &best);
+            confidence = std::min(confidence, max_score);
+            position.x = search.x + best.x;
+            position.y = search.y + best.y;
+            result.rects[i].x = float(position.x) / gray.cols;
+            result.rects[i].y = float(position.y) / gray.rows;
+        }
+        return confidence;
+    }
+
+  private:
+    cv::Mat key_;
+    vitis::ai::FaceDetectResult result_;
+    // 検出したフレームでの顔の領域と、追跡中の位置(縮小した画像の座標)
+    std::vector<cv::Rect> templates_;
+    std::vector<cv::Rect> positions_;
+};
+
+// 接続ごとに、interval枚に1枚(または追跡の一致度が下がったとき)だけ
+// DPUで検出し、間のフレームは最後に終わった検出の結果をCPUで追跡して
+// 結果を作る。追跡したフレームは検出の結果を待たずにすぐ返す。
+// 検出の結果を待っているフレームが2つ以上あるときに次の検出が来たら
+// DPUが追いついていないので間隔を広げ、待っていなければ狭める
+class TrackingStream : public BypassStream<vitis::ai::FaceDetectResult> {
+  public:
+    using Result = Tagged<vitis::ai::FaceDetectResult>;
+    using Submit = std::function<void(TaggedFrame)>;
+    using Emit = std::function<void(Result)>;
+
+    TrackingStream(const TrackOptions &options, Submit submit, Emit emit)
+        : options_(options), interval_(options.interval),
+          submit_(std::move(submit)), emit_(std::move(emit)) {}
+
+    // 追跡用の縮小したグレースケールの画像はデコードプールのスレッドで作る
+    cv::Mat inspect(const cv::Mat &image) override {
+        return tracking_image(image);
+    }
+
+    void push(TaggedFrame frame, std::optional<std::uint64_t>,
+              cv::Mat gray) override {
+        std::unique_lock<std::mutex> lock(mtx_);
+        if (!detect_next()) {
+            emit_(track(frame, gray));
+            return;
+        }
+        detecting_.emplace(frame.index, gray);
+        lock.unlock();
+        // スケジューラが捨てたフレームはdroppedで戻ってくる
+        submit_(std::move(frame));
+    }
+
+    // スケジューラから検出結果を受け取り、以降はこのフレームから追跡する
+    void inferred(Result result) override {
+        std::lock_guard<std::mutex> lock(mtx_);
+        auto it = detecting_.find(result.index);
+        if (it != detecting_.end()) {
+            tracker_.reset(it->second, result.value);
+            detecting_.erase(it);
+        }
+        ++detected_frames_;
+        emit_(std::move(result));
+    }
+
+    // スケジューラがキューの上限で捨てたフレームは、追跡して結果を返す
+    void dropped(const TaggedFrame &frame) override {
+        std::lock_guard<std::mutex> lock(mtx_);
+        auto it = detecting_.find(frame.index);
+        if (it == detecting_.end()) {
+            return;
+        }
+        cv::Mat gray = it->second;
+        detecting_.erase(it);
+        emit_(track(frame, gray));
+    }
+
+    void print(std::ostream &os) const override {
+        os << "Detected " << detected_frames_ << " frames and tracked "
+           << tracked_frames_ << " frames" << std::endl;
+    }
+
+  private:
+    bool detect_next() {
+        ++since_detect_;
+        if (!redetect_ && since_detect_ < interval_) {
+            return false;
+        }
+        if (!redetect_) {
+            std::size_t waiting = detecting_.size();
+            if (waiting >= 2) {
+                interval_ = std::min(interval_ + 1, options_.max_interval);
+            } else if (waiting == 0) {
+                interval_ = std::max(interval_ - 1, options_.interval);
+            }
+        }
+        redetect_ = false;
+        since_detect_ = 0;
+        return true;
+    }
+
+    // 最後に終わった検出の結果から追跡する。まだ検出が終わっていなければ
+    // 顔の無い結果を返す
+    Result track(const TaggedFrame &frame, const cv::Mat &gray) {
+        Result result{frame.header, vitis::ai::FaceDetectResult(),
+                      frame.times, frame.index, frame.size};
+        TraceScope scope("track", frame.times.frame);
+        if (tracker_.empty()) {
+            result.value.width = DENSEBOX_INPUT_WIDTH;
+            result.value.height = DENSEBOX_INPUT_HEIGHT;
+            if (!frame.size.empty()) {
+                rescale_result(result.value, frame.size);
+            }
+            // 検出を待っていれば、その結果から追跡を始める
+            redetect_ = detecting_.empty();
+        } else if (tracker_.track(gray, result.value) <
+                   options_.threshold) {
+            redetect_ = true;
+        }
+        result.times.lap(Stage::Infer);
+        ++tracked_frames_;
+        return result;
+    }
+
+    TrackOptions options_;
+    int interval_;
+    int since_detect_ = 0;
+    // 最初のフレームと、追跡の一致度が下がった次のフレームは検出する
+    bool redetect_ = true;
+    Submit submit_;
+    Emit emit_;
+    FaceTracker tracker_;
+    std::mutex mtx_;
+    // 検出を頼んだフレームの追跡用の画像。検出が終わったら追跡の元にする
+    std::map<std::uint64_t, cv::Mat> detecting_;
+    std::atomic<std::size_t> detected_frames_{0};
+    std::atomic<std::size_t> tracked_frames_{0};
+};
@@ -0,0 +1,99 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <memory>
+#include <opencv2/opencv.hpp>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "dpu_task_backend.hpp"
+#include "facedetect_result.hpp"
+#include "inference_backend.hpp"
+#include "options.hpp"
+
+#ifdef WITH_VITIS_AI
+#include <vitis/ai/nnpp/facedetect.hpp>
+#endif
+
+using FaceBackend = InferenceBackend<vitis::ai::FaceDetectResult>;
+
+// 座標と大きさは入力画像に対する比率で表す(Vitis AI Libraryと同じ)
+inline vitis::ai::FaceDetectResult
+synthetic_face_result(const cv::Mat &image, int num_faces, std::mt19937 &rng) {
+    vitis::ai::FaceDetectResult result;
+    result.width = image.empty() ? DENSEBOX_INPUT_WIDTH : image.cols;
+    result.height = image.empty() ? DENSEBOX_INPUT_HEIGHT : image.rows;
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    for (int n = 0; n < num_faces; ++n) {
+        vitis::ai::FaceDetectResult::BoundingBox box;
+        box.height = 0.1f + 0.3f * unit(rng);
+        box.width = box.height * result.height / result.width;
+        box.x = (1.0f - box.width) * unit(rng);
+        box.y = (1.0f - box.height) * unit(rng);
+        box.score = 0.5f + 0.5f * unit(rng);
+        result.rects.push_back(box);
+    }
+    return result;
+}
+
+// --backend=synthetic のときはFPGAを使わない模擬バックエンドを作る。
+// --preprocess=fused のときはDPUタスクを直接使うバックエンドを作る
+inline std::unique_ptr<FaceBackend>
+create_face_backend(const Options &options, const std::string &model_path) {
+    if (options.get("backend", "vitis") == "synthetic") {
+        int num_faces = options.get_int("synthetic-objects", 2);
+        return std::make_unique<
+            SyntheticBackend<vitis::ai::FaceDetectResult>>(
+            DENSEBOX_INPUT_WIDTH, DENSEBOX_INPUT_HEIGHT,
+            options.get_int("synthetic-batch", 1),
+            std::chrono::microseconds(
+                options.get_int("synthetic-base-us", 5000)),
+            std::chrono::microseconds(
+                options.get_int("synthetic-per-frame-us", 3000)),
+            [num_faces](const cv::Mat &image, std::mt19937 &rng) {
+                return synthetic_face_result(image, num_faces, rng);
+            });
+    }
+#ifdef WITH_VITIS_AI
+    // 前処理をまとめて行い、DPUの入力テンソルへ直接書き込む
+    if (options.get("preprocess", "library") == "fused") {
+        return std::make_unique<DpuTaskBackend<vitis::ai::FaceDetectResult>>(
+            model_path, [](vitis::ai::ConfigurableDpuTask &task,
+                           const std::vector<cv::Size> &sizes) {
+                auto results = vitis::ai::face_detect_post_process(
+                    task.getInputTensor(), task.getOutputTensor(),
+                    task.getConfig(),
+                    task.getConfig().dense_box_param().det_threshold());
+                for (std::size_t i = 0;
+                     i < std::min(results.size(), sizes.size()); ++i) {
+                    results[i].width = sizes[i].width;
+                    results[i].height = sizes[i].height;
+                }
+                return results;
+            });
+    }
+    return std::make_unique<
+        VitisBackend<vitis::ai::FaceDetect, vitis::ai::FaceDetectResult>>(
+        vitis::ai::FaceDetect::create(model_path));
+#else
+    throw std::runtime_error(
+        "built without Vitis AI Library, use --backend=synthetic");
+#endif
+}
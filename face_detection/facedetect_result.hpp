@@ -0,0 +1,105 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <boost/json.hpp>
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+
+#ifdef WITH_VITIS_AI
+#include <vitis/ai/facedetect.hpp>
+#else
+// Vitis AI Libraryが無い環境では同じ形の結果型を定義する
+namespace vitis {
+namespace ai {
+struct FaceDetectResult {
+    int width;
+    int height;
+    struct BoundingBox {
+        float x;
+        float y;
+        float width;
+        float height;
+        float score;
+    };
+    std::vector<BoundingBox> rects;
+};
+} // namespace ai
+} // namespace vitis
+#endif
+
+#include "binary_result.hpp"
+#include "protocol.hpp"
+
+#define DENSEBOX_INPUT_WIDTH 640
+#define DENSEBOX_INPUT_HEIGHT 360
+
+// 推論した画像の座標の結果を、sizeの画像の座標に直す。
+// 顔の位置は画像に対する割合なので、画像のサイズだけを変える
+inline void rescale_result(vitis::ai::FaceDetectResult &result,
+                           const cv::Size &size) {
+    result.width = size.width;
+    result.height = size.height;
+}
+
+inline std::string
+result_to_json_string(const vitis::ai::FaceDetectResult &result) {
+    boost::json::object result_json;
+    result_json["num"] = result.rects.size();
+    result_json["height"] = result.height;
+    result_json["width"] = result.width;
+    int num = 0;
+    for (const auto &r : result.rects) {
+        boost::json::object result_json_pos;
+        result_json_pos["x"] = static_cast<int>((r.x < 0 ? 0 : r.x) * result.width);
+        result_json_pos["y"] = static_cast<int>((r.y < 0 ? 0 : r.y) * result.height);
+        result_json_pos["size_col"] = static_cast<int>(r.width * result.width);
+        result_json_pos["size_row"] = static_cast<int>(r.height * result.height);
+        result_json[std::to_string(++num)] = std::move(result_json_pos);
+    }
+    std::string serialized_data = boost::json::serialize(result_json);
+    return serialized_data;
+}
+
+inline void result_to_binary(const vitis::ai::FaceDetectResult &result,
+                             std::string &out) {
+    BinaryResultHeader *header =
+        begin_binary_result(out, BINARY_RESULT_FACE, result.rects.size(), 0,
+                            result.rects.size() * sizeof(BinaryFaceRect));
+    header->width = result.width;
+    header->height = result.height;
+    auto *dst = reinterpret_cast<BinaryFaceRect *>(header + 1);
+    for (const auto &r : result.rects) {
+        dst->x = static_cast<int>((r.x < 0 ? 0 : r.x) * result.width);
+        dst->y = static_cast<int>((r.y < 0 ? 0 : r.y) * result.height);
+        dst->width = static_cast<int>(r.width * result.width);
+        dst->height = static_cast<int>(r.height * result.height);
+        dst->score = r.score;
+        ++dst;
+    }
+}
+
+inline std::string serialize_result(const vitis::ai::FaceDetectResult &result,
+                                    const SessionOptions &options) {
+    if (is_binary_result_format(options)) {
+        std::string out;
+        result_to_binary(result, out);
+        return out;
+    }
+    return result_to_json_string(result);
+}
@@ -0,0 +1,431 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#define BOOST_BIND_GLOBAL_PLACEHOLDERS
+
+#include <atomic>
+#include <boost/json.hpp>
+#include <boost/json/src.hpp>
+#include <iostream>
+#include <mutex>
+#include <opencv2/opencv.hpp>
+#include <thread>
+#include <variant>
+
+#include "batch_scheduler.hpp"
+#include "decode_pool.hpp"
+#include "facedetect_backend.hpp"
+#include "frame_pool.hpp"
+#include "openpose_backend.hpp"
+#include "options.hpp"
+#include "protocol.hpp"
+#include "queue_limit.hpp"
+#include "run_server.hpp"
+#include "server_settings.hpp"
+#include "stage_stats.hpp"
+#include "tagged_frame.hpp"
+#include "trace.hpp"
+#include "utilization_report.hpp"
+
+#define DEFAULT_PORT 54321
+#define DEFAULT_BATCH_WAIT_US 2000
+#define DEFAULT_REPORT_INTERVAL_S 10
+
+using ModelResult =
+    std::variant<vitis::ai::OpenPoseResult, vitis::ai::FaceDetectResult>;
+
+// 1フレームで実行した全てのモデルの結果。FrameRequestの順に並ぶ
+struct MultiResult {
+    FrameRequest request;
+    std::vector<ModelResult> results;
+};
+
+struct JobOwner;
+
+// 1フレーム分の処理。FrameRequestのモデルを1つずつスケジューラに渡し、
+// 全て終わったら接続へ返す。
+// 途中で捨てられたJobは、破棄されるときに接続へ知らせる
+struct Job {
+    ~Job();
+
+    // MultiPipeline::push()に渡したときに設定する
+    std::weak_ptr<JobOwner> owner;
+    // 接続の中で受信した順番
+    std::uint64_t index = 0;
+    FrameHeader header;
+    FrameRequest request;
+    // クライアントが送った画像のサイズ。結果はこのサイズの座標で返す
+    cv::Size size;
+    // モデルごとに前処理した画像
+    std::vector<cv::Mat> inputs;
+    std::size_t stage = 0;
+    std::vector<ModelResult> results;
+    FrameTimes times;
+    bool completed = false;
+};
+
+using JobPtr = std::shared_ptr<Job>;
+using Scheduler = BatchScheduler<JobPtr, JobPtr>;
+
+// モデルの種類(MODEL_POSE, MODEL_FACE)ごとの情報
+struct ModelInfo {
+    cv::Size input_size;
+    // 前処理をまとめて行うバックエンドのprepare()。空なら入力サイズに縮小する
+    std::function<cv::Mat(const cv::Mat &)> prepare;
+    // スケジューラでのモデルの番号。読み込んでいなければ-1
+    int index = -1;
+};
+
+StageReport stage_report;
+ModelInfo model_info[MODEL_FACE + 1];
+// スケジューラでのモデルの番号からモデルの種類を引く
+std::vector<std::uint8_t> model_kinds;
+// FrameRequestを送らない接続で実行するモデル
+FrameRequest default_request;
+
+std::vector<std::unique_ptr<PoseBackend>> pose_models;
+std::vector<std::unique_ptr<FaceBackend>> face_models;
+std::unique_ptr<Scheduler> scheduler;
+std::unique_ptr<DecodePool> decode_pool;
+
+// 接続ごとのスケジューラのストリームと、Jobの返し先
+struct JobOwner {
+    std::function<void(Tagged<MultiResult>)> emit;
+    std::function<void(const TaggedFrame &)> drop;
+    // スケジューラのインスタンスのスレッドが次の段を渡すのと、
+    // 接続のスレッドがclose()するのをmtxで排他する
+    std::mutex mtx;
+    // スケジューラのストリームはモデルごとに開く
+    std::vector<std::shared_ptr<Scheduler::Stream>> streams;
+    // trueならstreamsは閉じていて、Jobを接続に知らせない。
+    // Jobの破棄はmtxを持ったまま起きることがあるので、ロックを取らずに読む
+    std::atomic<bool> closed{false};
+};
+
+Job::~Job() {
+    if (completed) {
+        return;
+    }
+    auto data = owner.lock();
+    if (data && !data->closed) {
+        data->drop(TaggedFrame{header, cv::Mat(), times, index});
+    }
+}
+
+// 今の段のモデルのストリームにJobを渡す。接続を閉じた後なら、
+// Jobは知らせずに捨てる
+void submit_stage(JobOwner &data, JobPtr job) {
+    std::lock_guard<std::mutex> lock(data.mtx);
+    if (data.closed) {
+        job->completed = true;
+        return;
+    }
+    int index = model_info[job->request.models[job->stage]].index;
+    scheduler->submit(data.streams[index], std::move(job));
+}
+
+// 1つのモデルが終わったら次のモデルへ渡す
+void advance(JobPtr job) {
+    auto data = job->owner.lock();
+    if (!data) {
+        return;
+    }
+    if (++job->stage < job->request.count) {
+        submit_stage(*data, std::move(job));
+        return;
+    }
+    job->completed = true;
+    std::lock_guard<std::mutex> lock(data->mtx);
+    if (data->closed) {
+        return;
+    }
+    data->emit(Tagged<MultiResult>{
+        job->header, MultiResult{job->request, std::move(job->results)},
+        job->times, job->index});
+}
+
+cv::Mat preprocess(std::uint8_t model, cv::Mat image) {
+    const ModelInfo &info = model_info[model];
+    if (info.prepare) {
+        return info.prepare(image);
+    }
+    if (image.size() != info.input_size) {
+        cv::resize(image, image, info.input_size);
+    }
+    return image;
+}
+
+template <typename Backend>
+Scheduler::RunBatch run_model(Backend *backend) {
+    return [backend](const std::vector<JobPtr> &jobs) {
+        std::vector<cv::Mat> images;
+        images.reserve(jobs.size());
+        for (const auto &job : jobs) {
+            images.push_back(job->inputs[job->stage]);
+        }
+        auto start = StageClock::now();
+        auto results = backend->run(images);
+        auto end = StageClock::now();
+        // 結果が足りないJobは返さず、捨てられたものとして扱う
+        std::size_t count = std::min(jobs.size(), results.size());
+        for (std::size_t i = 0; i < count; ++i) {
+            if (!jobs[i]->size.empty()) {
+                rescale_result(results[i], jobs[i]->size);
+            }
+            jobs[i]->results.emplace_back(std::move(results[i]));
+            jobs[i]->times.lap(Stage::Queue, start);
+            jobs[i]->times.lap(Stage::Infer, end);
+        }
+        return std::vector<JobPtr>(jobs.begin(), jobs.begin() + count);
+    };
+}
+
+// FrameRequestのモデルが全て読み込まれているか確かめる
+bool valid_request(const FrameRequest &request) {
+    if (request.count > FRAME_REQUEST_MAX_MODELS) {
+        return false;
+    }
+    for (std::size_t i = 0; i < request.count; ++i) {
+        std::uint8_t model = request.models[i];
+        if (model > MODEL_FACE || model_info[model].index < 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// モデルが1つなら単独のサーバと同じ形式で返す。
+// 複数ならJSONはモデル名をキーとするオブジェクト、
+// バイナリは実行した順に結果を並べたものになる
+std::string serialize_results(const MultiResult &result,
+                              const SessionOptions &options) {
+    auto serialize = [&options](const auto &model_result) {
+        return serialize_result(model_result, options);
+    };
+    if (result.results.size() == 1) {
+        return std::visit(serialize, result.results[0]);
+    }
+    bool binary = is_binary_result_format(options);
+    std::string out = binary ? "" : "{";
+    for (std::size_t i = 0; i < result.results.size(); ++i) {
+        if (!binary) {
+            out += i == 0 ? "\"" : ",\"";
+            out += model_name(result.request.models[i]);
+            out += "\":";
+        }
+        out += std::visit(serialize, result.results[i]);
+    }
+    return binary ? out : out + "}";
+}
+
+// フレームごとにFrameRequestのモデルを順番に実行する接続の処理。
+// ThreadedServerとAsyncServerからModelPipelineと同じように呼ばれる
+class MultiPipeline {
+  public:
+    using Result = MultiResult;
+    using Frame = JobPtr;
+    using Emit = std::function<void(Tagged<Result>)>;
+    using Drop = std::function<void(const TaggedFrame &)>;
+
+    static constexpr std::uint16_t frame_headers =
+        FRAME_HEADER_REQUEST | FRAME_HEADER_SEQUENCE;
+
+    // 全ての接続で共有する設定
+    struct Context {
+        QueueLimit queue_limit;
+        // 読み込んだモデルの入力サイズの幅と高さそれぞれの最大。
+        // JPEGはこのサイズまで縮小してデコードし、生の画素もこのサイズで
+        // 送ってもらうので、どのモデルにも拡大した画像を渡さない
+        cv::Size frame_size;
+    };
+
+    MultiPipeline(Context &context, Emit emit, Drop drop)
+        : context_(context), owner_(std::make_shared<JobOwner>()) {
+        owner_->emit = std::move(emit);
+        owner_->drop = std::move(drop);
+        for (std::size_t i = 0; i < model_kinds.size(); ++i) {
+            auto stream = scheduler->open(advance, context_.queue_limit, i);
+            // 捨てたJobはロックの外で破棄させ、破棄されるときに知らせる
+            stream->set_drop([](JobPtr) {});
+            owner_->streams.push_back(std::move(stream));
+        }
+    }
+
+    cv::Size frame_size() const { return context_.frame_size; }
+
+    // フレームIDを付ける接続では、結果をモデルが終わった順に返す
+    void set_frame_ids() {
+        for (auto &stream : owner_->streams) {
+            stream->set_ordered(false);
+        }
+    }
+
+    bool receive(const TaggedFrame &tagged, const FrameRequest &request,
+                 FramePool &pool, const ReceivedFrame &received,
+                 Frame &frame) {
+        FrameRequest models = request.count == 0 ? default_request : request;
+        if (!valid_request(models)) {
+            return false;
+        }
+        frame = std::make_shared<Job>();
+        frame->index = tagged.index;
+        frame->header = tagged.header;
+        frame->request = models;
+        frame->times = tagged.times;
+        frame->size = pool.frame_size(received);
+        return true;
+    }
+
+    bool decodes(const Frame &) const { return true; }
+
+    // デコードと、実行するモデルごとの前処理はプールのスレッドで行う
+    cv::Mat decode(FramePool &pool, const ReceivedFrame &received,
+                   const Frame &job) {
+        cv::Mat image = pool.decode(received, cv::IMREAD_COLOR);
+        if (image.empty()) {
+            return image;
+        }
+        for (std::size_t i = 0; i < job->request.count; ++i) {
+            job->inputs.push_back(preprocess(job->request.models[i], image));
+        }
+        return job->inputs[0];
+    }
+
+    void push(Frame job, cv::Mat) {
+        job->times.lap(Stage::Decode);
+        job->owner = owner_;
+        submit_stage(*owner_, std::move(job));
+    }
+
+    std::string serialize(const Result &result,
+                          const SessionOptions &options) const {
+        return serialize_results(result, options);
+    }
+
+    // 未処理のJobは破棄する。先にclosedにするので、破棄したJobや
+    // 実行中のバッチから戻ったJobは接続に知らせない
+    void close() {
+        std::vector<std::shared_ptr<Scheduler::Stream>> streams;
+        {
+            std::lock_guard<std::mutex> lock(owner_->mtx);
+            owner_->closed = true;
+            streams = std::move(owner_->streams);
+        }
+        owner_.reset();
+        for (auto &stream : streams) {
+            scheduler->close(stream);
+        }
+    }
+
+    void print(std::ostream &) const {}
+
+  private:
+    Context &context_;
+    std::shared_ptr<JobOwner> owner_;
+};
+
+// 1種類のモデルのインスタンスを作り、スケジューラのモデルとして登録する
+template <typename Backend, typename Create>
+void load_model(const Options &options, std::uint8_t kind, Create create,
+                std::vector<std::unique_ptr<Backend>> &backends,
+                std::vector<Scheduler::Model> &models) {
+    std::string path = options.get(model_name(kind), "");
+    if (path.empty()) {
+        return;
+    }
+    Scheduler::Model model;
+    for (long i = 0; i < std::max(options.get_int("instances", 1), 1L); ++i) {
+        backends.push_back(create(options, path));
+        model.instances.push_back(run_model(backends.back().get()));
+    }
+    model.max_batch = backends[0]->input_batch();
+    model_info[kind].input_size =
+        cv::Size(backends[0]->input_width(), backends[0]->input_height());
+    if (backends[0]->fuses_resize()) {
+        Backend *backend = backends[0].get();
+        model_info[kind].prepare = [backend](const cv::Mat &image) {
+            return backend->prepare(image);
+        };
+    }
+    model_info[kind].index = static_cast<int>(models.size());
+    model_kinds.push_back(kind);
+    models.push_back(std::move(model));
+}
+
+int main(int argc, char *argv[]) {
+    Options options(argc, argv);
+    int port = DEFAULT_PORT;
+    if (options.positional_size() > 0) {
+        port = std::stoi(options.positional(0));
+    }
+    auto batch_wait = std::chrono::microseconds(
+        options.get_int("batch-wait-us", DEFAULT_BATCH_WAIT_US));
+    ServerSettings settings = server_settings_from_options(options, port);
+    trace_from_options(options);
+    // 以下の2つは呼び出したスレッドでシグナルを止め、以降に作る全ての
+    // スレッドがそれを引き継ぐ。SIGINTとSIGTERMを止めてから報告のスレッドを
+    // 作るので、どちらも他のスレッドを作る前にこの順で呼ぶ
+    write_trace_on_signal();
+    report_on_signal(SIGUSR1, [] { stage_report.print(std::cout); });
+    decode_pool = std::make_unique<DecodePool>(
+        options.get_int("decode-threads", std::thread::hardware_concurrency()));
+
+    std::vector<Scheduler::Model> models;
+    load_model(options, MODEL_POSE, create_pose_backend, pose_models, models);
+    load_model(options, MODEL_FACE, create_face_backend, face_models, models);
+    if (models.empty()) {
+        std::cerr << "Specify at least one model with --pose=<model> or "
+                     "--face=<model>"
+                  << std::endl;
+        return 1;
+    }
+    // 既定では読み込んだ全てのモデルを順番に実行する
+    std::string default_models;
+    for (std::uint8_t model : model_kinds) {
+        default_models += default_models.empty() ? "" : ",";
+        default_models += model_name(model);
+    }
+    default_models = options.get("default-models", default_models);
+    default_request = parse_frame_request(default_models);
+    if (default_request.count == 0 || !valid_request(default_request)) {
+        std::cerr << "Default models are not loaded" << std::endl;
+        return 1;
+    }
+    scheduler = std::make_unique<Scheduler>(std::move(models), batch_wait);
+    long report_interval =
+        options.get_int("report-interval", DEFAULT_REPORT_INTERVAL_S);
+    if (report_interval > 0) {
+        report_utilization(
+            *scheduler, std::chrono::seconds(report_interval),
+            [](const std::vector<Scheduler::InstanceStats> &) {
+                stage_report.print(std::cout);
+            },
+            [](std::size_t model) { return model_name(model_kinds[model]); });
+    }
+
+    MultiPipeline::Context context{settings.queue_limit, cv::Size()};
+    for (std::uint8_t model : model_kinds) {
+        cv::Size input_size = model_info[model].input_size;
+        context.frame_size.width =
+            std::max(context.frame_size.width, input_size.width);
+        context.frame_size.height =
+            std::max(context.frame_size.height, input_size.height);
+    }
+    run_server<MultiPipeline>(context, *decode_pool, stage_report, settings,
+                              "multi-model server (" + default_models + ")");
+    return 0;
+}
@@ -14,25 +14,37 @@
  * limitations under the License.
  */
 
+#include <array>
 #include <boost/asio.hpp>
 #include <boost/json.hpp>
 #include <boost/json/src.hpp>
-#include <condition_variable>
 #include <iostream>
-#include <mutex>
+#include <map>
 #include <opencv2/opencv.hpp>
-#include <queue>
 #include <thread>
 #include <vector>
 
+#include "binary_result.hpp"
+#include "delta_result.hpp"
+#include "frame_codec.hpp"
+#include "options.hpp"
+#include "protocol.hpp"
+#include "shared_frame_ring.hpp"
+#include "spsc_ring.hpp"
+#include "trace.hpp"
+
 #define CV_TIMEOUT 5000
 #define SLEEP_SEND_FRAME 300
 #define JPEG_QUALITY 80
+#define QUEUE_CAPACITY 64
+// 生の画素をPNGで圧縮して大きくなった場合にも収まるよう余裕を持たせる
+#define SHARED_SLOT_SIZE (368 * 368 * 3 + 65536)
 
 using namespace boost::asio;
 
 struct FrameInfo {
-    FrameInfo(cv::Mat img, ip::tcp::socket sock, std::string video_file)
+    FrameInfo(cv::Mat img, generic::stream_protocol::socket sock,
+              std::string video_file)
         : socket(std::move(sock)) {
         cap.open(video_file);
         if (!cap.isOpened()) {
@@ -48,136 +60,264 @@ struct FrameInfo {
         }
     }
 
-    std::queue<std::vector<uchar>> image_in;
-    std::queue<boost::json::value> result;
-    std::queue<cv::Mat> image_in_;
-    std::mutex mtx_in;
-    std::mutex mtx_in_;
-    std::mutex mtx_result;
-    std::condition_variable cv_in;
-    std::condition_variable cv_in_;
-    std::condition_variable cv_result;
+    SpscRing<std::vector<uchar>> image_in{QUEUE_CAPACITY};
+    SpscRing<std::string> result{QUEUE_CAPACITY};
+    SpscRing<cv::Mat> image_in_{QUEUE_CAPACITY};
     cv::VideoCapture cap;
-    ip::tcp::socket socket;
+    generic::stream_protocol::socket socket;
+    SessionOptions options;
+    // 同じホストのサーバと共有メモリで受け渡すときだけ使う
+    std::shared_ptr<SharedFrameRing> shared_ring;
+    std::uint32_t next_slot = 0;
     size_t frame_count;
+    // FRAME_HEADER_SEQUENCEの接続で、結果と対応を取るために送ったフレームを
+    // seqごとに保持する
+    std::map<std::uint64_t, cv::Mat> sent_frames;
+    std::uint64_t next_image = 0;
 };
 
+std::uint64_t now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
 void send_frame(FrameInfo *data) {
+    trace_recorder().name_thread("send");
     size_t recv_count = 0;
     while (++recv_count <= data->frame_count) {
         std::this_thread::sleep_for(
             std::chrono::milliseconds(SLEEP_SEND_FRAME));
-        std::unique_lock<std::mutex> lock_in(data->mtx_in);
-        bool available =
-            data->cv_in.wait_for(lock_in, std::chrono::milliseconds(CV_TIMEOUT),
-                                 [&data] { return !data->image_in.empty(); });
-        if (!available) {
+        std::vector<uchar> frame;
+        if (!data->image_in.pop_for(frame,
+                                    std::chrono::milliseconds(CV_TIMEOUT))) {
             std::cout << "Image data did not reach the queue and timed out"
                       << std::endl;
             break;
         }
-        std::vector<uchar> frame = data->image_in.front();
-        data->image_in.pop();
-        lock_in.unlock();
-        data->cv_in.notify_one();
-        std::size_t frame_size = frame.size();
-        boost::asio::write(data->socket, boost::asio::buffer(
-                                             &frame_size, sizeof(std::size_t)));
-        boost::asio::write(data->socket,
-                           boost::asio::buffer(frame, frame.size()));
+        // フレームIDを付ける場合は、送った順番と時刻をフレームの先頭に付ける
+        FrameHeader header;
+        header.seq = recv_count - 1;
+        header.timestamp_us = now_us();
+        std::size_t header_size =
+            has_frame_header(data->options, FRAME_HEADER_SEQUENCE)
+                ? sizeof(header)
+                : 0;
+        std::size_t frame_size = header_size + frame.size();
+        std::array<boost::asio::const_buffer, 3> buffers = {
+            boost::asio::buffer(&frame_size, sizeof(std::size_t)),
+            boost::asio::buffer(&header, header_size),
+            boost::asio::buffer(frame, frame.size())};
+        TraceScope scope("send", header.seq);
+        boost::asio::write(data->socket, buffers);
     }
+    data->image_in.close();
 }
 
 void recv_result(FrameInfo *data) {
+    trace_recorder().name_thread("recv");
     size_t recv_count = 0;
     while (++recv_count <= data->frame_count) {
         size_t result_size;
         boost::asio::read(data->socket, boost::asio::buffer(
                                             &result_size, sizeof(std::size_t)));
+        // 結果の長さが届いてから読み終えるまで
+        TraceScope scope("recv", recv_count - 1);
 
         std::string result_data(result_size, '\0');
         boost::asio::read(data->socket,
                           boost::asio::buffer(&result_data[0], result_size));
-        boost::json::value result_json = boost::json::parse(result_data);
-        std::unique_lock<std::mutex> lock_result(data->mtx_result);
-        data->result.push(result_json);
-        lock_result.unlock();
-        data->cv_result.notify_one();
+        if (!data->result.push(std::move(result_data))) {
+            break;
+        }
+    }
+}
+
+const std::vector<std::vector<int>> LIMB_SEQ = {
+    {0, 1}, {1, 2}, {2, 3},  {3, 4},  {1, 5},   {5, 6},  {6, 7},
+    {1, 8}, {8, 9}, {9, 10}, {1, 11}, {11, 12}, {12, 13}};
+
+void draw_json_result(cv::Mat &frame, boost::json::value result_json) {
+    auto result_poses = result_json.at("poses");
+    for (const auto &outer_pair : result_poses.as_object()) {
+        const auto &outer_value = outer_pair.value();
+        cv::Point2f pose_points[14];
+        int i = 0;
+        int type = 0;
+        for (const auto &middle_pair : outer_value.as_object()) {
+            const auto &middle_value = middle_pair.value();
+            double x = middle_value.at("x").as_double();
+            double y = middle_value.at("y").as_double();
+            type = middle_value.at("type").as_int64();
+            cv::Point2f point2f(x, y);
+            pose_points[i++] = point2f;
+            if (type == 1 && point2f != cv::Point2f(0, 0)) {
+                cv::circle(frame, point2f, 5, cv::Scalar(0, 255, 0), -1);
+            }
+        }
+        for (size_t i = 0; i < LIMB_SEQ.size(); ++i) {
+            cv::Point2f a = pose_points[LIMB_SEQ[i][0]];
+            cv::Point2f b = pose_points[LIMB_SEQ[i][1]];
+            if (type == 1 && a != cv::Point2f(0, 0) &&
+                b != cv::Point2f(0, 0)) {
+                cv::line(frame, a, b, cv::Scalar(255, 0, 0), 3, 4);
+            }
+        }
+    }
+}
+
+// 受信バッファを直接参照して描画する(メモリ確保なし)
+void draw_binary_result(cv::Mat &frame, const std::string &result_data) {
+    BinaryResultView view;
+    if (!view.parse(result_data.data(), result_data.size()) ||
+        view.header().kind != BINARY_RESULT_POSE) {
+        std::cout << "Invalid binary result" << std::endl;
+        return;
+    }
+    for (std::size_t n = 0; n < view.header().count; ++n) {
+        const BinaryPosePoint *points = view.pose(n);
+        for (std::size_t i = 0; i < view.header().points; ++i) {
+            if (points[i].type == 1) {
+                cv::circle(frame, cv::Point2f(points[i].x, points[i].y), 5,
+                           cv::Scalar(0, 255, 0), -1);
+            }
+        }
+        for (const auto &limb : LIMB_SEQ) {
+            if (static_cast<std::size_t>(limb[1]) >= view.header().points) {
+                continue;
+            }
+            const BinaryPosePoint &a = points[limb[0]];
+            const BinaryPosePoint &b = points[limb[1]];
+            if (a.type == 1 && b.type == 1) {
+                cv::line(frame, cv::Point2f(a.x, a.y), cv::Point2f(b.x, b.y),
+                         cv::Scalar(255, 0, 0), 3, 4);
+            }
+        }
     }
 }
 
+// 結果のseqと同じフレームを探す。結果は送った順番に届くとは限らないので、
+// 届いていない結果のフレームはキューの容量分だけ残しておく
+bool find_sent_frame(FrameInfo *data, std::uint64_t seq, cv::Mat &frame) {
+    while (data->next_image <= seq) {
+        cv::Mat image;
+        if (!data->image_in_.pop_for(image,
+                                     std::chrono::milliseconds(CV_TIMEOUT))) {
+            return false;
+        }
+        data->sent_frames.emplace(data->next_image++, image);
+    }
+    while (!data->sent_frames.empty() &&
+           data->sent_frames.begin()->first + QUEUE_CAPACITY < seq) {
+        data->sent_frames.erase(data->sent_frames.begin());
+    }
+    auto it = data->sent_frames.find(seq);
+    if (it == data->sent_frames.end()) {
+        return false;
+    }
+    frame = it->second;
+    data->sent_frames.erase(it);
+    return true;
+}
+
 void show_result(FrameInfo *data) {
+    trace_recorder().name_thread("display");
+    bool frame_ids = has_frame_header(data->options, FRAME_HEADER_SEQUENCE);
     size_t recv_count = 0;
+    // 差分形式の結果は受け取った順にバイナリ形式へ戻す
+    DeltaDecoder delta;
+    std::string delta_result;
     while (++recv_count <= data->frame_count) {
-        std::unique_lock<std::mutex> lock_result(data->mtx_result);
-        bool available = data->cv_result.wait_for(
-            lock_result, std::chrono::milliseconds(CV_TIMEOUT),
-            [&data] { return !data->result.empty(); });
-        if (!available) {
+        std::string result_data;
+        if (!data->result.pop_for(result_data,
+                                  std::chrono::milliseconds(CV_TIMEOUT))) {
             std::cout << "Result data did not reach the queue and timed out"
                       << std::endl;
             break;
         }
 
-        auto result_json = data->result.front();
-        data->result.pop();
-        lock_result.unlock();
-        data->cv_result.notify_one();
-
-        std::unique_lock<std::mutex> lock_in_(data->mtx_in_);
-        available = data->cv_result.wait_for(
-            lock_in_, std::chrono::milliseconds(CV_TIMEOUT),
-            [&data] { return !data->image_in_.empty(); });
-        if (!available) {
+        FrameHeader header;
+        if (frame_ids) {
+            if (result_data.size() < sizeof(header)) {
+                std::cout << "Invalid frame header" << std::endl;
+                break;
+            }
+            std::memcpy(&header, result_data.data(), sizeof(header));
+            result_data.erase(0, sizeof(header));
+        }
+        cv::Mat frame;
+        if (header.flags & FRAME_FLAG_DROPPED) {
+            std::cout << "Frame " << header.seq << " was dropped by the server"
+                      << std::endl;
+            find_sent_frame(data, header.seq, frame);
+            continue;
+        }
+        if (frame_ids ? !find_sent_frame(data, header.seq, frame)
+                      : !data->image_in_.pop_for(
+                            frame, std::chrono::milliseconds(CV_TIMEOUT))) {
             std::cout
                 << "Image for Result data did not reach the queue and timed out"
                 << std::endl;
             break;
         }
-        cv::Mat frame = data->image_in_.front();
-        data->image_in_.pop();
-        lock_in_.unlock();
-        data->cv_in_.notify_one();
-        std::vector<std::vector<int>> limb_seq = {
-            {0, 1}, {1, 2}, {2, 3},  {3, 4},  {1, 5},   {5, 6},  {6, 7},
-            {1, 8}, {8, 9}, {9, 10}, {1, 11}, {11, 12}, {12, 13}};
-        auto result_poses = result_json.at("poses");
-        for (const auto &outer_pair : result_poses.as_object()) {
-            const auto &outer_value = outer_pair.value();
-            cv::Point2f pose_points[14];
-            int i = 0;
-            int type = 0;
-            for (const auto &middle_pair : outer_value.as_object()) {
-                const auto &middle_value = middle_pair.value();
-                double x = middle_value.at("x").as_double();
-                double y = middle_value.at("y").as_double();
-                type = middle_value.at("type").as_int64();
-                cv::Point2f point2f(x, y);
-                pose_points[i++] = point2f;
-                if (type == 1 && point2f != cv::Point2f(0, 0)) {
-                    cv::circle(frame, point2f, 5, cv::Scalar(0, 255, 0), -1);
-                }
-            }
-            for (size_t i = 0; i < limb_seq.size(); ++i) {
-                cv::Point2f a = pose_points[limb_seq[i][0]];
-                cv::Point2f b = pose_points[limb_seq[i][1]];
-                if (type == 1 && a != cv::Point2f(0, 0) &&
-                    b != cv::Point2f(0, 0)) {
-                    cv::line(frame, a, b, cv::Scalar(255, 0, 0), 3, 4);
-                }
+
+        auto display_start = TraceRecorder::Clock::now();
+        if (data->options.result_format == RESULT_FORMAT_DELTA) {
+            if (!delta.decode(result_data.data(), result_data.size(),
+                              delta_result)) {
+                std::cout << "Invalid delta result" << std::endl;
+                continue;
             }
+            result_data.swap(delta_result);
+        }
+        if (is_binary_result_format(data->options)) {
+            draw_binary_result(frame, result_data);
+        } else {
+            draw_json_result(frame, boost::json::parse(result_data));
+        }
+        if (frame_ids) {
+            double latency_ms = (now_us() - header.timestamp_us) / 1000.0;
+            cv::putText(frame, cv::format("%.1f ms", latency_ms),
+                        cv::Point(10, 30), cv::FONT_HERSHEY_SIMPLEX, 1.0,
+                        cv::Scalar(0, 0, 255), 2);
         }
         cv::imshow("result", frame);
         cv::waitKey(1);
+        trace_recorder().record("display", display_start,
+                                TraceRecorder::Clock::now(),
+                                frame_ids ? header.seq : recv_count - 1);
     }
+    data->result.close();
+    data->image_in_.close();
     cv::destroyAllWindows();
 }
 
+// フレームを共有メモリのスロットに書き込み、代わりに送る記述子に置き換える
+bool to_shared_frame(FrameInfo *data, std::vector<uchar> &buff) {
+    SharedFrameRing &ring = *data->shared_ring;
+    std::uint32_t slot = data->next_slot;
+    data->next_slot = (slot + 1) % ring.slot_count();
+    if (buff.size() > ring.slot_size()) {
+        std::cout << "Frame does not fit in a shared slot" << std::endl;
+        return false;
+    }
+    if (!ring.acquire(slot, std::chrono::milliseconds(CV_TIMEOUT))) {
+        std::cout << "Shared slot was not released and timed out"
+                  << std::endl;
+        return false;
+    }
+    std::memcpy(ring.slot_data(slot), buff.data(), buff.size());
+    SharedFrameDescriptor descriptor = ring.publish(slot, buff.size());
+    const uchar *bytes = reinterpret_cast<const uchar *>(&descriptor);
+    buff.assign(bytes, bytes + sizeof(descriptor));
+    return true;
+}
+
 void read_image(FrameInfo *data) {
-    std::vector<int> param = std::vector<int>(2);
-    param[0] = cv::IMWRITE_JPEG_QUALITY;
-    param[1] = JPEG_QUALITY;
-    while (true) {
+    FrameEncoder encoder(data->options, JPEG_QUALITY);
+    trace_recorder().name_thread("read");
+    for (std::uint64_t count = 0;; ++count) {
+        auto read_start = TraceRecorder::Clock::now();
         cv::Mat frame;
         data->cap >> frame;
         if (frame.empty()) {
@@ -187,34 +327,99 @@ void read_image(FrameInfo *data) {
         if (frame.cols != 368 || frame.rows != 368) {
             cv::resize(frame, frame, cv::Size(368, 368));
         }
+        auto encode_start = TraceRecorder::Clock::now();
+        trace_recorder().record("read", read_start, encode_start, count);
         std::vector<uchar> buff;
-        imencode(".jpg", frame, buff, param);
-        std::unique_lock<std::mutex> lock_in(data->mtx_in);
-        data->image_in.push(buff);
-        lock_in.unlock();
-        data->cv_in.notify_one();
-
-        std::unique_lock<std::mutex> lock_in_(data->mtx_in_);
-        data->image_in_.push(frame);
-        lock_in_.unlock();
-        data->cv_in_.notify_one();
+        encoder.encode(frame, buff);
+        trace_recorder().record("encode", encode_start,
+                                TraceRecorder::Clock::now(), count);
+        if (data->shared_ring && !to_shared_frame(data, buff)) {
+            data->cap.release();
+            break;
+        }
+        // 送信側か表示側が終了していたら読み込みをやめる
+        if (!data->image_in.push(std::move(buff)) ||
+            !data->image_in_.push(frame)) {
+            data->cap.release();
+            break;
+        }
     }
 }
 
 int main(int argc, char *argv[]) {
-    char *server_ip = argv[1];
-    int server_port = std::stoi(argv[2]);
-    std::string video_file = argv[3];
+    Options options(argc, argv);
+    trace_from_options(options);
+    std::string server_ip = options.positional(0);
+    int server_port = std::stoi(options.positional(1));
+    std::string video_file = options.positional(2);
 
     boost::asio::io_service io_service;
-    ip::tcp::resolver resolver(io_service);
-    ip::tcp::resolver::query query(server_ip, std::to_string(server_port));
-    ip::tcp::resolver::iterator endpoint_iterator = resolver.resolve(query);
-    ip::tcp::socket socket(io_service);
-    boost::asio::connect(socket, endpoint_iterator);
-    socket.set_option(ip::tcp::no_delay(true));
+    generic::stream_protocol::socket socket(io_service);
+    std::shared_ptr<SharedFrameRing> shared_ring;
+    if (options.has("local-socket")) {
+        // 同じホストのサーバとは、フレームを共有メモリで受け渡す
+        local::stream_protocol::socket local_socket(io_service);
+        local_socket.connect(local::stream_protocol::endpoint(
+            options.get("local-socket", "")));
+        shared_ring =
+            SharedFrameRing::create(SHARED_FRAME_SLOTS, SHARED_SLOT_SIZE);
+        send_fd(local_socket.native_handle(), shared_ring->fd());
+        socket = generic::stream_protocol::socket(std::move(local_socket));
+    } else {
+        ip::tcp::resolver resolver(io_service);
+        ip::tcp::resolver::query query(server_ip,
+                                       std::to_string(server_port));
+        ip::tcp::resolver::iterator endpoint_iterator =
+            resolver.resolve(query);
+        ip::tcp::socket tcp_socket(io_service);
+        boost::asio::connect(tcp_socket, endpoint_iterator);
+        tcp_socket.set_option(ip::tcp::no_delay(true));
+        socket = generic::stream_protocol::socket(std::move(tcp_socket));
+    }
+
+    SessionOptions session_options;
+    std::string result_format = options.get("result-format", "json");
+    if (result_format == "binary") {
+        session_options.result_format = RESULT_FORMAT_BINARY;
+    } else if (result_format == "delta") {
+        session_options.result_format = RESULT_FORMAT_DELTA;
+    }
+    std::string frame_format = options.get("frame-format", "jpeg");
+    if (frame_format == "bgr") {
+        session_options.frame_format = FRAME_FORMAT_BGR;
+    } else if (frame_format == "nv12") {
+        session_options.frame_format = FRAME_FORMAT_NV12;
+    }
+    std::string frame_compression = options.get("frame-compression", "none");
+    if (frame_compression == "png") {
+        session_options.frame_compression = FRAME_COMPRESSION_PNG;
+    }
+    // ネゴシエーションに対応していない古いサーバは制御メッセージを
+    // 受け付けないので、既定以外の形式か--frame-idsを指定したときだけ送る。
+    // フレームIDの無い接続では結果を送った順に対応させるので、
+    // サーバが結果を捨てないこと(--overflow=block)が前提になる
+    if (result_format != "json" || frame_format != "jpeg" ||
+        frame_compression != "none" || options.has("frame-ids")) {
+        // 結果はseqで送ったフレームと対応を取る。サーバがキューのポリシーで
+        // 結果を返さずに捨てても、表示するフレームと結果がずれない
+        session_options.frame_header = FRAME_HEADER_SEQUENCE;
+        SessionOptions requested = session_options;
+        session_options = negotiate_session_options(socket, requested);
+        if (is_raw_frame_format(requested) &&
+            !is_raw_frame_format(session_options)) {
+            std::cout << "Server does not accept raw frames, using JPEG"
+                      << std::endl;
+        }
+        if (requested.frame_header != session_options.frame_header) {
+            std::cout << "Server does not accept frame IDs, pairing results "
+                         "in order"
+                      << std::endl;
+        }
+    }
 
     FrameInfo *data = new FrameInfo(cv::Mat(), std::move(socket), video_file);
+    data->options = session_options;
+    data->shared_ring = shared_ring;
 
     std::thread read_image_thread(read_image, data);
     std::thread send_frame_thread(send_frame, data);
@@ -225,6 +430,7 @@ int main(int argc, char *argv[]) {
     send_frame_thread.join();
     recv_result_thread.join();
     show_result_thread.join();
+    trace_recorder().write();
     std::cout << "All threads joined" << std::endl;
     return 0;
 }
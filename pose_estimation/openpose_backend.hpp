@@ -0,0 +1,111 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <memory>
+#include <opencv2/opencv.hpp>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "dpu_task_backend.hpp"
+#include "inference_backend.hpp"
+#include "openpose_result.hpp"
+#include "options.hpp"
+
+#ifdef WITH_VITIS_AI
+#include <vitis/ai/nnpp/openpose.hpp>
+#endif
+
+using PoseBackend = InferenceBackend<vitis::ai::OpenPoseResult>;
+
+// 立ち姿勢の部位座標(人物の外接矩形に対する比率)をずらして人物を配置する
+inline vitis::ai::OpenPoseResult
+synthetic_pose_result(const cv::Mat &image, int num_persons,
+                      std::mt19937 &rng) {
+    static const float skeleton[OPENPOSE_NUM_POINTS][2] = {
+        {0.50f, 0.05f}, {0.50f, 0.18f}, {0.35f, 0.20f}, {0.28f, 0.38f},
+        {0.25f, 0.55f}, {0.65f, 0.20f}, {0.72f, 0.38f}, {0.75f, 0.55f},
+        {0.42f, 0.55f}, {0.42f, 0.75f}, {0.42f, 0.95f}, {0.58f, 0.55f},
+        {0.58f, 0.75f}, {0.58f, 0.95f}};
+    vitis::ai::OpenPoseResult result;
+    result.width = image.empty() ? OPENPOSE_INPUT_WIDTH : image.cols;
+    result.height = image.empty() ? OPENPOSE_INPUT_HEIGHT : image.rows;
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    for (int n = 0; n < num_persons; ++n) {
+        float box_h = result.height * (0.4f + 0.5f * unit(rng));
+        float box_w = box_h * 0.5f;
+        float left = (result.width - box_w) * unit(rng);
+        float top = (result.height - box_h) * unit(rng);
+        std::vector<vitis::ai::OpenPoseResult::PosePoint> pose(
+            OPENPOSE_NUM_POINTS);
+        for (int i = 0; i < OPENPOSE_NUM_POINTS; ++i) {
+            // 一部の部位は検出できなかったものとして扱う
+            if (unit(rng) < 0.1f) {
+                continue;
+            }
+            pose[i].type = 1;
+            pose[i].point = cv::Point2f(left + skeleton[i][0] * box_w,
+                                        top + skeleton[i][1] * box_h);
+        }
+        result.poses.push_back(std::move(pose));
+    }
+    return result;
+}
+
+// --backend=synthetic のときはFPGAを使わない模擬バックエンドを作る。
+// --preprocess=fused のときはDPUタスクを直接使うバックエンドを作る
+inline std::unique_ptr<PoseBackend>
+create_pose_backend(const Options &options, const std::string &model_path) {
+    if (options.get("backend", "vitis") == "synthetic") {
+        int num_persons = options.get_int("synthetic-objects", 2);
+        return std::make_unique<SyntheticBackend<vitis::ai::OpenPoseResult>>(
+            OPENPOSE_INPUT_WIDTH, OPENPOSE_INPUT_HEIGHT,
+            options.get_int("synthetic-batch", 1),
+            std::chrono::microseconds(
+                options.get_int("synthetic-base-us", 20000)),
+            std::chrono::microseconds(
+                options.get_int("synthetic-per-frame-us", 10000)),
+            [num_persons](const cv::Mat &image, std::mt19937 &rng) {
+                return synthetic_pose_result(image, num_persons, rng);
+            });
+    }
+#ifdef WITH_VITIS_AI
+    // 前処理をまとめて行い、DPUの入力テンソルへ直接書き込む
+    if (options.get("preprocess", "library") == "fused") {
+        return std::make_unique<DpuTaskBackend<vitis::ai::OpenPoseResult>>(
+            model_path, [](vitis::ai::ConfigurableDpuTask &task,
+                           const std::vector<cv::Size> &sizes) {
+                std::vector<int> ws, hs;
+                for (const auto &size : sizes) {
+                    ws.push_back(size.width);
+                    hs.push_back(size.height);
+                }
+                return vitis::ai::open_pose_post_process(
+                    task.getInputTensor(), task.getOutputTensor(),
+                    task.getConfig(), ws, hs);
+            });
+    }
+    return std::make_unique<
+        VitisBackend<vitis::ai::OpenPose, vitis::ai::OpenPoseResult>>(
+        vitis::ai::OpenPose::create(model_path));
+#else
+    throw std::runtime_error(
+        "built without Vitis AI Library, use --backend=synthetic");
+#endif
+}
@@ -0,0 +1,125 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <boost/json.hpp>
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+
+#ifdef WITH_VITIS_AI
+#include <vitis/ai/openpose.hpp>
+#else
+// Vitis AI Libraryが無い環境では同じ形の結果型を定義する
+namespace vitis {
+namespace ai {
+struct OpenPoseResult {
+    int width;
+    int height;
+    struct PosePoint {
+        int type = 0;
+        cv::Point2f point;
+    };
+    std::vector<std::vector<PosePoint>> poses;
+};
+} // namespace ai
+} // namespace vitis
+#endif
+
+#include "binary_result.hpp"
+#include "protocol.hpp"
+
+#define OPENPOSE_INPUT_WIDTH 368
+#define OPENPOSE_INPUT_HEIGHT 368
+#define OPENPOSE_NUM_POINTS 14
+
+// 推論した画像の座標の結果を、sizeの画像の座標に直す
+inline void rescale_result(vitis::ai::OpenPoseResult &result,
+                           const cv::Size &size) {
+    if (result.width <= 0 || result.height <= 0) {
+        return;
+    }
+    float sx = static_cast<float>(size.width) / result.width;
+    float sy = static_cast<float>(size.height) / result.height;
+    for (auto &pose : result.poses) {
+        for (auto &point : pose) {
+            point.point.x *= sx;
+            point.point.y *= sy;
+        }
+    }
+    result.width = size.width;
+    result.height = size.height;
+}
+
+inline std::string
+result_to_json_string(const vitis::ai::OpenPoseResult &result) {
+    boost::json::object result_json;
+    boost::json::object poses;
+    int num = 0;
+    result_json["height"] = result.height;
+    result_json["width"] = result.width;
+    result_json["num"] = result.poses.size();
+    for (const auto &pose : result.poses) {
+        boost::json::object pose_point_json;
+        int pose_num = 0;
+        for (const auto &point : pose) {
+            boost::json::value point_json = {{"type", point.type},
+                                             {"x", point.point.x},
+                                             {"y", point.point.y}};
+            pose_point_json[std::to_string(pose_num++)] = std::move(point_json);
+        }
+        poses[std::to_string(++num)] = std::move(pose_point_json);
+    }
+    result_json["poses"] = std::move(poses);
+    std::string serialized_data = boost::json::serialize(result_json);
+    return serialized_data;
+}
+
+// 人物ごとの部位数は揃え、足りない部位はtype = 0で埋める
+inline void result_to_binary(const vitis::ai::OpenPoseResult &result,
+                             std::string &out) {
+    std::size_t points = 0;
+    for (const auto &pose : result.poses) {
+        points = std::max(points, pose.size());
+    }
+    BinaryResultHeader *header = begin_binary_result(
+        out, BINARY_RESULT_POSE, result.poses.size(), points,
+        result.poses.size() * points * sizeof(BinaryPosePoint));
+    header->width = result.width;
+    header->height = result.height;
+    auto *dst = reinterpret_cast<BinaryPosePoint *>(header + 1);
+    for (const auto &pose : result.poses) {
+        for (std::size_t i = 0; i < points; ++i, ++dst) {
+            if (i < pose.size()) {
+                *dst = {pose[i].point.x, pose[i].point.y, pose[i].type};
+            } else {
+                *dst = {0.0f, 0.0f, 0};
+            }
+        }
+    }
+}
+
+inline std::string serialize_result(const vitis::ai::OpenPoseResult &result,
+                                    const SessionOptions &options) {
+    if (is_binary_result_format(options)) {
+        std::string out;
+        result_to_binary(result, out);
+        return out;
+    }
+    return result_to_json_string(result);
+}
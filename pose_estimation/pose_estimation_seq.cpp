@@ -14,72 +14,72 @@
  * limitations under the License.
  */
 
-#include <condition_variable>
-#include <filesystem>
+#include <boost/json/src.hpp>
 #include <iostream>
-#include <mutex>
 #include <opencv2/opencv.hpp>
-#include <queue>
 #include <thread>
 #include <vector>
-#include <vitis/ai/openpose.hpp>
+
+#include "openpose_backend.hpp"
+#include "image_loader.hpp"
+#include "options.hpp"
+#include "result_sink.hpp"
+#include "spsc_ring.hpp"
+#include "trace.hpp"
+
+#define QUEUE_CAPACITY 16
 
 struct FrameInfo {
-    FrameInfo(cv::Mat img)
-        : image_in(std::queue<cv::Mat>()),
-          result(std::queue<vitis::ai::OpenPoseResult>()) {}
+    FrameInfo(cv::Mat img) : image_in(QUEUE_CAPACITY), result(QUEUE_CAPACITY) {}
 
-    std::queue<cv::Mat> image_in;
-    std::queue<vitis::ai::OpenPoseResult> result;
+    SpscRing<cv::Mat> image_in;
+    // 推論できなかった画像を飛ばすので、file_namesの何番目かを付けて渡す
+    SpscRing<std::pair<std::size_t, vitis::ai::OpenPoseResult>> result;
     std::vector<std::string> file_names;
-    std::mutex mtx_in;
-    std::mutex mtx_result;
-    std::condition_variable cv_in;
-    std::condition_variable cv_result;
-    bool stop;
-    unsigned long file_count;
 };
 
-std::unique_ptr<vitis::ai::OpenPose> model;
+std::unique_ptr<PoseBackend> model;
 
 void pose_estimate(FrameInfo *data) {
-    while (!data->stop) {
-        std::unique_lock<std::mutex> lock_in(data->mtx_in);
-        data->cv_in.wait_for(lock_in, std::chrono::milliseconds(500),
-                             [&data] { return !data->image_in.empty(); });
-        if (data->image_in.empty() && !data->stop) {
-            continue;
-        }
-        cv::Mat image = data->image_in.front();
-        data->image_in.pop();
-        lock_in.unlock();
+    trace_recorder().name_thread("infer");
+    std::size_t index = 0;
+    cv::Mat image;
+    while (data->image_in.pop(image)) {
+        std::size_t i = index++;
         if (image.empty()) {
             continue;
         }
+        TraceScope scope("infer", i);
+        data->result.push({i, model->run(image)});
+    }
+    data->result.close();
+}
 
-        vitis::ai::OpenPoseResult result = model->run(image);
-
-        std::unique_lock<std::mutex> lock_result(data->mtx_result);
-        data->result.push(result);
-        lock_result.unlock();
-        data->cv_result.notify_one();
+// 結果をsinkの形式でまとめて書き込む
+void write_result(FrameInfo *data, ResultSink *sink) {
+    std::pair<std::size_t, vitis::ai::OpenPoseResult> output;
+    trace_recorder().name_thread("output");
+    while (data->result.pop(output)) {
+        TraceScope scope("output", output.first);
+        const std::string &file = data->file_names[output.first];
+        if (sink->format() == RESULT_SINK_JSONL) {
+            sink->write_jsonl(output.first, file,
+                              result_to_json_string(output.second));
+        } else {
+            std::string binary;
+            result_to_binary(output.second, binary);
+            sink->write_binary(output.first, file, binary);
+        }
     }
 }
 
 void show_result(FrameInfo *data) {
     unsigned long frame_count = 0;
-    while (!data->stop) {
-        std::unique_lock<std::mutex> lock_result(data->mtx_result);
-        data->cv_result.wait_for(lock_result, std::chrono::milliseconds(500),
-                                 [&data] { return !data->result.empty(); });
-        if (data->result.empty() && !data->stop) {
-            continue;
-        }
-
-        vitis::ai::OpenPoseResult result = data->result.front();
-        data->result.pop();
-        lock_result.unlock();
-        data->cv_result.notify_one();
+    std::pair<std::size_t, vitis::ai::OpenPoseResult> output;
+    trace_recorder().name_thread("output");
+    while (data->result.pop(output)) {
+        const vitis::ai::OpenPoseResult &result = output.second;
+        TraceScope scope("output", output.first);
         frame_count++;
         std::cout << "frame " << frame_count << ": ";
         for (const auto &pose : result.poses) {
@@ -93,55 +93,66 @@ void show_result(FrameInfo *data) {
             std::cout << std::endl;
         }
         std::cout << std::endl;
-        data->stop = (frame_count == data->file_count);
     }
 }
 
-void read_image(FrameInfo *data) {
-    while (!data->file_names.empty()) {
-        std::string path = data->file_names.front();
-        data->file_names.erase(data->file_names.begin());
-        cv::Mat image = cv::imread(path);
-        std::unique_lock<std::mutex> lock_in(data->mtx_in);
-        data->image_in.push(image);
-        lock_in.unlock();
-        data->cv_in.notify_one();
-    }
-}
-
-std::vector<std::string> get_file_names(std::string images_directory) {
-    std::set<std::filesystem::path> contents_of_dir;
-    // ディレクトリからファイル(画像)をすべて取得する
-    std::filesystem::directory_iterator iter(images_directory), end;
-    for (const auto &file :
-         std::filesystem::directory_iterator(images_directory)) {
-        if (file.path().extension() == ".jpg" ||
-            file.path().extension() == ".png") {
-            contents_of_dir.insert(file.path());
-        }
+void read_image(FrameInfo *data, ImageLoader *loader,
+                const ImageArchive *archive) {
+    trace_recorder().name_thread("read");
+    auto deliver = [data](cv::Mat image) { data->image_in.push(image); };
+    if (archive) {
+        loader->run(*archive, deliver);
+    } else {
+        loader->run(data->file_names, deliver);
     }
-    std::vector<std::string> file_names(contents_of_dir.begin(),
-                                        contents_of_dir.end());
-    return file_names;
+    data->image_in.close();
 }
 
 int main(int argc, char *argv[]) {
-    std::string model_ = argv[1];
-    std::string images_directory = argv[2];
+    Options options(argc, argv);
+    trace_from_options(options);
+    std::string model_ = options.positional(0);
+    std::string images_directory = options.positional(1);
 
-    model = vitis::ai::OpenPose::create(model_);
+    model = create_pose_backend(options, model_);
 
     FrameInfo *data = new FrameInfo(cv::Mat());
-    data->file_names = get_file_names(images_directory);
-    data->stop = false;
-    data->file_count = data->file_names.size();
+    // ディレクトリの代わりにpack_imagesで作ったアーカイブも指定できる
+    std::unique_ptr<ImageArchive> archive;
+    if (is_image_archive(images_directory)) {
+        archive = std::make_unique<ImageArchive>(images_directory);
+        data->file_names = archive->names();
+    } else {
+        data->file_names = get_file_names(images_directory);
+    }
+
+    int output_format =
+        parse_result_sink(options.get("output-format", "text"));
+    std::unique_ptr<ResultSink> sink;
+    if (output_format != RESULT_SINK_TEXT) {
+        sink = std::make_unique<ResultSink>(output_format,
+                                            options.get("output", "-"));
+    }
 
-    std::thread read_image_thread(read_image, data);
+    ImageLoader loader(
+        options.get_int("decode-threads", std::thread::hardware_concurrency()),
+        options.get_int("prefetch", DEFAULT_LOAD_WINDOW));
+    std::thread read_image_thread(read_image, data, &loader,
+                                  archive.get());
     std::thread pose_estimate_thread(pose_estimate, data);
-    std::thread show_result_thread(show_result, data);
+    std::thread show_result_thread;
+    if (output_format == RESULT_SINK_TEXT) {
+        show_result_thread = std::thread(show_result, data);
+    } else {
+        show_result_thread = std::thread(write_result, data, sink.get());
+    }
 
     read_image_thread.join();
     pose_estimate_thread.join();
     show_result_thread.join();
+    if (sink) {
+        sink->close();
+    }
+    trace_recorder().write();
     return 0;
 }
@@ -0,0 +1,255 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "batch_scheduler.hpp"
+#include "check.hpp"
+
+using Scheduler = BatchScheduler<int, int>;
+
+// スケジューラのスレッドから届いた値を記録し、数が揃うまで待つ
+class Collector {
+  public:
+    void add(std::string event) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        events_.push_back(std::move(event));
+        cv_.notify_all();
+    }
+
+    bool wait(std::size_t count) {
+        std::unique_lock<std::mutex> lock(mtx_);
+        return cv_.wait_for(lock, std::chrono::seconds(5),
+                            [this, count] { return events_.size() >= count; });
+    }
+
+    std::vector<std::string> events() {
+        std::lock_guard<std::mutex> lock(mtx_);
+        return events_;
+    }
+
+  private:
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    std::vector<std::string> events_;
+};
+
+// インスタンスの集計はdeliverの後に更新されるので、揃うまで待つ
+bool wait_frames(Scheduler &scheduler, std::size_t count) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (std::chrono::steady_clock::now() < deadline) {
+        std::size_t frames = 0;
+        for (const auto &stats : scheduler.instance_stats()) {
+            frames += stats.frames;
+        }
+        if (frames >= count) {
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return false;
+}
+
+// 終わる順番がばらばらでも、1つの接続の結果は入れた順に届く
+void test_ordered_delivery() {
+    std::vector<Scheduler::RunBatch> instances;
+    for (int i = 0; i < 3; ++i) {
+        instances.push_back([](const std::vector<int> &inputs) {
+            thread_local std::mt19937 random(std::random_device{}());
+            std::this_thread::sleep_for(
+                std::chrono::microseconds(random() % 2000));
+            std::vector<int> results;
+            for (int input : inputs) {
+                results.push_back(input * 10);
+            }
+            return results;
+        });
+    }
+    Scheduler scheduler(std::move(instances), 4,
+                        std::chrono::microseconds(200));
+    Collector collector;
+    auto stream = scheduler.open(
+        [&collector](int result) { collector.add(std::to_string(result)); });
+    const int count = 200;
+    for (int i = 0; i < count; ++i) {
+        scheduler.submit(stream, i);
+    }
+    CHECK(collector.wait(count));
+    std::vector<std::string> events = collector.events();
+    CHECK(events.size() == count);
+    for (int i = 0; i < count && i < static_cast<int>(events.size()); ++i) {
+        CHECK(events[i] == std::to_string(i * 10));
+    }
+    CHECK(wait_frames(scheduler, count));
+    scheduler.close(stream);
+}
+
+// 1つのインスタンスが推論中なら、空いているインスタンスにバッチを送る
+void test_least_loaded_dispatch() {
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool started = false;
+    bool released = false;
+    std::vector<int> instance_of(6, -1);
+    std::vector<Scheduler::RunBatch> instances;
+    for (int i = 0; i < 2; ++i) {
+        instances.push_back([&, i](const std::vector<int> &inputs) {
+            std::unique_lock<std::mutex> lock(mtx);
+            for (int input : inputs) {
+                instance_of[input] = i;
+            }
+            if (inputs[0] == 0) {
+                started = true;
+                cv.notify_all();
+                cv.wait(lock, [&released] { return released; });
+            }
+            return inputs;
+        });
+    }
+    Scheduler scheduler(std::move(instances), 1,
+                        std::chrono::microseconds(100));
+    Collector collector;
+    auto stream = scheduler.open(
+        [&collector](int result) { collector.add(std::to_string(result)); });
+    stream->set_ordered(false);
+
+    scheduler.submit(stream, 0);
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        CHECK(cv.wait_for(lock, std::chrono::seconds(5),
+                          [&started] { return started; }));
+    }
+    // 1フレームずつ終わるのを待ってから入れると、全て空いている方へ行く
+    for (int i = 1; i < 6; ++i) {
+        scheduler.submit(stream, i);
+        CHECK(collector.wait(i));
+    }
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        CHECK(instance_of[0] == 0);
+        for (int i = 1; i < 6; ++i) {
+            CHECK(instance_of[i] == 1);
+        }
+        released = true;
+    }
+    cv.notify_all();
+    CHECK(collector.wait(6));
+    CHECK(wait_frames(scheduler, 6));
+    auto stats = scheduler.instance_stats();
+    CHECK(stats.size() == 2);
+    CHECK(stats[0].frames == 1);
+    CHECK(stats[1].frames == 5);
+    scheduler.close(stream);
+}
+
+// 例外を投げたバッチや結果が足りないバッチのフレームは、
+// 結果と同じ順番でdropに渡る
+void test_failed_batches() {
+    Scheduler scheduler(
+        [](const std::vector<int> &inputs) {
+            if (inputs[0] == 3) {
+                throw std::runtime_error("backend failure");
+            }
+            if (inputs[0] == 5) {
+                return std::vector<int>();
+            }
+            return inputs;
+        },
+        1, std::chrono::microseconds(100));
+    Collector collector;
+    auto stream = scheduler.open([&collector](int result) {
+        collector.add("r" + std::to_string(result));
+    });
+    stream->set_drop([&collector](int input) {
+        collector.add("d" + std::to_string(input));
+    });
+    for (int i = 0; i < 8; ++i) {
+        scheduler.submit(stream, i);
+    }
+    CHECK(collector.wait(8));
+    std::vector<std::string> expected = {"r0", "r1", "r2", "d3",
+                                         "r4", "d5", "r6", "r7"};
+    CHECK(collector.events() == expected);
+    scheduler.close(stream);
+}
+
+// バッチには接続を順番に1フレームずつ入れる
+void test_round_robin() {
+    Collector collector;
+    Scheduler scheduler(
+        [&collector](const std::vector<int> &inputs) {
+            std::string batch;
+            for (int input : inputs) {
+                batch += (batch.empty() ? "" : ",") + std::to_string(input);
+            }
+            collector.add(batch);
+            return inputs;
+        },
+        4, std::chrono::seconds(1));
+    auto busy = scheduler.open([](int) {});
+    auto quiet = scheduler.open([](int) {});
+    scheduler.submit(quiet, 100);
+    scheduler.submit(quiet, 101);
+    for (int i = 0; i < 4; ++i) {
+        scheduler.submit(busy, i);
+    }
+    CHECK(collector.wait(1));
+    CHECK(collector.events()[0] == "0,100,1,101");
+    scheduler.close(busy);
+    scheduler.close(quiet);
+}
+
+// 閉じた接続に渡したフレームはdropに渡り、他の接続の推論は止まらない
+void test_submit_after_close() {
+    Scheduler scheduler([](const std::vector<int> &inputs) { return inputs; },
+                        2, std::chrono::microseconds(100));
+    Collector collector;
+    auto closed = scheduler.open([&collector](int result) {
+        collector.add("c" + std::to_string(result));
+    });
+    closed->set_drop([&collector](int input) {
+        collector.add("d" + std::to_string(input));
+    });
+    auto open = scheduler.open([&collector](int result) {
+        collector.add("r" + std::to_string(result));
+    });
+    scheduler.close(closed);
+    CHECK(scheduler.submit(closed, 1) == 1);
+    CHECK(collector.wait(1));
+    CHECK(collector.events()[0] == "d1");
+    scheduler.submit(open, 2);
+    CHECK(collector.wait(2));
+    std::vector<std::string> expected = {"d1", "r2"};
+    CHECK(collector.events() == expected);
+    scheduler.close(open);
+}
+
+int main() {
+    test_ordered_delivery();
+    test_least_loaded_dispatch();
+    test_failed_batches();
+    test_round_robin();
+    test_submit_after_close();
+    return test_failures();
+}
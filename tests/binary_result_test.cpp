@@ -0,0 +1,135 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <boost/json/src.hpp>
+#include <string>
+
+#include "check.hpp"
+#include "facedetect_result.hpp"
+#include "openpose_result.hpp"
+
+SessionOptions result_format(std::uint16_t format) {
+    SessionOptions options;
+    options.result_format = format;
+    return options;
+}
+
+// 人物ごとの部位数は最も多い人物に揃え、足りない部位はtype = 0で埋める
+void test_pose_round_trip() {
+    vitis::ai::OpenPoseResult result;
+    result.width = 368;
+    result.height = 368;
+    result.poses.resize(2);
+    for (int i = 0; i < OPENPOSE_NUM_POINTS; ++i) {
+        result.poses[0].push_back({1, cv::Point2f(i * 2.5f, i * 3.0f)});
+    }
+    result.poses[1].push_back({1, cv::Point2f(10.0f, 20.0f)});
+    result.poses[1].push_back({0, cv::Point2f(0.0f, 0.0f)});
+
+    std::string binary =
+        serialize_result(result, result_format(RESULT_FORMAT_BINARY));
+    BinaryResultView view;
+    CHECK(view.parse(binary.data(), binary.size()));
+    CHECK(view.header().kind == BINARY_RESULT_POSE);
+    CHECK(view.header().count == 2);
+    CHECK(view.header().points == OPENPOSE_NUM_POINTS);
+    CHECK(view.header().width == 368);
+    CHECK(view.header().height == 368);
+    for (int i = 0; i < OPENPOSE_NUM_POINTS; ++i) {
+        const BinaryPosePoint &point = view.pose(0)[i];
+        CHECK(point.type == 1);
+        CHECK(point.x == i * 2.5f);
+        CHECK(point.y == i * 3.0f);
+    }
+    CHECK(view.pose(1)[0].type == 1);
+    CHECK(view.pose(1)[0].x == 10.0f);
+    CHECK(view.pose(1)[0].y == 20.0f);
+    for (int i = 1; i < OPENPOSE_NUM_POINTS; ++i) {
+        CHECK(view.pose(1)[i].type == 0);
+    }
+}
+
+// 座標はJSON形式と同じく画素単位にし、負の位置は0に切り詰める
+void test_face_round_trip() {
+    vitis::ai::FaceDetectResult result;
+    result.width = DENSEBOX_INPUT_WIDTH;
+    result.height = DENSEBOX_INPUT_HEIGHT;
+    result.rects.push_back({0.5f, 0.25f, 0.125f, 0.5f, 0.9f});
+    result.rects.push_back({-0.1f, 0.0f, 0.25f, 0.25f, 0.6f});
+
+    std::string binary =
+        serialize_result(result, result_format(RESULT_FORMAT_BINARY));
+    BinaryResultView view;
+    CHECK(view.parse(binary.data(), binary.size()));
+    CHECK(view.header().kind == BINARY_RESULT_FACE);
+    CHECK(view.header().count == 2);
+    CHECK(view.rect(0).x == 320);
+    CHECK(view.rect(0).y == 90);
+    CHECK(view.rect(0).width == 80);
+    CHECK(view.rect(0).height == 180);
+    CHECK(view.rect(0).score == 0.9f);
+    CHECK(view.rect(1).x == 0);
+    CHECK(view.rect(1).width == 160);
+
+    boost::json::value json = boost::json::parse(
+        serialize_result(result, result_format(RESULT_FORMAT_JSON)));
+    CHECK(json.at("num").as_int64() == 2);
+    CHECK(json.at("1").at("x").as_int64() == view.rect(0).x);
+    CHECK(json.at("1").at("size_row").as_int64() == view.rect(0).height);
+}
+
+// 差分形式の接続でも、差分を取る前の結果はバイナリ形式で作る
+void test_format_selection() {
+    vitis::ai::FaceDetectResult result;
+    result.width = DENSEBOX_INPUT_WIDTH;
+    result.height = DENSEBOX_INPUT_HEIGHT;
+    std::string delta =
+        serialize_result(result, result_format(RESULT_FORMAT_DELTA));
+    BinaryResultView view;
+    CHECK(view.parse(delta.data(), delta.size()));
+    CHECK(view.header().count == 0);
+    std::string json =
+        serialize_result(result, result_format(RESULT_FORMAT_JSON));
+    CHECK(!json.empty() && json[0] == '{');
+}
+
+// 長さや種類が合わないデータは読まない
+void test_parse_rejects_invalid() {
+    vitis::ai::FaceDetectResult result;
+    result.width = DENSEBOX_INPUT_WIDTH;
+    result.height = DENSEBOX_INPUT_HEIGHT;
+    result.rects.push_back({0.5f, 0.5f, 0.1f, 0.1f, 0.5f});
+    std::string binary =
+        serialize_result(result, result_format(RESULT_FORMAT_BINARY));
+    BinaryResultView view;
+    CHECK(!view.parse(binary.data(), binary.size() - 1));
+    CHECK(!view.parse(binary.data(), sizeof(BinaryResultHeader) - 1));
+    std::string bad_magic = binary;
+    bad_magic[0] ^= 0xff;
+    CHECK(!view.parse(bad_magic.data(), bad_magic.size()));
+    std::string bad_kind = binary;
+    reinterpret_cast<BinaryResultHeader *>(&bad_kind[0])->kind = 7;
+    CHECK(!view.parse(bad_kind.data(), bad_kind.size()));
+}
+
+int main() {
+    test_pose_round_trip();
+    test_face_round_trip();
+    test_format_selection();
+    test_parse_rejects_invalid();
+    return test_failures();
+}
@@ -0,0 +1,5 @@
+mkdir build
+cd build
+cmake ..
+make -B -j
+ctest --output-on-failure
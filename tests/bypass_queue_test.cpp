@@ -0,0 +1,96 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <cstdint>
+#include <vector>
+
+#include "bypass_queue.hpp"
+#include "check.hpp"
+
+using Queue = BypassQueue<int, int>;
+
+// 受信時刻は全て同じにして、indexだけで見分けられることを確かめる
+TaggedFrame frame(std::uint64_t index) {
+    return TaggedFrame{FrameHeader(), cv::Mat(), FrameTimes(), index};
+}
+
+struct Fixture {
+    std::vector<Tagged<int>> emitted;
+    // 推論しないフレームはExtraを結果にする
+    Queue queue{[](Queue::Entry &entry) {
+                    if (entry.done) {
+                        return std::move(entry.result);
+                    }
+                    return Tagged<int>{entry.header, entry.extra, entry.times,
+                                       entry.index};
+                },
+                [this](Tagged<int> result) { emitted.push_back(result); }};
+};
+
+// 推論の結果が届くまで後ろのフレームを待たせ、受信した順に返す
+void test_results_in_stream_order() {
+    Fixture f;
+    f.queue.push(frame(0), -1, true);
+    f.queue.push(frame(1), 1, false);
+    f.queue.push(frame(2), -1, true);
+    f.queue.drain();
+    CHECK(f.emitted.empty());
+    f.queue.complete(Tagged<int>{FrameHeader(), 0, FrameTimes(), 0});
+    f.queue.drain();
+    CHECK(f.emitted.size() == 2);
+    f.queue.complete(Tagged<int>{FrameHeader(), 2, FrameTimes(), 2});
+    f.queue.drain();
+    CHECK(f.emitted.size() == 3);
+    for (std::size_t i = 0; i < f.emitted.size(); ++i) {
+        CHECK(f.emitted[i].index == i);
+        CHECK(f.emitted[i].value == static_cast<int>(i));
+    }
+}
+
+// 前に頼んだフレームの結果が無ければ推論できなかったものとして扱う
+void test_missing_result() {
+    Fixture f;
+    f.queue.push(frame(0), 10, true);
+    f.queue.push(frame(1), 11, true);
+    f.queue.complete(Tagged<int>{FrameHeader(), 1, FrameTimes(), 1});
+    f.queue.drain();
+    CHECK(f.emitted.size() == 2);
+    CHECK(f.emitted.size() == 2 && f.emitted[0].value == 10);
+    CHECK(f.emitted.size() == 2 && f.emitted[1].value == 1);
+}
+
+// 捨てたフレームはindexの一致するものだけを推論しないものとして扱う
+void test_cancel_by_index() {
+    Fixture f;
+    f.queue.push(frame(0), 10, true);
+    f.queue.push(frame(1), 11, true);
+    f.queue.cancel(frame(1));
+    f.queue.drain();
+    CHECK(f.emitted.empty());
+    f.queue.complete(Tagged<int>{FrameHeader(), 0, FrameTimes(), 0});
+    f.queue.drain();
+    CHECK(f.emitted.size() == 2);
+    CHECK(f.emitted.size() == 2 && f.emitted[0].value == 0);
+    CHECK(f.emitted.size() == 2 && f.emitted[1].value == 11);
+}
+
+int main() {
+    test_results_in_stream_order();
+    test_missing_result();
+    test_cancel_by_index();
+    return test_failures();
+}
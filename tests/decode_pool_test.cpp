@@ -0,0 +1,159 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <opencv2/opencv.hpp>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "check.hpp"
+#include "decode_pool.hpp"
+
+// 番号を1画素に入れた画像。空の画像は-1として数える
+cv::Mat numbered(int value) { return cv::Mat(1, 1, CV_32S, cv::Scalar(value)); }
+
+int number(const cv::Mat &image) {
+    return image.empty() ? -1 : image.at<int>(0, 0);
+}
+
+// デコードプールから届いた番号を記録し、数が揃うまで待つ
+class Collector {
+  public:
+    DecodePool::Deliver deliver() {
+        return [this](cv::Mat image) {
+            std::lock_guard<std::mutex> lock(mtx_);
+            values_.push_back(number(image));
+            cv_.notify_all();
+        };
+    }
+
+    bool wait(std::size_t count) {
+        std::unique_lock<std::mutex> lock(mtx_);
+        return cv_.wait_for(lock, std::chrono::seconds(5),
+                            [this, count] { return values_.size() >= count; });
+    }
+
+    std::vector<int> values() {
+        std::lock_guard<std::mutex> lock(mtx_);
+        return values_;
+    }
+
+  private:
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    std::vector<int> values_;
+};
+
+// 終わる順番がばらばらでも、投入した順番で渡す
+void test_ordered_delivery() {
+    DecodePool pool(4);
+    Collector collector;
+    auto stream = pool.open(collector.deliver());
+    std::mt19937 rng(1);
+    const int count = 200;
+    for (int i = 0; i < count; ++i) {
+        int sleep_us = std::uniform_int_distribution<int>(0, 500)(rng);
+        pool.submit(stream, [i, sleep_us] {
+            std::this_thread::sleep_for(std::chrono::microseconds(sleep_us));
+            return numbered(i);
+        });
+    }
+    CHECK(collector.wait(count));
+    std::vector<int> values = collector.values();
+    bool ordered = values.size() == count;
+    for (int i = 0; ordered && i < count; ++i) {
+        ordered = values[i] == i;
+    }
+    CHECK(ordered);
+}
+
+// 例外を投げたフレームは、その順番で空の画像として渡す
+void test_exception() {
+    DecodePool pool(2);
+    Collector collector;
+    auto stream = pool.open(collector.deliver());
+    pool.submit(stream, [] { return numbered(0); });
+    pool.submit(stream, []() -> cv::Mat {
+        throw std::runtime_error("corrupt frame");
+    });
+    pool.submit(stream, [] { return numbered(2); });
+    CHECK(collector.wait(3));
+    CHECK(collector.values() == std::vector<int>({0, -1, 2}));
+}
+
+// 遅いフレームが他の接続のフレームを待たせない
+void test_independent_streams() {
+    DecodePool pool(2);
+    Collector slow_collector, fast_collector;
+    auto slow = pool.open(slow_collector.deliver());
+    auto fast = pool.open(fast_collector.deliver());
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool release = false;
+    pool.submit(slow, [&] {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [&release] { return release; });
+        return numbered(0);
+    });
+    pool.submit(fast, [] { return numbered(1); });
+    CHECK(fast_collector.wait(1));
+    CHECK(slow_collector.values().empty());
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        release = true;
+    }
+    cv.notify_all();
+    CHECK(slow_collector.wait(1));
+}
+
+// 閉じた後に終わったフレームは渡さない
+void test_close() {
+    DecodePool pool(2);
+    Collector collector;
+    auto stream = pool.open(collector.deliver());
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool release = false;
+    pool.submit(stream, [&] {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [&release] { return release; });
+        return numbered(0);
+    });
+    pool.submit(stream, [] { return numbered(1); });
+    pool.close(stream);
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        release = true;
+    }
+    cv.notify_all();
+    // 閉じたストリームにも投入はできるが、結果は捨てる
+    pool.submit(stream, [] { return numbered(2); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    CHECK(collector.values().empty());
+}
+
+int main() {
+    test_ordered_delivery();
+    test_exception();
+    test_independent_streams();
+    test_close();
+    return test_failures();
+}
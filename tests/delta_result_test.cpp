@@ -0,0 +1,112 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <cstring>
+#include <random>
+#include <string>
+
+#include "check.hpp"
+#include "delta_result.hpp"
+
+DeltaResultHeader header_of(const std::string &encoded) {
+    DeltaResultHeader header;
+    std::memcpy(&header, encoded.data(), sizeof(header));
+    return header;
+}
+
+// 長さも中身も変わる結果の列を、キーフレームを挟みながら元どおりに戻す
+void test_round_trip() {
+    std::mt19937 rng(1);
+    DeltaEncoder encoder(5);
+    DeltaDecoder decoder;
+    std::string binary(40, 'a');
+    bool restored = true;
+    for (int i = 0; i < 500; ++i) {
+        // 長さは4の倍数でないものも含めて伸び縮みさせる
+        binary.resize(std::uniform_int_distribution<int>(0, 80)(rng), 'z');
+        int changes = std::uniform_int_distribution<int>(0, 4)(rng);
+        for (int c = 0; c < changes && !binary.empty(); ++c) {
+            std::size_t pos = std::uniform_int_distribution<std::size_t>(
+                0, binary.size() - 1)(rng);
+            binary[pos] = static_cast<char>(rng());
+        }
+        std::string encoded = encoder.encode(binary);
+        std::string decoded;
+        restored = restored &&
+                   decoder.decode(encoded.data(), encoded.size(), decoded) &&
+                   decoded == binary;
+        CHECK(((header_of(encoded).flags & DELTA_FLAG_KEYFRAME) != 0) ==
+              (i % 5 == 0));
+    }
+    CHECK(restored);
+    CHECK(encoder.raw_bytes() > 0);
+}
+
+// 変わらなければ範囲は無く、近い変化は1つの範囲にまとめる
+void test_runs() {
+    DeltaEncoder encoder(100);
+    std::string binary(64, '\0');
+    CHECK(header_of(encoder.encode(binary)).runs == 1);
+    std::string same = encoder.encode(binary);
+    CHECK(same.size() == sizeof(DeltaResultHeader));
+    CHECK(header_of(same).runs == 0);
+
+    // 0語目と3語目の変化は、2語の隙間を挟んで1つの範囲になる
+    binary[0] = 1;
+    binary[12] = 1;
+    std::string merged = encoder.encode(binary);
+    CHECK(header_of(merged).runs == 1);
+    CHECK(merged.size() == sizeof(DeltaResultHeader) + sizeof(DeltaRun) + 16);
+
+    // 3語より離れた変化は別の範囲になる
+    binary[0] = 2;
+    binary[16] = 2;
+    std::string split = encoder.encode(binary);
+    CHECK(header_of(split).runs == 2);
+    CHECK(split.size() ==
+          sizeof(DeltaResultHeader) + 2 * sizeof(DeltaRun) + 8);
+}
+
+// 最初のキーフレームの前と、壊れた結果の後は次のキーフレームまで戻さない
+void test_recovery() {
+    DeltaEncoder encoder(3);
+    std::string key = encoder.encode("keyframe");
+    std::string delta1 = encoder.encode("keyframf");
+    std::string delta2 = encoder.encode("keyframg");
+    std::string key2 = encoder.encode("keyframh");
+
+    DeltaDecoder decoder;
+    std::string out;
+    CHECK(!decoder.decode(delta1.data(), delta1.size(), out));
+    CHECK(decoder.decode(key.data(), key.size(), out) && out == "keyframe");
+    // 範囲の途中で切れた結果
+    CHECK(!decoder.decode(delta1.data(), delta1.size() - 1, out));
+    CHECK(!decoder.decode(delta2.data(), delta2.size(), out));
+    CHECK(decoder.decode(key2.data(), key2.size(), out) && out == "keyframh");
+
+    std::string wrong = key2;
+    wrong[0] ^= 1;
+    CHECK(!decoder.decode(wrong.data(), wrong.size(), out));
+    CHECK(!decoder.decode(key2.data(), 4, out));
+}
+
+int main() {
+    test_round_trip();
+    test_runs();
+    test_recovery();
+    return test_failures();
+}
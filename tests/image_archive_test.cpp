@@ -0,0 +1,99 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+
+#include "check.hpp"
+#include "image_archive.hpp"
+
+// 書き込んだ画像のデータと名前が同じ順で読める
+void test_round_trip() {
+    std::string path = "image_archive_test.bin";
+    ImageArchiveWriter writer(path);
+    writer.add("a.jpg", "first", 5);
+    writer.add("b.png", "", 0);
+    writer.add("c.jpg", "third image", 11);
+    writer.finish();
+    CHECK(is_image_archive(path));
+
+    ImageArchive archive(path);
+    CHECK(archive.count() == 3);
+    CHECK(archive.names().size() == 3);
+    CHECK(archive.names()[0] == "a.jpg");
+    CHECK(archive.names()[2] == "c.jpg");
+    CHECK(std::string(archive.data(0), archive.size(0)) == "first");
+    CHECK(archive.size(1) == 0);
+    CHECK(std::string(archive.data(2), archive.size(2)) == "third image");
+    std::remove(path.c_str());
+}
+
+// 先頭がIMAGE_ARCHIVE_MAGICでないファイルや、存在しないパスは
+// アーカイブとみなさない
+void test_not_archive() {
+    std::string path = "image_archive_test.jpg";
+    {
+        std::ofstream out(path, std::ios::binary);
+        out << "\xff\xd8\xff\xe0 not an archive";
+    }
+    CHECK(!is_image_archive(path));
+    CHECK(!is_image_archive("image_archive_test_missing"));
+    CHECK(!is_image_archive("."));
+    bool thrown = false;
+    try {
+        ImageArchive archive(path);
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    CHECK(thrown);
+    std::remove(path.c_str());
+}
+
+// 索引が途中で切れたアーカイブは開けない
+void test_truncated() {
+    std::string path = "image_archive_test.bin";
+    ImageArchiveWriter writer(path);
+    writer.add("a.jpg", "first", 5);
+    writer.finish();
+    std::ifstream in(path, std::ios::binary);
+    std::string data((std::istreambuf_iterator<char>(in)),
+                     std::istreambuf_iterator<char>());
+    in.close();
+    {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out.write(data.data(), data.size() - 8);
+    }
+    CHECK(is_image_archive(path));
+    bool thrown = false;
+    try {
+        ImageArchive archive(path);
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    CHECK(thrown);
+    std::remove(path.c_str());
+}
+
+int main() {
+    test_round_trip();
+    test_not_archive();
+    test_truncated();
+    return test_failures();
+}
@@ -0,0 +1,202 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <boost/asio.hpp>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include "check.hpp"
+#include "protocol.hpp"
+
+using boost::asio::local::stream_protocol;
+
+// 対応していない値は既定値に戻し、生の画素にはサーバのサイズを返す
+void test_accept() {
+    SessionOptions requested;
+    requested.result_format = RESULT_FORMAT_BINARY;
+    requested.frame_format = FRAME_FORMAT_NV12;
+    requested.frame_compression = FRAME_COMPRESSION_PNG;
+    requested.frame_width = 1920;
+    requested.frame_height = 1080;
+    requested.frame_header = FRAME_HEADER_REQUEST | FRAME_HEADER_SEQUENCE;
+    SessionOptions accepted = accept_session_options(requested, 368, 368);
+    CHECK(accepted.result_format == RESULT_FORMAT_BINARY);
+    CHECK(accepted.frame_format == FRAME_FORMAT_NV12);
+    CHECK(accepted.frame_compression == FRAME_COMPRESSION_PNG);
+    CHECK(accepted.frame_width == 368 && accepted.frame_height == 368);
+    CHECK(accepted.frame_header == FRAME_HEADER_SEQUENCE);
+    CHECK(raw_frame_size(accepted) == 368 * 368 * 3 / 2);
+
+    requested.result_format = 7;
+    requested.frame_format = 9;
+    accepted = accept_session_options(requested, 368, 368, FRAME_HEADER_NONE);
+    CHECK(accepted.result_format == RESULT_FORMAT_JSON);
+    CHECK(accepted.frame_format == FRAME_FORMAT_JPEG);
+    CHECK(accepted.frame_compression == FRAME_COMPRESSION_NONE);
+    CHECK(accepted.frame_width == 0 && accepted.frame_height == 0);
+    CHECK(accepted.frame_header == FRAME_HEADER_NONE);
+    CHECK(!is_raw_frame_format(accepted));
+
+    // マジックが違えば何も受け入れない
+    requested.magic = 0;
+    requested.result_format = RESULT_FORMAT_BINARY;
+    accepted = accept_session_options(requested, 368, 368);
+    CHECK(accepted.result_format == RESULT_FORMAT_JSON);
+    CHECK(accepted.frame_header == FRAME_HEADER_NONE);
+}
+
+// 差分形式は対応するサーバだけが受け入れ、他はバイナリ形式で応じる
+void test_accept_delta() {
+    SessionOptions requested;
+    requested.result_format = RESULT_FORMAT_DELTA;
+    SessionOptions accepted = accept_session_options(requested, 640, 360);
+    CHECK(accepted.result_format == RESULT_FORMAT_BINARY);
+    CHECK(is_binary_result_format(accepted));
+    accepted = accept_session_options(requested, 640, 360,
+                                      FRAME_HEADER_SEQUENCE, true);
+    CHECK(accepted.result_format == RESULT_FORMAT_DELTA);
+    CHECK(is_binary_result_format(accepted));
+}
+
+// 古いクライアントの短いSessionOptionsは、足りない部分を既定値にする
+void test_read_short_options() {
+    boost::asio::io_context io;
+    stream_protocol::socket client(io), server(io);
+    boost::asio::local::connect_pair(client, server);
+    SessionOptions v1;
+    v1.version = 1;
+    v1.result_format = RESULT_FORMAT_BINARY;
+    v1.frame_format = FRAME_FORMAT_BGR;
+    // バージョン1はresult_formatまでの8バイト
+    boost::asio::write(client, boost::asio::buffer(&v1, 8));
+    SessionOptions options =
+        read_session_options(server, CONTROL_MESSAGE_FLAG | 8);
+    CHECK(options.version == 1);
+    CHECK(options.result_format == RESULT_FORMAT_BINARY);
+    CHECK(options.frame_format == FRAME_FORMAT_JPEG);
+    CHECK(options.frame_header == FRAME_HEADER_NONE);
+}
+
+// 新しいクライアントの長いSessionOptionsは、残りを読み捨てる
+void test_read_long_options() {
+    boost::asio::io_context io;
+    stream_protocol::socket client(io), server(io);
+    boost::asio::local::connect_pair(client, server);
+    char buf[sizeof(SessionOptions) + 8] = {};
+    SessionOptions future;
+    future.frame_header = FRAME_HEADER_SEQUENCE;
+    std::memcpy(buf, &future, sizeof(future));
+    std::memset(buf + sizeof(future), 0x5a, 8);
+    std::uint32_t next = 0x12345678;
+    boost::asio::write(client, boost::asio::buffer(buf, sizeof(buf)));
+    boost::asio::write(client, boost::asio::buffer(&next, sizeof(next)));
+    SessionOptions options =
+        read_session_options(server, CONTROL_MESSAGE_FLAG | sizeof(buf));
+    CHECK(options.frame_header == FRAME_HEADER_SEQUENCE);
+    std::uint32_t value = 0;
+    boost::asio::read(server, boost::asio::buffer(&value, sizeof(value)));
+    CHECK(value == next);
+
+    bool thrown = false;
+    try {
+        read_session_options(server, CONTROL_MESSAGE_FLAG | 4097);
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    CHECK(thrown);
+}
+
+// クライアントの要求をサーバが受け入れた内容で返す
+void test_negotiate() {
+    boost::asio::io_context io;
+    stream_protocol::socket client(io), server(io);
+    boost::asio::local::connect_pair(client, server);
+    std::thread server_thread([&server] {
+        std::size_t header;
+        boost::asio::read(server,
+                          boost::asio::buffer(&header, sizeof(header)));
+        CHECK(is_control_message(header));
+        SessionOptions requested = read_session_options(server, header);
+        write_session_options(server,
+                              accept_session_options(requested, 640, 360));
+    });
+    SessionOptions requested;
+    requested.result_format = RESULT_FORMAT_BINARY;
+    requested.frame_format = FRAME_FORMAT_BGR;
+    requested.frame_header = FRAME_HEADER_SEQUENCE;
+    SessionOptions accepted = negotiate_session_options(client, requested);
+    server_thread.join();
+    CHECK(accepted.magic == PROTOCOL_MAGIC);
+    CHECK(accepted.version == PROTOCOL_VERSION);
+    CHECK(accepted.result_format == RESULT_FORMAT_BINARY);
+    CHECK(accepted.frame_width == 640 && accepted.frame_height == 360);
+    CHECK(raw_frame_size(accepted) == 640 * 360 * 3);
+    CHECK(has_frame_header(accepted, FRAME_HEADER_SEQUENCE));
+    CHECK(!has_frame_header(accepted, FRAME_HEADER_REQUEST));
+}
+
+// 結果の先頭には送ったFrameHeaderがそのまま付く
+void test_tag_result() {
+    FrameHeader header;
+    header.flags = FRAME_FLAG_DROPPED;
+    header.stream_id = 3;
+    header.seq = 42;
+    header.timestamp_us = 123456789;
+    std::string tagged = tag_result(header, "body");
+    CHECK(tagged.size() == sizeof(FrameHeader) + 4);
+    FrameHeader read;
+    std::memcpy(&read, tagged.data(), sizeof(read));
+    CHECK(read.version == FRAME_HEADER_VERSION);
+    CHECK(read.flags == FRAME_FLAG_DROPPED);
+    CHECK(read.stream_id == 3 && read.seq == 42);
+    CHECK(read.timestamp_us == 123456789);
+    CHECK(tagged.substr(sizeof(FrameHeader)) == "body");
+}
+
+void test_frame_request() {
+    FrameRequest request = parse_frame_request("face,pose");
+    CHECK(request.count == 2);
+    CHECK(request.models[0] == MODEL_FACE && request.models[1] == MODEL_POSE);
+    CHECK(parse_frame_request("").count == 0);
+    bool unknown = false;
+    try {
+        parse_frame_request("pose,hand");
+    } catch (const std::invalid_argument &) {
+        unknown = true;
+    }
+    CHECK(unknown);
+    bool too_many = false;
+    try {
+        parse_frame_request("pose,pose,pose,pose,pose,pose,pose,pose");
+    } catch (const std::invalid_argument &) {
+        too_many = true;
+    }
+    CHECK(too_many);
+}
+
+int main() {
+    test_accept();
+    test_accept_delta();
+    test_read_short_options();
+    test_read_long_options();
+    test_negotiate();
+    test_tag_result();
+    test_frame_request();
+    return test_failures();
+}
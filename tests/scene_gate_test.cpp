@@ -0,0 +1,104 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <cstdint>
+#include <opencv2/opencv.hpp>
+#include <optional>
+#include <vector>
+
+#include "check.hpp"
+#include "scene_gate.hpp"
+
+using Gated = GatedStream<int>;
+
+// 全ての画素がvalueの比較用の画像
+cv::Mat thumbnail(int value) {
+    return cv::Mat(GATE_HEIGHT, GATE_WIDTH, CV_8UC1, cv::Scalar(value));
+}
+
+TaggedFrame frame(std::uint64_t index) {
+    return TaggedFrame{FrameHeader(), cv::Mat(), FrameTimes(), index};
+}
+
+Tagged<int> result(std::uint64_t index, int value) {
+    return Tagged<int>{FrameHeader(), value, FrameTimes(), index};
+}
+
+// 基準は受信した順に変わり、同じ場面のフレームは基準のindexを返す
+void test_reference_follows_stream_order() {
+    SceneGate gate(4.0);
+    CHECK(!gate.similar(thumbnail(100), 0));
+    CHECK(gate.similar(thumbnail(102), 1) == std::optional<std::uint64_t>(0));
+    CHECK(!gate.similar(thumbnail(200), 2));
+    CHECK(gate.similar(thumbnail(198), 3) == std::optional<std::uint64_t>(2));
+    // 前の場面に戻っても、比べるのは最後の基準
+    CHECK(!gate.similar(thumbnail(100), 4));
+}
+
+// 使い回すフレームには基準のフレームの結果を受信した順に返す
+void test_reused_results_follow_reference() {
+    GateStats stats;
+    std::vector<TaggedFrame> submitted;
+    std::vector<Tagged<int>> emitted;
+    Gated gated(
+        4.0, stats,
+        [&submitted](TaggedFrame frame) { submitted.push_back(frame); },
+        [&emitted](Tagged<int> result) { emitted.push_back(result); });
+    gated.push(frame(0), std::nullopt, cv::Mat());
+    gated.push(frame(1), 0, cv::Mat());
+    gated.push(frame(2), std::nullopt, cv::Mat());
+    gated.push(frame(3), 2, cv::Mat());
+    CHECK(submitted.size() == 2);
+    // 推論の結果が届くまで後ろのフレームは待たせる
+    CHECK(emitted.empty());
+    gated.inferred(result(0, 10));
+    gated.inferred(result(2, 20));
+    CHECK(emitted.size() == 4);
+    std::vector<int> expected = {10, 10, 20, 20};
+    for (std::size_t i = 0; i < emitted.size() && i < 4; ++i) {
+        CHECK(emitted[i].index == i);
+        CHECK(emitted[i].value == expected[i]);
+    }
+    CHECK(stats.frames == 4);
+    CHECK(stats.reused == 2);
+}
+
+// スケジューラが基準のフレームを捨てたら、基準もそれを使い回すフレームも
+// その前の結果を返す
+void test_dropped_reference() {
+    GateStats stats;
+    std::vector<Tagged<int>> emitted;
+    Gated gated(
+        4.0, stats, [](TaggedFrame) {},
+        [&emitted](Tagged<int> result) { emitted.push_back(result); });
+    gated.push(frame(0), std::nullopt, cv::Mat());
+    gated.inferred(result(0, 10));
+    gated.push(frame(1), std::nullopt, cv::Mat());
+    gated.push(frame(2), 1, cv::Mat());
+    gated.dropped(frame(1));
+    CHECK(emitted.size() == 3);
+    for (const auto &result : emitted) {
+        CHECK(result.value == 10);
+    }
+}
+
+int main() {
+    test_reference_follows_stream_order();
+    test_reused_results_follow_reference();
+    test_dropped_reference();
+    return test_failures();
+}
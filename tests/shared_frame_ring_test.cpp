@@ -0,0 +1,91 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "check.hpp"
+#include "shared_frame_ring.hpp"
+
+bool attach_fails(int fd) {
+    try {
+        SharedFrameRing::attach(fd);
+    } catch (const std::runtime_error &) {
+        return true;
+    }
+    return false;
+}
+
+// クライアントが作った共有メモリは大きさが封印され、サーバからフレームが読める
+void test_attach() {
+    auto client = SharedFrameRing::create(2, 100);
+    CHECK(client->slot_size() == SHARED_FRAME_ALIGN);
+    CHECK(ftruncate(client->fd(), 0) != 0);
+    auto server = SharedFrameRing::attach(dup(client->fd()));
+    CHECK(server->slot_count() == 2);
+    CHECK(server->slot_size() == SHARED_FRAME_ALIGN);
+    CHECK(client->acquire(1, std::chrono::milliseconds(10)));
+    std::memcpy(client->slot_data(1), "frame", 5);
+    SharedFrameDescriptor descriptor = client->publish(1, 5);
+    const std::uint8_t *frame = server->frame(descriptor);
+    CHECK(frame != nullptr && std::memcmp(frame, "frame", 5) == 0);
+    CHECK(!client->acquire(1, std::chrono::milliseconds(1)));
+    server->release(1);
+    CHECK(client->acquire(1, std::chrono::milliseconds(10)));
+    CHECK(server->frame(descriptor) == nullptr);
+}
+
+// 封印していないmemfdは中身が正しくてもマップしない
+void test_reject_unsealed() {
+    auto client = SharedFrameRing::create(1, 100);
+    int fd = memfd_create("unsealed", MFD_CLOEXEC);
+    CHECK(fd >= 0);
+    struct stat st;
+    CHECK(fstat(client->fd(), &st) == 0);
+    CHECK(ftruncate(fd, st.st_size) == 0);
+    std::vector<char> data(st.st_size);
+    CHECK(pread(client->fd(), data.data(), data.size(), 0) ==
+          static_cast<ssize_t>(data.size()));
+    CHECK(pwrite(fd, data.data(), data.size(), 0) ==
+          static_cast<ssize_t>(data.size()));
+    CHECK(attach_fails(fd));
+    // attachが失敗してもfdは閉じられている
+    CHECK(fcntl(fd, F_GETFD) < 0);
+}
+
+// 封印されていても、ヘッダが壊れていれば拒否する
+void test_reject_invalid_header() {
+    auto client = SharedFrameRing::create(1, 100);
+    std::uint32_t magic = 0;
+    CHECK(pwrite(client->fd(), &magic, sizeof(magic), 0) ==
+          static_cast<ssize_t>(sizeof(magic)));
+    int fd = dup(client->fd());
+    CHECK(attach_fails(fd));
+    CHECK(fcntl(fd, F_GETFD) < 0);
+}
+
+int main() {
+    test_attach();
+    test_reject_unsealed();
+    test_reject_invalid_header();
+    return test_failures();
+}
@@ -0,0 +1,145 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+
+#include "check.hpp"
+#include "spsc_ring.hpp"
+
+// 容量は2のべき乗に切り上げ、一杯ならtry_pushは値を残してfalseを返す
+void test_capacity() {
+    SpscRing<std::unique_ptr<int>> ring(3);
+    CHECK(ring.capacity() == 4);
+    for (int i = 0; i < 4; ++i) {
+        auto value = std::make_unique<int>(i);
+        CHECK(ring.try_push(value));
+    }
+    auto extra = std::make_unique<int>(4);
+    CHECK(!ring.try_push(extra));
+    CHECK(extra && *extra == 4);
+    CHECK(ring.size() == 4);
+    std::unique_ptr<int> value;
+    for (int i = 0; i < 4; ++i) {
+        CHECK(ring.try_pop(value) && *value == i);
+    }
+    CHECK(!ring.try_pop(value));
+    CHECK(ring.size() == 0);
+}
+
+// 小さな容量で生産者と消費者が待ち合っても、順番どおりに全て届く
+void test_ordered_transfer() {
+    const int count = 200000;
+    SpscRing<int> ring(4);
+    std::thread producer([&ring] {
+        for (int i = 0; i < count; ++i) {
+            ring.push(i);
+        }
+        ring.close();
+    });
+    int expected = 0;
+    int value;
+    bool ordered = true;
+    while (ring.pop(value)) {
+        ordered = ordered && value == expected;
+        ++expected;
+    }
+    producer.join();
+    CHECK(ordered);
+    CHECK(expected == count);
+}
+
+// close()の後も残りは取り出せ、空になったらpopはfalseを返す
+void test_close_drains() {
+    SpscRing<int> ring(4);
+    ring.push(1);
+    ring.push(2);
+    ring.close();
+    int value = 0;
+    CHECK(ring.pop(value) && value == 1);
+    CHECK(ring.pop(value) && value == 2);
+    CHECK(!ring.pop(value));
+}
+
+// 待っているpop()とpush()はclose()で戻る
+void test_close_wakes() {
+    SpscRing<int> empty(2);
+    std::atomic<bool> popped{true};
+    std::thread consumer([&empty, &popped] {
+        int value;
+        popped = empty.pop(value);
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    empty.close();
+    consumer.join();
+    CHECK(!popped);
+
+    SpscRing<int> full(1);
+    full.push(0);
+    std::atomic<bool> pushed{true};
+    std::thread producer([&full, &pushed] { pushed = full.push(1); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    // 消費者側から閉じる
+    full.close();
+    producer.join();
+    CHECK(!pushed);
+}
+
+void test_pop_for() {
+    SpscRing<int> ring(2);
+    int value = 0;
+    auto start = std::chrono::steady_clock::now();
+    CHECK(!ring.pop_for(value, std::chrono::milliseconds(20)));
+    CHECK(std::chrono::steady_clock::now() - start >=
+          std::chrono::milliseconds(20));
+    std::thread producer([&ring] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        ring.push(7);
+    });
+    CHECK(ring.pop_for(value, std::chrono::seconds(5)) && value == 7);
+    producer.join();
+}
+
+// 条件を変えてnotify()すれば眠っている側が起き、変えなければ時間切れになる
+void test_wait_event() {
+    WaitEvent event;
+    std::atomic<bool> flag{false};
+    CHECK(!event.wait_for([&flag] { return flag.load(); },
+                          std::chrono::milliseconds(10)));
+    std::thread setter([&event, &flag] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        flag = true;
+        event.notify();
+    });
+    auto start = std::chrono::steady_clock::now();
+    CHECK(event.wait_for([&flag] { return flag.load(); },
+                         std::chrono::seconds(5)));
+    CHECK(std::chrono::steady_clock::now() - start < std::chrono::seconds(5));
+    setter.join();
+}
+
+int main() {
+    test_capacity();
+    test_ordered_transfer();
+    test_close_drains();
+    test_close_wakes();
+    test_pop_for();
+    test_wait_event();
+    return test_failures();
+}
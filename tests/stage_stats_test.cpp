@@ -0,0 +1,135 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+#include "check.hpp"
+#include "stage_stats.hpp"
+
+// 8未満の値はそのまま数え、それ以上はバケットの上限を返す。
+// 上限は値の12.5%を超えて離れない
+void test_bucket_bounds() {
+    for (std::uint64_t us = 0; us < (std::uint64_t(1) << 36);
+         us = us < 64 ? us + 1 : us + us / 7) {
+        LatencyHistogram histogram;
+        histogram.record(us);
+        histogram.record(std::uint64_t(1) << 38);
+        std::uint64_t upper = histogram.percentile(0.0);
+        CHECK(upper >= us);
+        CHECK(upper <= us + us / HISTOGRAM_SUB_BUCKETS);
+        if (us < HISTOGRAM_SUB_BUCKETS) {
+            CHECK(upper == us);
+        }
+    }
+}
+
+void test_percentiles() {
+    LatencyHistogram histogram;
+    CHECK(histogram.count() == 0);
+    CHECK(histogram.percentile(0.5) == 0);
+    for (std::uint64_t us = 1; us <= 1000; ++us) {
+        histogram.record(us);
+    }
+    CHECK(histogram.count() == 1000);
+    CHECK(histogram.max() == 1000);
+    std::uint64_t p50 = histogram.percentile(0.5);
+    CHECK(p50 >= 500 && p50 <= 500 + 500 / HISTOGRAM_SUB_BUCKETS);
+    std::uint64_t p90 = histogram.percentile(0.9);
+    CHECK(p90 >= 900 && p90 <= 1000);
+    // 最後のバケットの上限は記録した最大値で抑える
+    CHECK(histogram.percentile(0.999) == 1000);
+    CHECK(histogram.percentile(1.0) == 1000);
+}
+
+// 範囲を超える値は最後のバケットに数える
+void test_overflow() {
+    LatencyHistogram histogram;
+    histogram.record(UINT64_MAX);
+    CHECK(histogram.count() == 1);
+    CHECK(histogram.max() == UINT64_MAX);
+    CHECK(histogram.percentile(0.5) <= UINT64_MAX);
+}
+
+// 接続ごとの記録は全体にも加わり、キューの長さは最大値が伝わる
+void test_parent() {
+    StageStats total("all");
+    StageStats connection("client", &total);
+    connection.record(Stage::Infer, std::chrono::microseconds(100));
+    connection.record(Stage::Total, std::chrono::microseconds(300));
+    // 時計が戻ったときの負の時間は0として数える
+    connection.record(Stage::Total, std::chrono::microseconds(-5));
+    connection.observe(Gauge::InFlight, 3);
+    connection.observe(Gauge::InFlight, 1);
+
+    std::ostringstream child;
+    connection.print(child);
+    CHECK(child.str().find("Latency [client] 2 frames") == 0);
+    CHECK(child.str().find("in_flight 1 (max 3)") != std::string::npos);
+    std::ostringstream all;
+    total.print(all);
+    CHECK(all.str().find("Latency [all] 2 frames") == 0);
+    CHECK(all.str().find("infer") != std::string::npos);
+    CHECK(all.str().find("in_flight (max 3)") != std::string::npos);
+    // 記録の無い段は表示しない
+    CHECK(all.str().find("send") == std::string::npos);
+}
+
+// 閉じた接続は表示から外す
+void test_report() {
+    StageReport report;
+    auto open = report.open("open");
+    report.open("closed");
+    open->record(Stage::Total, std::chrono::microseconds(10));
+    std::ostringstream os;
+    report.print(os);
+    CHECK(os.str().find("Latency [all] 1 frames") == 0);
+    CHECK(os.str().find("[open]") != std::string::npos);
+    CHECK(os.str().find("[closed]") == std::string::npos);
+}
+
+// シグナルは起動したスレッドだけが受け取り、呼び出したスレッドでは止まる
+void test_report_on_signal() {
+    // 起動したスレッドはテストの後も残るので、静的な変数に数える
+    static std::atomic<int> reports{0};
+    report_on_signal(SIGUSR1, [] { ++reports; });
+    sigset_t mask;
+    pthread_sigmask(SIG_BLOCK, nullptr, &mask);
+    CHECK(sigismember(&mask, SIGUSR1) == 1);
+    kill(getpid(), SIGUSR1);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (reports == 0 && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    CHECK(reports == 1);
+}
+
+int main() {
+    test_bucket_bounds();
+    test_percentiles();
+    test_overflow();
+    test_parent();
+    test_report();
+    test_report_on_signal();
+    return test_failures();
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright 2023 Eisuke Okazaki
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "check.hpp"
+#include "trace.hpp"
+
+std::string read_file(const std::string &path) {
+    std::ifstream in(path);
+    std::stringstream ss;
+    ss << in.rdbuf();
+    return ss.str();
+}
+
+// 他のスレッドが記録している最中に書き出しても、記録は止まり、
+// 書き出したJSONは閉じている
+void test_write_while_recording() {
+    std::string path = "trace_test.json";
+    TraceRecorder recorder;
+    recorder.open(path, 64);
+    std::atomic<bool> running{true};
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; ++i) {
+        threads.emplace_back([&recorder, &running, i] {
+            recorder.name_thread("worker" + std::to_string(i));
+            while (running) {
+                auto now = TraceRecorder::Clock::now();
+                recorder.record("work", now, now, i);
+                recorder.record_stage("stage", now, now, i);
+            }
+        });
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    CHECK(recorder.write());
+    CHECK(!recorder.enabled());
+    std::string json = read_file(path);
+    running = false;
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    CHECK(json.find("\"name\":\"work\"") != std::string::npos);
+    CHECK(json.find("thread_name") != std::string::npos);
+    CHECK(json.size() >= 4 && json.compare(json.size() - 4, 4, "\n]}\n") == 0);
+    // 2回目は何もしない
+    CHECK(recorder.write());
+    CHECK(read_file(path) == json);
+    std::remove(path.c_str());
+}
+
+// パスを指定しなければ記録しない
+void test_disabled() {
+    TraceRecorder recorder;
+    recorder.open("", 64);
+    CHECK(!recorder.enabled());
+    auto now = TraceRecorder::Clock::now();
+    recorder.record("work", now, now);
+    CHECK(recorder.write());
+}
+
+int main() {
+    test_write_while_recording();
+    test_disabled();
+    return test_failures();
+}